@@ -0,0 +1,351 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <app/export.h>
+#include <budget_db/budget_db.h>
+#include <error.h>
+#include <log.h>
+
+#define DEFAULT_BUFFER_SIZE (1 << 20)
+/* Room for every field of a row except the description */
+#define MAX_FIXED_ROW_LENGTH 192
+#define MAX_AMOUNT_LENGTH 24
+#define MIN_BUFFER_SIZE (4 * MAX_FIXED_ROW_LENGTH)
+
+#define CSV_HEADER "date,amount,description,payment_type,expense_type\n"
+
+/** @struct output_buffer
+  *
+  * @details
+  *		Rows are formatted straight into data, which is only written to
+  *		fd once it is full
+  */
+struct output_buffer {
+	int fd;
+	export_format format;
+	char* data;
+	size_t used;
+	size_t capacity;
+	size_t rows;
+	size_t bytes_written;
+	size_t writes;
+} typedef output_buffer;
+
+static double elapsed_seconds(const struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int32_t flush_output(output_buffer* out) {
+	size_t written = 0;
+	ssize_t rc;
+
+	while (written < out->used) {
+		rc = write(out->fd, out->data + written, out->used - written);
+		if (-1 == rc) {
+			if (EINTR == errno) {
+				continue;
+			}
+			ERR_LOG("Failed to write export: [%m]");
+			return ERR_KO;
+		}
+
+		written += rc;
+		++out->writes;
+	}
+
+	out->bytes_written += out->used;
+	out->used = 0;
+
+	return ERR_OK;
+}
+
+/* Makes sure len bytes can be formatted without flushing */
+static int32_t reserve_output(output_buffer* out, size_t len) {
+	if (out->capacity - out->used < len) {
+		return flush_output(out);
+	}
+
+	return ERR_OK;
+}
+
+static int32_t append_output(output_buffer* out, const char* data, size_t len) {
+	size_t copied;
+	int32_t rc;
+
+	while (len) {
+		if (out->used == out->capacity) {
+			rc = flush_output(out);
+			if (ERR_OK != rc) {
+				return rc;
+			}
+		}
+
+		copied = out->capacity - out->used;
+		if (copied > len) {
+			copied = len;
+		}
+
+		memcpy(out->data + out->used, data, copied);
+		out->used += copied;
+		data += copied;
+		len -= copied;
+	}
+
+	return ERR_OK;
+}
+
+/* Quotes the field only when it holds a separator, quote or line break */
+static int32_t append_csv_string(output_buffer* out, const char* text) {
+	const char* quote;
+	int32_t rc;
+
+	if (!strpbrk(text, ",\"\r\n")) {
+		return append_output(out, text, strlen(text));
+	}
+
+	rc = append_output(out, "\"", 1);
+
+	/* Each quote is written twice to escape it */
+	while (ERR_OK == rc && NULL != (quote = strchr(text, '"'))) {
+		rc = append_output(out, text, quote - text + 1);
+		if (ERR_OK == rc) {
+			rc = append_output(out, "\"", 1);
+		}
+		text = quote + 1;
+	}
+
+	if (ERR_OK == rc) {
+		rc = append_output(out, text, strlen(text));
+	}
+
+	if (ERR_OK == rc) {
+		rc = append_output(out, "\"", 1);
+	}
+
+	return rc;
+}
+
+static int32_t append_json_string(output_buffer* out, const char* text) {
+	const char* run = text;
+	char escape[8];
+	size_t escape_length;
+	int32_t rc;
+
+	rc = append_output(out, "\"", 1);
+
+	for (; ERR_OK == rc && *text; ++text) {
+		switch (*text) {
+			case '"':
+				escape_length = sprintf(escape, "\\\"");
+				break;
+			case '\\':
+				escape_length = sprintf(escape, "\\\\");
+				break;
+			case '\n':
+				escape_length = sprintf(escape, "\\n");
+				break;
+			case '\r':
+				escape_length = sprintf(escape, "\\r");
+				break;
+			case '\t':
+				escape_length = sprintf(escape, "\\t");
+				break;
+			default:
+				if ((unsigned char)*text >= 0x20) {
+					continue;
+				}
+				escape_length = sprintf(escape, "\\u%04x", (unsigned char)*text);
+				break;
+		}
+
+		/* Characters that need no escaping are copied in runs */
+		rc = append_output(out, run, text - run);
+		if (ERR_OK == rc) {
+			rc = append_output(out, escape, escape_length);
+		}
+		run = text + 1;
+	}
+
+	if (ERR_OK == rc) {
+		rc = append_output(out, run, text - run);
+	}
+
+	if (ERR_OK == rc) {
+		rc = append_output(out, "\"", 1);
+	}
+
+	return rc;
+}
+
+/* Amounts are in cents and written as dollars, e.g. -1205 as -12.05 */
+static void format_amount(char* buffer, size_t size, int64_t amount) {
+	uint64_t magnitude = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+
+	snprintf(buffer, size, "%s%" PRIu64 ".%02" PRIu64,
+		amount < 0 ? "-" : "", magnitude / 100, magnitude % 100);
+}
+
+static int32_t write_csv_row(const expense* expense, void* ctx) {
+	output_buffer* out = (output_buffer*)ctx;
+	char amount[MAX_AMOUNT_LENGTH];
+	int32_t rc;
+
+	rc = reserve_output(out, MAX_FIXED_ROW_LENGTH);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	format_amount(amount, sizeof(amount), expense->amount);
+	out->used += snprintf(out->data + out->used, out->capacity - out->used,
+		"%ld,%s,", (long)expense->date, amount);
+
+	rc = append_csv_string(out, expense->description);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	rc = reserve_output(out, MAX_FIXED_ROW_LENGTH);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	out->used += snprintf(out->data + out->used, out->capacity - out->used,
+		",%u,%u\n", expense->payment_type, expense->expense_type);
+	++out->rows;
+
+	return ERR_OK;
+}
+
+static int32_t write_json_row(const expense* expense, void* ctx) {
+	output_buffer* out = (output_buffer*)ctx;
+	char amount[MAX_AMOUNT_LENGTH];
+	int32_t rc;
+
+	rc = reserve_output(out, MAX_FIXED_ROW_LENGTH);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	format_amount(amount, sizeof(amount), expense->amount);
+	out->used += snprintf(out->data + out->used, out->capacity - out->used,
+		"%s{\"date\":%ld,\"amount\":%s,\"description\":",
+		out->rows ? ",\n" : "\n", (long)expense->date, amount);
+
+	rc = append_json_string(out, expense->description);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	rc = reserve_output(out, MAX_FIXED_ROW_LENGTH);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	out->used += snprintf(out->data + out->used, out->capacity - out->used,
+		",\"payment_type\":%u,\"expense_type\":%u}",
+		expense->payment_type, expense->expense_type);
+	++out->rows;
+
+	return ERR_OK;
+}
+
+int32_t export_expenses(
+	db_connection* db,
+	const export_options* options,
+	export_stats* stats) {
+
+	output_buffer out = {0};
+	struct timespec start;
+	expense_callback write_row;
+	int32_t rc;
+
+	if (!db || !options) {
+		ERR_LOG("DB or options is NULL");
+		return ERR_INVALID;
+	}
+
+	switch (options->format) {
+		case EXPORT_FORMAT_CSV:
+			write_row = write_csv_row;
+			break;
+		case EXPORT_FORMAT_JSON:
+			write_row = write_json_row;
+			break;
+		default:
+			ERR_LOG("Unknown export format [%d]", options->format);
+			return ERR_INVALID;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	out.fd = options->fd;
+	out.format = options->format;
+	out.capacity = options->buffer_size ? options->buffer_size : DEFAULT_BUFFER_SIZE;
+	if (out.capacity < MIN_BUFFER_SIZE) {
+		out.capacity = MIN_BUFFER_SIZE;
+	}
+
+	out.data = (char*)malloc(out.capacity);
+	if (!out.data) {
+		ERR_LOG("Unable to allocate [%zu] byte export buffer", out.capacity);
+		return ERR_NOMEM;
+	}
+
+	NOTICE_LOG("Exporting expenses in date range [%ld:%ld]",
+		(long)options->range.start, (long)options->range.end);
+
+	rc = EXPORT_FORMAT_CSV == out.format ?
+		append_output(&out, CSV_HEADER, strlen(CSV_HEADER)) :
+		append_output(&out, "[", 1);
+	if (ERR_OK != rc) {
+		goto CLEAN_UP;
+	}
+
+	rc = for_each_expense_in_range(db, (date_range*)&options->range, write_row, &out);
+	if (ERR_OK != rc) {
+		ERR_LOG("Export stopped after [%zu] rows", out.rows);
+		goto CLEAN_UP;
+	}
+
+	if (EXPORT_FORMAT_JSON == out.format) {
+		rc = append_output(&out, "\n]\n", 3);
+		if (ERR_OK != rc) {
+			goto CLEAN_UP;
+		}
+	}
+
+	rc = flush_output(&out);
+
+CLEAN_UP:
+
+	if (stats) {
+		stats->rows_exported = out.rows;
+		stats->bytes_written = out.bytes_written;
+		stats->writes = out.writes;
+		stats->elapsed_sec = elapsed_seconds(&start);
+		stats->rows_per_sec = stats->elapsed_sec > 0 ?
+			out.rows / stats->elapsed_sec : 0;
+	}
+
+	NOTICE_LOG("Exported [%zu] rows in [%zu] bytes with [%zu] writes",
+		out.rows, out.bytes_written, out.writes);
+
+	free(out.data);
+
+	return rc;
+}
@@ -0,0 +1,774 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <app/import.h>
+#include <budget_db/budget_db.h>
+#include <error.h>
+#include <log.h>
+
+#define DEFAULT_BATCH_SIZE 10000
+#define QUEUED_BATCHES_PER_THREAD 2
+#define BATCH_TEXT_INITIAL_SIZE 4096
+/* Smaller files are not worth splitting further */
+#define MIN_CHUNK_SIZE (1 << 20)
+#define MAX_FIELD_LENGTH 64
+
+#define MIN_FIELDS 3
+#define MAX_FIELDS 5
+
+#define DATE_FIELD 0
+#define AMOUNT_FIELD 1
+#define DESCRIPTION_FIELD 2
+#define PAYMENT_TYPE_FIELD 3
+#define EXPENSE_TYPE_FIELD 4
+
+/** @struct import_batch
+  *
+  * @details
+  *		Expenses parsed by a worker. Descriptions are stored back to
+  *		back in text and only pointed at once the batch is complete, as
+  *		text may move while it grows.
+  */
+struct import_batch {
+	struct import_batch* next;
+	expense_list list;
+	size_t* description_offsets;
+	char* text;
+	size_t text_used;
+	size_t text_capacity;
+} typedef import_batch;
+
+/** @struct batch_queue
+  *
+  * @details
+  *		Bounded queue of parsed batches between the workers and the
+  *		writer. Workers block while it is full so parsing never runs
+  *		far ahead of inserting.
+  */
+struct batch_queue {
+	import_batch* head;
+	import_batch* tail;
+	size_t num_batches;
+	size_t capacity;
+	size_t running_workers;
+	bool aborted;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} typedef batch_queue;
+
+/** @struct import_chunk
+  *
+  * @details
+  *		Lines of the file parsed by one worker
+  */
+struct import_chunk {
+	const char* file_start;
+	const char* start;
+	const char* end;
+	size_t batch_size;
+	const import_options* options;
+	batch_queue* queue;
+	size_t rows_skipped;
+	int32_t rc;
+	pthread_t thread;
+} typedef import_chunk;
+
+/** @struct csv_field
+  *
+  * @details
+  *		Field of a CSV line. A quoted field excludes the quotes and may
+  *		still contain escaped "" quotes.
+  */
+struct csv_field {
+	const char* start;
+	size_t len;
+	bool quoted;
+} typedef csv_field;
+
+static double elapsed_seconds(const struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void free_batch(import_batch* batch) {
+	if (!batch) {
+		return;
+	}
+
+	free(batch->list.expenses);
+	free(batch->description_offsets);
+	free(batch->text);
+	free(batch);
+}
+
+static import_batch* alloc_batch(size_t batch_size) {
+	import_batch* batch = (import_batch*)calloc(1, sizeof(import_batch));
+
+	if (!batch) {
+		return NULL;
+	}
+
+	batch->list.expenses = (expense*)malloc(sizeof(expense) * batch_size);
+	batch->description_offsets = (size_t*)malloc(sizeof(size_t) * batch_size);
+	batch->text = (char*)malloc(BATCH_TEXT_INITIAL_SIZE);
+	if (!batch->list.expenses || !batch->description_offsets || !batch->text) {
+		free_batch(batch);
+		return NULL;
+	}
+
+	batch->text_capacity = BATCH_TEXT_INITIAL_SIZE;
+
+	return batch;
+}
+
+/* Returns false if the import was aborted and the batch was not queued */
+static bool push_batch(batch_queue* queue, import_batch* batch) {
+	size_t i;
+	bool queued = false;
+
+	for (i = 0; i < batch->list.num_expenses; ++i) {
+		batch->list.expenses[i].description =
+			batch->text + batch->description_offsets[i];
+	}
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->num_batches == queue->capacity && !queue->aborted) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	if (!queue->aborted) {
+		if (queue->tail) {
+			queue->tail->next = batch;
+		}
+		else {
+			queue->head = batch;
+		}
+		queue->tail = batch;
+		++queue->num_batches;
+		queued = true;
+
+		pthread_cond_signal(&queue->not_empty);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return queued;
+}
+
+/* Returns NULL once every worker has finished and the queue is empty */
+static import_batch* pop_batch(batch_queue* queue) {
+	import_batch* batch;
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (!queue->num_batches && queue->running_workers) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	batch = queue->head;
+	if (batch) {
+		queue->head = batch->next;
+		if (!queue->head) {
+			queue->tail = NULL;
+		}
+		--queue->num_batches;
+
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return batch;
+}
+
+static void abort_queue(batch_queue* queue) {
+	pthread_mutex_lock(&queue->lock);
+	queue->aborted = true;
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static size_t split_fields(
+	const char* line,
+	const char* end,
+	csv_field* fields,
+	size_t max_fields) {
+
+	const char* pos = line;
+	csv_field* field;
+	size_t num_fields = 0;
+
+	for (;;) {
+		if (num_fields == max_fields) {
+			return max_fields + 1;
+		}
+
+		field = &fields[num_fields++];
+
+		if (pos < end && '"' == *pos) {
+			field->quoted = true;
+			field->start = ++pos;
+
+			/* "" is an escaped quote, a lone quote closes the field */
+			while (pos < end && !('"' == *pos && (pos + 1 == end || '"' != pos[1]))) {
+				pos += '"' == *pos ? 2 : 1;
+			}
+
+			field->len = pos - field->start;
+
+			while (pos < end && ',' != *pos) {
+				++pos;
+			}
+		}
+		else {
+			field->quoted = false;
+			field->start = pos;
+
+			while (pos < end && ',' != *pos) {
+				++pos;
+			}
+
+			field->len = pos - field->start;
+		}
+
+		if (pos == end) {
+			return num_fields;
+		}
+
+		/* Skip the separator */
+		++pos;
+	}
+}
+
+/* Copies a field without surrounding spaces so it can be parsed */
+static bool copy_field(const csv_field* field, char* buffer) {
+	const char* start = field->start;
+	const char* end = field->start + field->len;
+
+	while (start < end && ' ' == *start) {
+		++start;
+	}
+
+	while (end > start && ' ' == end[-1]) {
+		--end;
+	}
+
+	if (start == end || end - start >= MAX_FIELD_LENGTH) {
+		return false;
+	}
+
+	memcpy(buffer, start, end - start);
+	buffer[end - start] = '\0';
+
+	return true;
+}
+
+/* Reads min_digits to max_digits digits. Unlike %d no sign or space
+ * is taken. Returns NULL if there are too few. */
+static const char* parse_digits(
+	const char* pos,
+	size_t min_digits,
+	size_t max_digits,
+	int* value) {
+
+	size_t num_digits = 0;
+
+	*value = 0;
+	for (; num_digits < max_digits && *pos >= '0' && *pos <= '9'; ++pos, ++num_digits) {
+		*value = *value * 10 + (*pos - '0');
+	}
+
+	return num_digits >= min_digits ? pos : NULL;
+}
+
+bool parse_calendar_date(const char* text, time_t* date) {
+	struct tm day = {0};
+	struct tm check;
+	const char* pos;
+	time_t seconds;
+
+	pos = parse_digits(text, 4, 4, &day.tm_year);
+	if (pos && '-' == *pos) {
+		pos = parse_digits(pos + 1, 1, 2, &day.tm_mon);
+	}
+	if (pos && '-' == *pos) {
+		pos = parse_digits(pos + 1, 1, 2, &day.tm_mday);
+	}
+	if (!pos || '\0' != *pos) {
+		return false;
+	}
+
+	day.tm_year -= 1900;
+	day.tm_mon -= 1;
+	check = day;
+
+	/* timegm normalizes, e.g. February 30th into March */
+	seconds = timegm(&day);
+	if (!gmtime_r(&seconds, &day) ||
+		day.tm_year != check.tm_year ||
+		day.tm_mon != check.tm_mon ||
+		day.tm_mday != check.tm_mday) {
+		return false;
+	}
+
+	*date = seconds;
+
+	return true;
+}
+
+static bool parse_date(const csv_field* field, time_t* date) {
+	char buffer[MAX_FIELD_LENGTH];
+	char* end;
+
+	if (!copy_field(field, buffer)) {
+		return false;
+	}
+
+	if (strchr(buffer + 1, '-')) {
+		return parse_calendar_date(buffer, date);
+	}
+
+	*date = strtoll(buffer, &end, 10);
+
+	return '\0' == *end &&
+		MIN_EXPENSE_DATE <= *date && *date <= MAX_EXPENSE_DATE;
+}
+
+/* Parses a decimal amount such as -12.5 into cents without going
+ * through floating point. Digits past the cents must be zeros. */
+static bool parse_amount(const csv_field* field, int64_t* amount) {
+	char buffer[MAX_FIELD_LENGTH];
+	const char* pos = buffer;
+	bool negative = false;
+	bool has_digits = false;
+	int64_t cents = 0;
+	size_t num_decimals = 0;
+
+	if (!copy_field(field, buffer)) {
+		return false;
+	}
+
+	if ('-' == *pos || '+' == *pos) {
+		negative = '-' == *pos++;
+	}
+
+	for (; *pos >= '0' && *pos <= '9'; ++pos) {
+		if (cents > (INT64_MAX - 9) / 1000) {
+			return false;
+		}
+		cents = cents * 10 + (*pos - '0');
+		has_digits = true;
+	}
+
+	if ('.' == *pos) {
+		for (++pos; *pos >= '0' && *pos <= '9'; ++pos, ++num_decimals) {
+			if (num_decimals < 2) {
+				cents = cents * 10 + (*pos - '0');
+			}
+			else if ('0' != *pos) {
+				return false;
+			}
+			has_digits = true;
+		}
+	}
+
+	for (; num_decimals < 2; ++num_decimals) {
+		cents *= 10;
+	}
+
+	*amount = negative ? -cents : cents;
+
+	return has_digits && '\0' == *pos;
+}
+
+static bool parse_type(const csv_field* field, uint32_t* type) {
+	char buffer[MAX_FIELD_LENGTH];
+	char* end;
+
+	if (!copy_field(field, buffer) || '-' == buffer[0]) {
+		return false;
+	}
+
+	*type = strtoul(buffer, &end, 10);
+
+	return '\0' == *end;
+}
+
+static int32_t append_description(import_batch* batch, const csv_field* field) {
+	size_t needed = batch->text_used + field->len + 1;
+	size_t capacity = batch->text_capacity;
+	char* text;
+	char* out;
+	size_t i;
+
+	if (needed > capacity) {
+		while (needed > capacity) {
+			capacity *= 2;
+		}
+
+		text = (char*)realloc(batch->text, capacity);
+		if (!text) {
+			ERR_LOG("Unable to grow batch text to [%zu] bytes", capacity);
+			return ERR_NOMEM;
+		}
+
+		batch->text = text;
+		batch->text_capacity = capacity;
+	}
+
+	batch->description_offsets[batch->list.num_expenses] = batch->text_used;
+	out = batch->text + batch->text_used;
+
+	for (i = 0; i < field->len; ++i) {
+		*out++ = field->start[i];
+		if (field->quoted && '"' == field->start[i]) {
+			++i;
+		}
+	}
+	*out++ = '\0';
+
+	batch->text_used = out - batch->text;
+
+	return ERR_OK;
+}
+
+static int32_t parse_row(
+	const import_chunk* chunk,
+	const char* line,
+	const char* end,
+	import_batch* batch) {
+
+	csv_field fields[MAX_FIELDS];
+	expense* expense = &batch->list.expenses[batch->list.num_expenses];
+	size_t num_fields = split_fields(line, end, fields, MAX_FIELDS);
+
+	if (num_fields < MIN_FIELDS || num_fields > MAX_FIELDS ||
+		!parse_date(&fields[DATE_FIELD], &expense->date) ||
+		!parse_amount(&fields[AMOUNT_FIELD], &expense->amount)) {
+		return ERR_INVALID;
+	}
+
+	expense->payment_type = chunk->options->payment_type;
+	expense->expense_type = chunk->options->expense_type;
+
+	if (num_fields > PAYMENT_TYPE_FIELD &&
+		!parse_type(&fields[PAYMENT_TYPE_FIELD], &expense->payment_type)) {
+		return ERR_INVALID;
+	}
+
+	if (num_fields > EXPENSE_TYPE_FIELD &&
+		!parse_type(&fields[EXPENSE_TYPE_FIELD], &expense->expense_type)) {
+		return ERR_INVALID;
+	}
+
+	return append_description(batch, &fields[DESCRIPTION_FIELD]);
+}
+
+/* Returns the newline ending the row at pos, or end. A newline inside
+ * a quoted field does not end the row. */
+static const char* find_row_end(const char* pos, const char* end) {
+	const char* newline = (const char*)memchr(pos, '\n', end - pos);
+	bool field_start = true;
+
+	if (!newline) {
+		newline = end;
+	}
+
+	/* Most rows hold no quotes */
+	if (!memchr(pos, '"', newline - pos)) {
+		return newline;
+	}
+
+	for (; pos < end; ++pos) {
+		if ('"' == *pos && field_start) {
+			/* Same rules as split_fields */
+			for (++pos; pos < end && !('"' == *pos && (pos + 1 == end || '"' != pos[1]));) {
+				pos += '"' == *pos ? 2 : 1;
+			}
+
+			field_start = false;
+			if (pos == end) {
+				break;
+			}
+			continue;
+		}
+
+		if ('\n' == *pos) {
+			return pos;
+		}
+
+		field_start = ',' == *pos;
+	}
+
+	return end;
+}
+
+static void* parse_chunk(void* arg) {
+	import_chunk* chunk = (import_chunk*)arg;
+	import_batch* batch = NULL;
+	const char* pos = chunk->start;
+	const char* line_end;
+	const char* next;
+	int32_t rc;
+
+	while (pos < chunk->end) {
+		line_end = find_row_end(pos, chunk->end);
+		next = line_end < chunk->end ? line_end + 1 : chunk->end;
+		if (line_end > pos && '\r' == line_end[-1]) {
+			--line_end;
+		}
+
+		if (line_end == pos) {
+			pos = next;
+			continue;
+		}
+
+		if (!batch) {
+			batch = alloc_batch(chunk->batch_size);
+			if (!batch) {
+				ERR_LOG("Unable to allocate import batch");
+				chunk->rc = ERR_NOMEM;
+				break;
+			}
+		}
+
+		rc = parse_row(chunk, pos, line_end, batch);
+		if (ERR_OK == rc) {
+			++batch->list.num_expenses;
+		}
+		else if (ERR_INVALID == rc) {
+			/* A header line is expected at the start of the file */
+			if (pos != chunk->file_start) {
+				WARN_LOG("Skipping malformed row at byte [%zu]",
+					(size_t)(pos - chunk->file_start));
+				++chunk->rows_skipped;
+			}
+		}
+		else {
+			chunk->rc = rc;
+			break;
+		}
+
+		if (batch->list.num_expenses == chunk->batch_size) {
+			if (!push_batch(chunk->queue, batch)) {
+				break;
+			}
+			batch = NULL;
+		}
+
+		pos = next;
+	}
+
+	if (batch && batch->list.num_expenses && ERR_OK == chunk->rc) {
+		if (push_batch(chunk->queue, batch)) {
+			batch = NULL;
+		}
+	}
+
+	free_batch(batch);
+
+	if (ERR_OK != chunk->rc) {
+		abort_queue(chunk->queue);
+	}
+
+	pthread_mutex_lock(&chunk->queue->lock);
+	--chunk->queue->running_workers;
+	pthread_cond_broadcast(&chunk->queue->not_empty);
+	pthread_mutex_unlock(&chunk->queue->lock);
+
+	return NULL;
+}
+
+static size_t default_num_threads() {
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return num_cpus > 0 ? (size_t)num_cpus : 1;
+}
+
+/* Returns the start of the first row at or after split. Rows are
+ * walked from row, the start of one, since splitting at the next
+ * newline could land inside a quoted field. */
+static const char* next_row(const char* row, const char* split, const char* end) {
+	while (row < split) {
+		row = find_row_end(row, end);
+		if (row < end) {
+			++row;
+		}
+	}
+
+	return row;
+}
+
+int32_t import_csv(
+	db_connection* db,
+	const import_options* options,
+	import_stats* stats) {
+
+	import_chunk* chunks = NULL;
+	import_batch* batch;
+	batch_queue queue = {0};
+	struct timespec start;
+	struct stat st;
+	const char* data = MAP_FAILED;
+	const char* chunk_start;
+	size_t num_threads;
+	size_t num_started = 0;
+	size_t rows_imported = 0;
+	size_t rows_skipped = 0;
+	size_t batches = 0;
+	int32_t rc = ERR_OK;
+	int fd;
+	size_t i;
+
+	if (!db || !options || !options->path) {
+		ERR_LOG("DB, options or path is NULL");
+		return ERR_INVALID;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	fd = open(options->path, O_RDONLY);
+	if (-1 == fd) {
+		ERR_LOG("Unable to open [%s]: [%m]", options->path);
+		return ERR_NOT_FOUND;
+	}
+
+	if (-1 == fstat(fd, &st)) {
+		ERR_LOG("Unable to stat [%s]: [%m]", options->path);
+		close(fd);
+		return ERR_KO;
+	}
+
+	if (!st.st_size) {
+		NOTICE_LOG("[%s] is empty", options->path);
+		close(fd);
+		goto DONE;
+	}
+
+	data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data) {
+		ERR_LOG("Unable to map [%s]: [%m]", options->path);
+		return ERR_NOMEM;
+	}
+
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	num_threads = options->num_threads ? options->num_threads : default_num_threads();
+	if (num_threads > (size_t)st.st_size / MIN_CHUNK_SIZE + 1) {
+		num_threads = st.st_size / MIN_CHUNK_SIZE + 1;
+	}
+
+	chunks = (import_chunk*)calloc(num_threads, sizeof(import_chunk));
+	if (!chunks) {
+		ERR_LOG("Unable to allocate [%zu] import chunks", num_threads);
+		rc = ERR_NOMEM;
+		goto CLEAN_UP;
+	}
+
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.not_empty, NULL);
+	pthread_cond_init(&queue.not_full, NULL);
+	queue.capacity = num_threads * QUEUED_BATCHES_PER_THREAD;
+	queue.running_workers = num_threads;
+
+	NOTICE_LOG("Importing [%s] ([%ld] bytes) with [%zu] parser threads",
+		options->path, (long)st.st_size, num_threads);
+
+	chunk_start = data;
+	for (i = 0; i < num_threads; ++i) {
+		chunks[i].file_start = data;
+		chunks[i].start = chunk_start;
+		chunks[i].end = i + 1 == num_threads ?
+			data + st.st_size :
+			next_row(chunk_start, data + st.st_size * (i + 1) / num_threads,
+				data + st.st_size);
+		chunks[i].batch_size = options->batch_size ?
+			options->batch_size : DEFAULT_BATCH_SIZE;
+		chunks[i].options = options;
+		chunks[i].queue = &queue;
+		chunk_start = chunks[i].end;
+
+		if (0 != pthread_create(&chunks[i].thread, NULL, parse_chunk, &chunks[i])) {
+			ERR_LOG("Unable to start import thread [%zu]", i);
+			rc = ERR_KO;
+			abort_queue(&queue);
+
+			/* Workers that never started will not finish */
+			pthread_mutex_lock(&queue.lock);
+			queue.running_workers -= num_threads - i;
+			pthread_cond_broadcast(&queue.not_empty);
+			pthread_mutex_unlock(&queue.lock);
+			break;
+		}
+		++num_started;
+	}
+
+	/* The calling thread is the single writer */
+	while (NULL != (batch = pop_batch(&queue))) {
+		if (ERR_OK == rc) {
+			rc = insert_expenses_bulk(db, &batch->list, NULL, NULL);
+			if (ERR_OK != rc) {
+				ERR_LOG("Failed to insert import batch");
+				abort_queue(&queue);
+			}
+			else {
+				rows_imported += batch->list.num_expenses;
+				++batches;
+			}
+		}
+
+		free_batch(batch);
+	}
+
+	for (i = 0; i < num_started; ++i) {
+		pthread_join(chunks[i].thread, NULL);
+		rows_skipped += chunks[i].rows_skipped;
+		if (ERR_OK == rc) {
+			rc = chunks[i].rc;
+		}
+	}
+
+	pthread_cond_destroy(&queue.not_full);
+	pthread_cond_destroy(&queue.not_empty);
+	pthread_mutex_destroy(&queue.lock);
+
+CLEAN_UP:
+
+	free(chunks);
+	munmap((void*)data, st.st_size);
+
+DONE:
+
+	if (stats) {
+		stats->rows_imported = rows_imported;
+		stats->rows_skipped = rows_skipped;
+		stats->batches = batches;
+		stats->elapsed_sec = elapsed_seconds(&start);
+		stats->rows_per_sec = stats->elapsed_sec > 0 ?
+			rows_imported / stats->elapsed_sec : 0;
+	}
+
+	NOTICE_LOG("Imported [%zu] rows in [%zu] batches, skipped [%zu] rows",
+		rows_imported, batches, rows_skipped);
+
+	return rc;
+}
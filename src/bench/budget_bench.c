@@ -0,0 +1,470 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sqlite3.h>
+
+#include <budget_db/budget_db.h>
+#include <sql/sql_db.h>
+#include <error.h>
+#include <log.h>
+
+#define BENCH_NAME "budget_bench"
+#define DEFAULT_DB_DIR "/tmp/budget_bench"
+#define DB_FILE "budget.db"
+#define MAX_PATH_LENGTH 4096
+
+#define DEFAULT_NUM_ROWS 10000
+#define DEFAULT_NUM_QUERIES 1000
+#define DEFAULT_BATCH_SIZE 10000
+
+/* Rows are generated and inserted a chunk at a time to bound memory */
+#define CHUNK_ROWS 100000
+
+#define SECONDS_IN_A_DAY 86400
+#define DATASET_DAYS (10 * 365)
+/* 2010-01-01T00:00:00Z */
+#define DATASET_START 1262304000
+
+#define NUM_PAYMENT_TYPES 5
+#define NUM_EXPENSE_TYPES 12
+
+#define NS_PER_SEC 1000000000L
+
+static const char* DESCRIPTIONS[] = {
+	"Groceries",
+	"Fuel",
+	"Rent",
+	"Restaurant",
+	"Electricity bill",
+	"Pharmacy",
+	"Streaming subscription",
+	"Hardware store"
+};
+
+#define NUM_DESCRIPTIONS (sizeof(DESCRIPTIONS) / sizeof(DESCRIPTIONS[0]))
+
+/** @struct bench_config
+  *
+  * @details
+  *		Benchmark settings parsed from the command line
+  */
+struct bench_config {
+	size_t num_rows;
+	size_t num_queries;
+	size_t batch_size;
+	size_t range_days;
+	const char* db_dir;
+	const db_options* options;
+	const char* options_name;
+	bool query_stats;
+} typedef bench_config;
+
+/** @struct latency_stats
+  *
+  * @details
+  *		Latency percentiles of one query type in nanoseconds
+  */
+struct latency_stats {
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+	double mean;
+	double mean_rows;
+} typedef latency_stats;
+
+typedef int32_t (*range_query)(
+	db_connection* db,
+	date_range* range,
+	uint32_t type,
+	expense_list* expenses);
+
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+/* xorshift64* so every run inserts the same dataset */
+static uint64_t next_random() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t now_ns() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+static int32_t parse_count(const char* arg, size_t* count) {
+	char* end = NULL;
+	unsigned long long value = strtoull(arg, &end, 10);
+
+	if (end == arg) {
+		return ERR_INVALID;
+	}
+
+	if (!strcasecmp(end, "k")) {
+		value *= 1000;
+	}
+	else if (!strcasecmp(end, "m")) {
+		value *= 1000000;
+	}
+	else if (*end) {
+		return ERR_INVALID;
+	}
+
+	if (!value) {
+		return ERR_INVALID;
+	}
+
+	*count = value;
+
+	return ERR_OK;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"Usage: " BENCH_NAME " [-n rows] [-q queries] [-b batch_size] "
+		"[-r range_days] [-d db_dir] [-p default|high_throughput] [-s]\n"
+		"  rows accepts a k or m suffix, e.g. 10k, 1m or 10m\n"
+		"  -s adds per query statistics to the output\n");
+}
+
+static int32_t parse_args(int argc, char** argv, bench_config* config) {
+	int opt;
+
+	config->num_rows = DEFAULT_NUM_ROWS;
+	config->num_queries = DEFAULT_NUM_QUERIES;
+	config->batch_size = DEFAULT_BATCH_SIZE;
+	config->range_days = 30;
+	config->db_dir = DEFAULT_DB_DIR;
+	config->options = &DB_OPTIONS_DEFAULT;
+	config->options_name = "default";
+	config->query_stats = false;
+
+	while (-1 != (opt = getopt(argc, argv, "n:q:b:r:d:p:sh"))) {
+		switch (opt) {
+			case 'n':
+				if (ERR_OK != parse_count(optarg, &config->num_rows)) {
+					return ERR_INVALID;
+				}
+				break;
+			case 'q':
+				if (ERR_OK != parse_count(optarg, &config->num_queries)) {
+					return ERR_INVALID;
+				}
+				break;
+			case 'b':
+				if (ERR_OK != parse_count(optarg, &config->batch_size)) {
+					return ERR_INVALID;
+				}
+				break;
+			case 'r':
+				if (ERR_OK != parse_count(optarg, &config->range_days)) {
+					return ERR_INVALID;
+				}
+				break;
+			case 'd':
+				config->db_dir = optarg;
+				break;
+			case 'p':
+				if (!strcmp(optarg, "default")) {
+					config->options = &DB_OPTIONS_DEFAULT;
+				}
+				else if (!strcmp(optarg, "high_throughput")) {
+					config->options = &DB_OPTIONS_HIGH_THROUGHPUT;
+				}
+				else {
+					return ERR_INVALID;
+				}
+				config->options_name = optarg;
+				break;
+			case 's':
+				config->query_stats = true;
+				break;
+			default:
+				return ERR_INVALID;
+		}
+	}
+
+	return ERR_OK;
+}
+
+static void remove_db_files(const char* db_dir) {
+	static const char* SUFFIXES[] = { "", "-wal", "-shm", "-journal" };
+	char path[MAX_PATH_LENGTH];
+	size_t i;
+
+	for (i = 0; i < sizeof(SUFFIXES) / sizeof(SUFFIXES[0]); ++i) {
+		snprintf(path, sizeof(path), "%s/" DB_FILE "%s", db_dir, SUFFIXES[i]);
+		unlink(path);
+	}
+}
+
+static void generate_expenses(expense* expenses, size_t num_expenses) {
+	size_t i;
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses[i].amount = next_random() % 100000;
+		expenses[i].date = DATASET_START +
+			next_random() % ((uint64_t)DATASET_DAYS * SECONDS_IN_A_DAY);
+		expenses[i].payment_type = next_random() % NUM_PAYMENT_TYPES;
+		expenses[i].expense_type = next_random() % NUM_EXPENSE_TYPES;
+		expenses[i].description =
+			(char*)DESCRIPTIONS[next_random() % NUM_DESCRIPTIONS];
+	}
+}
+
+static int32_t bench_insert(
+	db_connection* db,
+	const bench_config* config,
+	bulk_insert_stats* total) {
+
+	bulk_insert_options options = { .batch_size = config->batch_size };
+	bulk_insert_stats stats;
+	expense_list expenses = {0};
+	size_t remaining = config->num_rows;
+	uint64_t start;
+	int32_t rc = ERR_OK;
+
+	expenses.expenses = (expense*)malloc(sizeof(expense) * CHUNK_ROWS);
+	if (!expenses.expenses) {
+		ERR_LOG("Unable to allocate [%d] expenses", CHUNK_ROWS);
+		return ERR_NOMEM;
+	}
+
+	memset(total, 0, sizeof(bulk_insert_stats));
+
+	start = now_ns();
+
+	while (remaining) {
+		expenses.num_expenses = remaining < CHUNK_ROWS ? remaining : CHUNK_ROWS;
+		generate_expenses(expenses.expenses, expenses.num_expenses);
+
+		rc = insert_expenses_bulk(db, &expenses, &options, &stats);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to insert expenses");
+			break;
+		}
+
+		total->rows_inserted += stats.rows_inserted;
+		total->batches_committed += stats.batches_committed;
+		total->elapsed_sec += stats.elapsed_sec;
+		remaining -= expenses.num_expenses;
+	}
+
+	free(expenses.expenses);
+
+	if (ERR_OK == rc) {
+		/* Includes generating the rows, rows_per_sec does not */
+		double wall_sec = (now_ns() - start) / (double)NS_PER_SEC;
+
+		total->rows_per_sec = total->elapsed_sec > 0 ?
+			total->rows_inserted / total->elapsed_sec : 0;
+
+		NOTICE_LOG("Inserted [%zu] rows in [%f]s", total->rows_inserted, wall_sec);
+	}
+
+	return rc;
+}
+
+static int32_t query_in_range(
+	db_connection* db,
+	date_range* range,
+	uint32_t type,
+	expense_list* expenses) {
+
+	(void)type;
+
+	return get_expenses_in_range(db, range, expenses);
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t lhs = *(const uint64_t*)a;
+	uint64_t rhs = *(const uint64_t*)b;
+
+	return lhs < rhs ? -1 : lhs > rhs;
+}
+
+static uint64_t percentile(const uint64_t* sorted, size_t count, double pct) {
+	size_t index = (size_t)(pct * (count - 1) + 0.5);
+
+	return sorted[index];
+}
+
+static int32_t bench_query(
+	db_connection* db,
+	const bench_config* config,
+	range_query query,
+	uint32_t num_types,
+	latency_stats* stats) {
+
+	uint64_t* latencies;
+	uint64_t start;
+	uint64_t total_ns = 0;
+	size_t total_rows = 0;
+	uint64_t range_sec = (uint64_t)config->range_days * SECONDS_IN_A_DAY;
+	uint64_t span_sec = (uint64_t)DATASET_DAYS * SECONDS_IN_A_DAY;
+	expense_list expenses = {0};
+	date_range range;
+	int32_t rc = ERR_OK;
+	size_t i;
+
+	latencies = (uint64_t*)malloc(sizeof(uint64_t) * config->num_queries);
+	if (!latencies) {
+		ERR_LOG("Unable to allocate [%zu] latencies", config->num_queries);
+		return ERR_NOMEM;
+	}
+
+	for (i = 0; i < config->num_queries; ++i) {
+		range.start = DATASET_START +
+			(range_sec < span_sec ? next_random() % (span_sec - range_sec) : 0);
+		range.end = range.start + range_sec;
+
+		start = now_ns();
+		rc = query(db, &range, next_random() % num_types, &expenses);
+		latencies[i] = now_ns() - start;
+
+		if (ERR_OK != rc) {
+			ERR_LOG("Query [%zu] failed", i);
+			goto CLEAN_UP;
+		}
+
+		total_ns += latencies[i];
+		total_rows += expenses.num_expenses;
+		free_expenses(&expenses);
+	}
+
+	qsort(latencies, config->num_queries, sizeof(uint64_t), compare_u64);
+
+	stats->p50 = percentile(latencies, config->num_queries, 0.50);
+	stats->p90 = percentile(latencies, config->num_queries, 0.90);
+	stats->p99 = percentile(latencies, config->num_queries, 0.99);
+	stats->max = latencies[config->num_queries - 1];
+	stats->mean = (double)total_ns / config->num_queries;
+	stats->mean_rows = (double)total_rows / config->num_queries;
+
+CLEAN_UP:
+
+	free(latencies);
+
+	return rc;
+}
+
+static void print_latency(const char* name, const latency_stats* stats, bool last) {
+	printf("    \"%s\": {\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, "
+		"\"max_ns\": %lu, \"mean_ns\": %.0f, \"mean_rows\": %.1f}%s\n",
+		name,
+		stats->p50,
+		stats->p90,
+		stats->p99,
+		stats->max,
+		stats->mean,
+		stats->mean_rows,
+		last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+	bench_config config;
+	db_connection db = {0};
+	bulk_insert_stats insert_stats;
+	latency_stats range_stats = {0};
+	latency_stats payment_stats = {0};
+	latency_stats expense_stats = {0};
+	struct rusage usage_stats;
+	int32_t rc;
+
+	if (ERR_OK != parse_args(argc, argv, &config)) {
+		usage();
+		return 1;
+	}
+
+	open_log(BENCH_NAME);
+	set_log_level(LOG_WARNING);
+
+	remove_db_files(config.db_dir);
+
+	db.db_path = (char*)config.db_dir;
+	db.options = config.options;
+	db.collect_stats = config.query_stats;
+	rc = open_budget_db(&db);
+	if (ERR_OK != rc) {
+		fprintf(stderr, "Failed to open [%s]: [%s]\n",
+			config.db_dir, error_to_string(rc));
+		close_log();
+		return 1;
+	}
+
+	rc = bench_insert(&db, &config, &insert_stats);
+	if (ERR_OK != rc) {
+		fprintf(stderr, "Insert failed: [%s]\n", error_to_string(rc));
+		goto CLEAN_UP;
+	}
+
+	rc = bench_query(&db, &config, query_in_range, 1, &range_stats);
+	if (ERR_OK == rc) {
+		rc = bench_query(&db, &config,
+			get_expenses_in_range_with_payment_type,
+			NUM_PAYMENT_TYPES, &payment_stats);
+	}
+	if (ERR_OK == rc) {
+		rc = bench_query(&db, &config,
+			get_expenses_in_range_with_expense_type,
+			NUM_EXPENSE_TYPES, &expense_stats);
+	}
+	if (ERR_OK != rc) {
+		fprintf(stderr, "Query failed: [%s]\n", error_to_string(rc));
+		goto CLEAN_UP;
+	}
+
+	getrusage(RUSAGE_SELF, &usage_stats);
+
+	printf("{\n");
+	printf("  \"sqlite_version\": \"%s\",\n", sqlite3_libversion());
+	printf("  \"options\": \"%s\",\n", config.options_name);
+	printf("  \"rows\": %zu,\n", config.num_rows);
+	printf("  \"batch_size\": %zu,\n", config.batch_size);
+	printf("  \"insert\": {\"rows\": %zu, \"batches\": %zu, "
+		"\"elapsed_sec\": %.6f, \"rows_per_sec\": %.0f},\n",
+		insert_stats.rows_inserted,
+		insert_stats.batches_committed,
+		insert_stats.elapsed_sec,
+		insert_stats.rows_per_sec);
+	printf("  \"queries\": %zu,\n", config.num_queries);
+	printf("  \"range_days\": %zu,\n", config.range_days);
+	printf("  \"query_latency\": {\n");
+	print_latency("get_expenses_in_range", &range_stats, false);
+	print_latency("get_expenses_in_range_with_payment_type", &payment_stats, false);
+	print_latency("get_expenses_in_range_with_expense_type", &expense_stats, true);
+	printf("  },\n");
+	printf("  \"memory\": {\"max_rss_kb\": %ld, \"sqlite_highwater_bytes\": %lld}%s\n",
+		usage_stats.ru_maxrss,
+		(long long)sqlite3_memory_highwater(0),
+		config.query_stats ? "," : "");
+	if (config.query_stats) {
+		printf("  \"query_stats\": ");
+		fflush(stdout);
+		dump_query_stats(&db, stdout);
+	}
+	printf("}\n");
+
+CLEAN_UP:
+
+	close_budget_db(&db);
+	remove_db_files(config.db_dir);
+	close_log();
+
+	return ERR_OK == rc ? 0 : 1;
+}
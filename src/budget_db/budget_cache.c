@@ -0,0 +1,471 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <budget_db/budget_db.h>
+#include <budget_db/budget_cache.h>
+#include <sql/sql_db.h>
+#include <error.h>
+#include <log.h>
+
+#define DEFAULT_CACHE_CAPACITY 128
+#define DEFAULT_CACHE_MAX_BYTES (64 << 20)
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/** @struct result_cache_entry
+  *
+  * @details
+  *		Cached result, chained in its bucket and linked from newest to
+  *		oldest use
+  */
+struct result_cache_entry {
+	struct result_cache_entry* next_in_bucket;
+	struct result_cache_entry* newer;
+	struct result_cache_entry* older;
+	uint64_t hash;
+	char* key;
+	size_t key_length;
+	uint64_t generation;
+	void* rows;
+	size_t num_rows;
+	size_t row_size;
+	size_t size;
+} typedef result_cache_entry;
+
+static uint64_t hash_key(const char* key, size_t key_length) {
+	uint64_t hash = FNV_OFFSET_BASIS;
+	size_t i;
+
+	for (i = 0; i < key_length; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+int32_t open_result_cache(result_cache* cache, size_t capacity, size_t max_bytes) {
+	if (!cache) {
+		ERR_LOG("Result cache is NULL");
+		return ERR_INVALID;
+	}
+
+	memset(cache, 0, sizeof(result_cache));
+
+	cache->capacity = capacity ? capacity : DEFAULT_CACHE_CAPACITY;
+	cache->max_bytes = max_bytes ? max_bytes : DEFAULT_CACHE_MAX_BYTES;
+
+	/* At most half full so chains stay short */
+	cache->num_buckets = 1;
+	while (cache->num_buckets < cache->capacity * 2) {
+		cache->num_buckets <<= 1;
+	}
+
+	cache->buckets = (result_cache_entry**)calloc(
+		cache->num_buckets, sizeof(result_cache_entry*));
+	if (!cache->buckets) {
+		ERR_LOG("Unable to allocate [%zu] result cache buckets", cache->num_buckets);
+		return ERR_NOMEM;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+
+	DEBUG_LOG("Opened result cache of [%zu] results, [%zu] bytes",
+		cache->capacity, cache->max_bytes);
+
+	return ERR_OK;
+}
+
+static void free_entry(result_cache_entry* entry) {
+	free(entry->key);
+	free(entry->rows);
+	free(entry);
+}
+
+void close_result_cache(result_cache* cache) {
+	result_cache_entry* entry;
+	result_cache_entry* older;
+
+	if (!cache || !cache->buckets) {
+		return;
+	}
+
+	NOTICE_LOG("Closing result cache [%lu hits, %lu misses, %lu evictions]",
+		cache->hits, cache->misses, cache->evictions);
+
+	for (entry = cache->newest; entry; entry = older) {
+		older = entry->older;
+		free_entry(entry);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	memset(cache, 0, sizeof(result_cache));
+}
+
+void invalidate_result_cache(result_cache* cache) {
+	if (!cache || !cache->buckets) {
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	++cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static uint64_t result_cache_generation(result_cache* cache) {
+	uint64_t generation;
+
+	pthread_mutex_lock(&cache->lock);
+	generation = cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+
+	return generation;
+}
+
+static const char* param_text(const db_value* value) {
+	return value->value.string_val ? value->value.string_val : "";
+}
+
+/* Serializes the statement text and parameter values of query */
+static int32_t build_cache_key(const db_query* query, char** key, size_t* key_length) {
+	size_t query_length = strlen(query->query) + 1;
+	size_t length = query_length;
+	const db_value* value;
+	db_value copy;
+	char* pos;
+	size_t i;
+
+	for (i = 0; i < query->num_params; ++i) {
+		value = &query->params[i].param;
+		length += 1 + (TEXT == value->type || STATIC_TEXT == value->type ?
+			strlen(param_text(value)) + 1 : sizeof(value->value));
+	}
+
+	*key = (char*)malloc(length);
+	if (!*key) {
+		ERR_LOG("Unable to allocate [%zu] byte cache key", length);
+		return ERR_NOMEM;
+	}
+
+	memcpy(*key, query->query, query_length);
+	pos = *key + query_length;
+
+	/* Values are prefixed with their type so e.g. 1 and 1.0 differ */
+	for (i = 0; i < query->num_params; ++i) {
+		value = &query->params[i].param;
+		*pos++ = (char)value->type;
+
+		if (TEXT == value->type || STATIC_TEXT == value->type) {
+			length = strlen(param_text(value)) + 1;
+			memcpy(pos, param_text(value), length);
+			pos += length;
+			continue;
+		}
+
+		/* Zeroed so the bytes an int leaves unused compare equal */
+		memset(&copy, 0, sizeof(copy));
+		if (DOUBLE == value->type) {
+			copy.value.double_val = value->value.double_val;
+		}
+		else if (INT64 == value->type) {
+			copy.value.int64_val = value->value.int64_val;
+		}
+		else {
+			copy.value.int_val = value->value.int_val;
+		}
+
+		memcpy(pos, &copy.value, sizeof(copy.value));
+		pos += sizeof(copy.value);
+	}
+
+	*key_length = pos - *key;
+
+	return ERR_OK;
+}
+
+static result_cache_entry** find_entry(
+	result_cache* cache,
+	const char* key,
+	size_t key_length,
+	uint64_t hash) {
+
+	result_cache_entry** link = &cache->buckets[hash & (cache->num_buckets - 1)];
+
+	while (*link &&
+		((*link)->hash != hash ||
+		(*link)->key_length != key_length ||
+		memcmp((*link)->key, key, key_length))) {
+
+		link = &(*link)->next_in_bucket;
+	}
+
+	return link;
+}
+
+static void unlink_lru(result_cache* cache, result_cache_entry* entry) {
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	}
+	else {
+		cache->newest = entry->older;
+	}
+
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	}
+	else {
+		cache->oldest = entry->newer;
+	}
+
+	entry->newer = NULL;
+	entry->older = NULL;
+}
+
+static void push_newest(result_cache* cache, result_cache_entry* entry) {
+	entry->older = cache->newest;
+	entry->newer = NULL;
+
+	if (cache->newest) {
+		cache->newest->newer = entry;
+	}
+	else {
+		cache->oldest = entry;
+	}
+
+	cache->newest = entry;
+}
+
+/* link points at the entry in its bucket */
+static void remove_entry(result_cache* cache, result_cache_entry** link) {
+	result_cache_entry* entry = *link;
+
+	*link = entry->next_in_bucket;
+	unlink_lru(cache, entry);
+
+	--cache->num_entries;
+	cache->num_bytes -= entry->size;
+
+	free_entry(entry);
+}
+
+static void evict_oldest(result_cache* cache) {
+	result_cache_entry* oldest = cache->oldest;
+
+	remove_entry(cache, find_entry(cache, oldest->key, oldest->key_length, oldest->hash));
+	++cache->evictions;
+}
+
+static int32_t copy_flat_rows(
+	const void* packed,
+	size_t num_rows,
+	size_t row_size,
+	void** rows) {
+
+	*rows = NULL;
+	if (!num_rows) {
+		return ERR_OK;
+	}
+
+	*rows = malloc(row_size * num_rows);
+	if (!*rows) {
+		ERR_LOG("Unable to copy [%zu] cached rows", num_rows);
+		return ERR_NOMEM;
+	}
+
+	memcpy(*rows, packed, row_size * num_rows);
+
+	return ERR_OK;
+}
+
+/* Copies the rows cached under key if they are from the current
+ * generation. Returns ERR_NOT_FOUND on a miss. */
+static int32_t lookup_cached_rows(
+	result_cache* cache,
+	const char* key,
+	size_t key_length,
+	const cached_row_ops* ops,
+	void** rows,
+	size_t* num_rows) {
+
+	result_cache_entry** link;
+	result_cache_entry* entry;
+	int32_t rc = ERR_NOT_FOUND;
+
+	pthread_mutex_lock(&cache->lock);
+
+	link = find_entry(cache, key, key_length, hash_key(key, key_length));
+	entry = *link;
+
+	if (entry && entry->generation != cache->generation) {
+		remove_entry(cache, link);
+	}
+	else if (entry) {
+		rc = ops ?
+			ops->copy(entry->rows, entry->num_rows, rows) :
+			copy_flat_rows(entry->rows, entry->num_rows, entry->row_size, rows);
+		if (ERR_OK == rc) {
+			*num_rows = entry->num_rows;
+
+			unlink_lru(cache, entry);
+			push_newest(cache, entry);
+		}
+	}
+
+	if (ERR_OK == rc) {
+		++cache->hits;
+	}
+	else {
+		++cache->misses;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return rc;
+}
+
+/* Caches rows under key, evicting the least recently used results to
+ * make room. Ownership of key and rows, a single allocation of size
+ * bytes, passes to the cache. */
+static void store_cached_rows(
+	result_cache* cache,
+	char* key,
+	size_t key_length,
+	uint64_t generation,
+	void* rows,
+	size_t num_rows,
+	size_t row_size,
+	size_t size) {
+
+	result_cache_entry** link;
+	result_cache_entry* entry;
+	uint64_t hash = hash_key(key, key_length);
+
+	size += key_length + sizeof(result_cache_entry);
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* A write may have happened while the rows were read */
+	if (generation != cache->generation || size > cache->max_bytes) {
+		goto CLEAN_UP;
+	}
+
+	link = find_entry(cache, key, key_length, hash);
+	if (*link) {
+		remove_entry(cache, link);
+	}
+
+	entry = (result_cache_entry*)calloc(1, sizeof(result_cache_entry));
+	if (!entry) {
+		WARN_LOG("Unable to allocate result cache entry");
+		goto CLEAN_UP;
+	}
+
+	while (cache->num_entries &&
+		(cache->num_entries >= cache->capacity ||
+		cache->num_bytes + size > cache->max_bytes)) {
+
+		evict_oldest(cache);
+	}
+
+	entry->hash = hash;
+	entry->key = key;
+	entry->key_length = key_length;
+	entry->generation = generation;
+	entry->rows = rows;
+	entry->num_rows = num_rows;
+	entry->row_size = row_size;
+	entry->size = size;
+
+	link = &cache->buckets[hash & (cache->num_buckets - 1)];
+	entry->next_in_bucket = *link;
+	*link = entry;
+	push_newest(cache, entry);
+
+	++cache->num_entries;
+	cache->num_bytes += size;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return;
+
+CLEAN_UP:
+
+	pthread_mutex_unlock(&cache->lock);
+
+	free(key);
+	free(rows);
+}
+
+int32_t execute_cached_query(
+	db_query* query,
+	db_row_mapper mapper,
+	size_t row_size,
+	const cached_row_ops* ops,
+	void** rows,
+	size_t* num_rows) {
+
+	result_cache* cache = query && query->connection ?
+		query->connection->result_cache : NULL;
+	uint64_t generation;
+	bool changed;
+	char* key;
+	size_t key_length;
+	void* packed;
+	size_t size;
+	int32_t rc;
+
+	if (!cache || !cache->buckets ||
+		ERR_OK != check_db_changed(query->connection, &changed)) {
+
+		return execute_mapped_query(query, mapper, row_size, NULL, rows, num_rows);
+	}
+
+	/* Also catches writes made without going through budget_db */
+	if (changed) {
+		invalidate_result_cache(cache);
+	}
+
+	if (ERR_OK != build_cache_key(query, &key, &key_length)) {
+		return execute_mapped_query(query, mapper, row_size, NULL, rows, num_rows);
+	}
+
+	if (ERR_OK == lookup_cached_rows(cache, key, key_length, ops, rows, num_rows)) {
+		DEBUG_LOG("Served [%zu] rows of [%s] from the result cache",
+			*num_rows, query->query);
+		free(key);
+		return ERR_OK;
+	}
+
+	/* Taken before reading so rows older than a concurrent write are
+	 * not stored */
+	generation = result_cache_generation(cache);
+
+	rc = execute_mapped_query(query, mapper, row_size, NULL, rows, num_rows);
+	if (ERR_OK != rc) {
+		free(key);
+		return rc;
+	}
+
+	packed = NULL;
+	size = row_size * *num_rows;
+	rc = ops ?
+		ops->pack(*rows, *num_rows, &packed, &size) :
+		copy_flat_rows(*rows, *num_rows, row_size, &packed);
+	if (ERR_OK != rc) {
+		/* The rows were still read */
+		WARN_LOG("Unable to cache [%zu] rows of [%s]", *num_rows, query->query);
+		free(key);
+		return ERR_OK;
+	}
+
+	store_cached_rows(cache, key, key_length, generation, packed, *num_rows, row_size, size);
+
+	return ERR_OK;
+}
@@ -5,48 +5,438 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sqlite3.h>
 
 #include <budget_db/budget_db.h>
 #include <budget_db/budget_db_queries.h>
+#include <budget_db/budget_cache.h>
 #include <sql/sql_db.h>
 #include <error.h>
 #include <log.h>
 
-static void result_to_expense(db_query_result* restrict result, expense_list* restrict expenses) {
+#define MAX_SCHEMA_VERSION_QUERY_LENGTH 64
+#define CURRENT_SCHEMA_VERSION 5
+
+/* Must be a power of two */
+#define ROLLUP_INITIAL_CAPACITY 64
+
+/* Longest filter query without its type sets, and room per type */
+#define MAX_FILTER_QUERY_LENGTH 256
+#define FILTER_TYPE_LENGTH 2
+#define MAX_BOUND_PARAMS 4
+#define MAX_PAGE_PARAMS 3
+#define MAX_FILTER_TYPES 256
+
+/** @struct monthly_rollup
+  *
+  * @details
+  *		Monthly totals accumulated for the current insert batch, keyed
+  *		by (year_month, expense_type, payment_type) with open
+  *		addressing. A slot with a count of zero is empty. The bounds of
+  *		the last month seen are kept so consecutive dates in the same
+  *		month skip the calendar conversion.
+  */
+struct monthly_rollup {
+	monthly_total* totals;
+	size_t capacity;
+	size_t num_totals;
+	time_t month_start;
+	time_t month_end;
+	int32_t year_month;
+} typedef monthly_rollup;
+
+/** @struct filter_query
+  *
+  * @details
+  *		Statement text and parameters built from an expense_filter.
+  *		overflow is set once the text or parameters would not fit.
+  */
+struct filter_query {
+	db_query query;
+	size_t max_params;
+	char* sql;
+	size_t sql_length;
+	size_t sql_capacity;
+	bool overflow;
+} typedef filter_query;
+
+/** @struct schema_migration
+  *
+  * @details
+  *		Statements that move the schema to version. Migrations are
+  *		applied in order to any database whose user_version is older.
+  */
+struct schema_migration {
+	int32_t version;
+	const char* const* statements;
+} typedef schema_migration;
+
+static const char* const CREATE_EXPENSES_STATEMENTS[] = {
+	CREATE_EXPENSES_TABLE,
+	NULL
+};
+
+static const char* const CREATE_INDEX_STATEMENTS[] = {
+	CREATE_DATE_INDEX,
+	CREATE_PAYMENT_TYPE_DATE_INDEX,
+	CREATE_EXPENSE_TYPE_DATE_INDEX,
+	NULL
+};
+
+static const char* const ROWID_ALIAS_STATEMENTS[] = {
+	CREATE_EXPENSES_ROWID_TABLE,
+	COPY_EXPENSES_TO_ROWID_TABLE,
+	DROP_EXPENSES_TABLE,
+	RENAME_EXPENSES_ROWID_TABLE,
+	CREATE_DATE_INDEX,
+	CREATE_PAYMENT_TYPE_DATE_INDEX,
+	CREATE_EXPENSE_TYPE_DATE_INDEX,
+	NULL
+};
+
+static const char* const MONTHLY_TOTALS_STATEMENTS[] = {
+	CREATE_MONTHLY_TOTALS_TABLE,
+	CLEAR_MONTHLY_TOTALS,
+	FILL_MONTHLY_TOTALS,
+	NULL
+};
+
+/* Existing amounts are rounded to the nearest cent */
+static const char* const CENTS_STATEMENTS[] = {
+	CREATE_EXPENSES_CENTS_TABLE,
+	COPY_EXPENSES_TO_CENTS_TABLE,
+	DROP_EXPENSES_TABLE,
+	RENAME_EXPENSES_CENTS_TABLE,
+	CREATE_DATE_INDEX,
+	CREATE_PAYMENT_TYPE_DATE_INDEX,
+	CREATE_EXPENSE_TYPE_DATE_INDEX,
+	DROP_MONTHLY_TOTALS_TABLE,
+	CREATE_MONTHLY_TOTALS_CENTS_TABLE,
+	FILL_MONTHLY_TOTALS,
+	NULL
+};
+
+static const schema_migration MIGRATIONS[] = {
+	{ 1, CREATE_EXPENSES_STATEMENTS },
+	{ 2, CREATE_INDEX_STATEMENTS },
+	{ 3, ROWID_ALIAS_STATEMENTS },
+	{ 4, MONTHLY_TOTALS_STATEMENTS },
+	{ CURRENT_SCHEMA_VERSION, CENTS_STATEMENTS }
+};
+
+#define NUM_MIGRATIONS (sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]))
+
+static const char* const CURRENT_SCHEMA_STATEMENTS[] = {
+	CREATE_CURRENT_EXPENSES_TABLE,
+	CREATE_DATE_INDEX,
+	CREATE_PAYMENT_TYPE_DATE_INDEX,
+	CREATE_EXPENSE_TYPE_DATE_INDEX,
+	CREATE_MONTHLY_TOTALS_CENTS_TABLE,
+	NULL
+};
+
+/* A new database skips the migrations, which rebuild expenses twice */
+static const schema_migration CURRENT_SCHEMA = {
+	CURRENT_SCHEMA_VERSION, CURRENT_SCHEMA_STATEMENTS
+};
+
+/* ctx is an optional expense_page_key set to the row's position */
+static int32_t decode_expense(sqlite3_stmt* stmt, void* row, void* ctx) {
+	expense* decoded = (expense*)row;
+	expense_page_key* key = (expense_page_key*)ctx;
+	const char* description;
+	size_t description_length;
+
+	if (NUM_EXPENSE_COLS != sqlite3_column_count(stmt)) {
+		ERR_LOG("Received [%u] result columns but was expecting [%u]",
+			sqlite3_column_count(stmt), NUM_EXPENSE_COLS);
+		return ERR_INVALID;
+	}
+
+	decoded->amount = sqlite3_column_int64(stmt, AMOUNT_INDEX);
+	decoded->date = sqlite3_column_int64(stmt, DATE_INDEX);
+	decoded->payment_type = sqlite3_column_int(stmt, PAYMENT_TYPE_INDEX);
+	decoded->expense_type = sqlite3_column_int(stmt, EXPENSE_TYPE_INDEX);
+
+	if (key) {
+		key->date = decoded->date;
+		key->id = sqlite3_column_int64(stmt, ID_INDEX);
+	}
+
+	description = (const char*)sqlite3_column_text(stmt, DESCRIPTION_INDEX);
+	description_length = sqlite3_column_bytes(stmt, DESCRIPTION_INDEX);
 
+	decoded->description = (char*)malloc(
+		sizeof(char) * (description_length + 1));
+	if (!decoded->description) {
+		ERR_LOG("Failed to allocate expense description");
+		return ERR_NOMEM;
+	}
+
+	if (description) {
+		memcpy(decoded->description, description, description_length);
+	}
+	decoded->description[description_length] = '\0';
+
+	DEBUG_LOG("Got result row [%ld, %ld, %u, %u, %s]",
+		(long)decoded->amount,
+		(long)decoded->date,
+		decoded->payment_type,
+		decoded->expense_type,
+		decoded->description);
+
+	return ERR_OK;
+}
+
+/* Packs the expenses and their descriptions into one allocation */
+static int32_t pack_expenses(const void* rows, size_t num_rows, void** packed, size_t* size) {
+	const expense* expenses = (const expense*)rows;
+	expense* packed_expenses;
+	char* text;
+	size_t length;
 	size_t i;
-	size_t description_length;
-	expenses->num_expenses = result->num_rows;
-	expenses->expenses = (expense*)malloc(sizeof(expense) * result->num_rows);
-	for (i = 0; i < expenses->num_expenses; ++i) {
-		DEBUG_LOG("Got result row [%f, %ld, %u, %u, %s]",
-			result->values[i][AMOUNT_INDEX].value.double_val,
-			result->values[i][DATE_INDEX].value.int_val,
-			result->values[i][PAYMENT_TYPE_INDEX].value.int_val,
-			result->values[i][EXPENSE_TYPE_INDEX].value.int_val,
-			result->values[i][DESCRIPTION_INDEX].value.string_val);
 
-		expenses->expenses[i].amount = result->values[i][AMOUNT_INDEX].value.double_val;
+	*size = sizeof(expense) * num_rows;
+	for (i = 0; i < num_rows; ++i) {
+		*size += strlen(expenses[i].description) + 1;
+	}
+
+	*packed = NULL;
+	if (!num_rows) {
+		return ERR_OK;
+	}
+
+	*packed = malloc(*size);
+	if (!*packed) {
+		return ERR_NOMEM;
+	}
 
-		expenses->expenses[i].date = result->values[i][DATE_INDEX].value.int_val;
-		expenses->expenses[i].payment_type = result->values[i][PAYMENT_TYPE_INDEX].value.int_val;
-		expenses->expenses[i].expense_type = result->values[i][EXPENSE_TYPE_INDEX].value.int_val;
+	packed_expenses = (expense*)*packed;
+	text = (char*)(packed_expenses + num_rows);
 
-		description_length = strlen(result->values[i][DESCRIPTION_INDEX].value.string_val) + 1;
+	for (i = 0; i < num_rows; ++i) {
+		length = strlen(expenses[i].description) + 1;
 
-		expenses->expenses[i].description = (char*)malloc(
-			sizeof(char) * description_length);
-		strncpy(
-			expenses->expenses[i].description,
-			result->values[i][DESCRIPTION_INDEX].value.string_val,
-			description_length);
+		packed_expenses[i] = expenses[i];
+		packed_expenses[i].description = memcpy(text, expenses[i].description, length);
+		text += length;
 	}
+
+	return ERR_OK;
 }
 
-int32_t open_budget_db(db_connection* db) {
+/* Copies packed expenses so they can be released with free_expenses */
+static int32_t copy_expenses(const void* packed, size_t num_rows, void** rows) {
+	expense_list copy = {0};
+	size_t i;
+
+	*rows = NULL;
+	if (!num_rows) {
+		return ERR_OK;
+	}
+
+	copy.expenses = (expense*)malloc(sizeof(expense) * num_rows);
+	if (!copy.expenses) {
+		return ERR_NOMEM;
+	}
+
+	for (i = 0; i < num_rows; ++i) {
+		copy.expenses[i] = ((const expense*)packed)[i];
+		copy.expenses[i].description = strdup(copy.expenses[i].description);
+		if (!copy.expenses[i].description) {
+			free_expenses(&copy);
+			return ERR_NOMEM;
+		}
+		++copy.num_expenses;
+	}
+
+	*rows = copy.expenses;
+
+	return ERR_OK;
+}
+
+static const cached_row_ops EXPENSE_ROW_OPS = {
+	pack_expenses,
+	copy_expenses
+};
+
+static int32_t query_expenses(db_query* query, void* ctx, expense_list* expenses) {
+	int32_t rc;
+
+	expenses->expenses = NULL;
+	expenses->num_expenses = 0;
+
+	/* Pages record their key while decoding so are always read */
+	rc = ctx ?
+		execute_mapped_query(
+			query,
+			decode_expense,
+			sizeof(expense),
+			ctx,
+			(void**)&expenses->expenses,
+			&expenses->num_expenses) :
+		execute_cached_query(
+			query,
+			decode_expense,
+			sizeof(expense),
+			&EXPENSE_ROW_OPS,
+			(void**)&expenses->expenses,
+			&expenses->num_expenses);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to get expenses");
+		free_expenses(expenses);
+		return rc;
+	}
+
+	if (!expenses->num_expenses) {
+		INFO_LOG("No expenses matching query found");
+	}
+
+	return ERR_OK;
+}
+
+static int32_t execute_statement(db_connection* db, const char* sql) {
+	db_query query = {0};
+
+	query.connection = db;
+	query.query = sql;
+
+	return execute_query(&query, NULL);
+}
+
+/* Runs a statement returning a single integer */
+static int32_t select_int(db_connection* db, const char* sql, int32_t* value) {
+	db_query query = {0};
+	db_query_result result = {0};
 	int32_t rc;
+
+	query.connection = db;
+	query.query = sql;
+	rc = execute_query(&query, &result);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to run [%s]", sql);
+		return rc;
+	}
+
+	if (1 != result.num_rows ||
+		INT != result.values[0][0].type) {
+		ERR_LOG("Unexpected result for [%s]", sql);
+		free_results(&result);
+		return ERR_INVALID;
+	}
+
+	*value = result.values[0][0].value.int_val;
+
+	free_results(&result);
+
+	return ERR_OK;
+}
+
+static int32_t apply_migration(
+	db_connection* db,
+	const schema_migration* migration) {
+
 	db_query query = {0};
+	char set_version[MAX_SCHEMA_VERSION_QUERY_LENGTH];
+	const char* const* statement;
+	int32_t rc;
+
+	NOTICE_LOG("Migrating budget DB to schema version [%d]",
+		migration->version);
+
+	rc = execute_statement(db, BEGIN_TRANSACTION);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to begin SQL transaction");
+		return rc;
+	}
+
+	for (statement = migration->statements; *statement; ++statement) {
+		rc = execute_statement(db, *statement);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to apply migration [%d]", migration->version);
+			goto CLEAN_UP;
+		}
+	}
+
+	/* Pragmas cannot be bound so this is run uncached */
+	snprintf(set_version, sizeof(set_version),
+		SET_SCHEMA_VERSION, migration->version);
+	query.handle = db->handle;
+	query.query = set_version;
+	rc = execute_query(&query, NULL);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to set schema version [%d]", migration->version);
+		goto CLEAN_UP;
+	}
+
+	rc = execute_statement(db, END_TRANSACTION);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to commit migration [%d]", migration->version);
+		goto CLEAN_UP;
+	}
+
+	return ERR_OK;
+
+CLEAN_UP:
+
+	if (ERR_OK != execute_statement(db, ROLLBACK_TRANSACTION)) {
+		WARN_LOG("Failed to roll back migration [%d]", migration->version);
+	}
+
+	return rc;
+}
+
+static int32_t migrate_schema(db_connection* db) {
+	int32_t version;
+	int32_t num_tables;
+	int32_t rc;
+	size_t i;
+
+	rc = select_int(db, SELECT_SCHEMA_VERSION, &version);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to get schema version");
+		return rc;
+	}
+
+	DEBUG_LOG("Budget DB is at schema version [%d]", version);
+
+	/* Databases from before versioning have expenses at version 0 */
+	if (!version) {
+		rc = select_int(db, COUNT_EXPENSES_TABLES, &num_tables);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+
+		if (!num_tables) {
+			return apply_migration(db, &CURRENT_SCHEMA);
+		}
+	}
+
+	if (version > MIGRATIONS[NUM_MIGRATIONS - 1].version) {
+		WARN_LOG("Budget DB schema version [%d] is newer than supported [%d]",
+			version, MIGRATIONS[NUM_MIGRATIONS - 1].version);
+		return ERR_OK;
+	}
+
+	for (i = 0; i < NUM_MIGRATIONS; ++i) {
+		if (MIGRATIONS[i].version <= version) {
+			continue;
+		}
+
+		rc = apply_migration(db, &MIGRATIONS[i]);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	return ERR_OK;
+}
+
+int32_t open_budget_db(db_connection* db) {
+	int32_t rc;
 
 	if (!db) {
 		ERR_LOG("DB db is NULL");
@@ -58,61 +448,794 @@ int32_t open_budget_db(db_connection* db) {
 		return ERR_IN_USE;
 	}
 
-	DEBUG_LOG("Opening db to budget DB");
+	DEBUG_LOG("Opening db to budget DB");
+
+	rc = open_db(db);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to open db: [%d:%s]",
+			rc, error_to_string(rc));
+		return rc;
+	}
+
+	rc = migrate_schema(db);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to migrate budget DB schema");
+		close_db(db);
+		return rc;
+	}
+
+
+	return ERR_OK;
+}
+
+int32_t open_budget_pool(
+	db_pool* pool,
+	const char* db_path,
+	size_t num_readers,
+	const db_options* options) {
+
+	int32_t rc;
+
+	if (!pool) {
+		ERR_LOG("DB pool is NULL");
+		return ERR_INVALID;
+	}
+
+	DEBUG_LOG("Opening pool to budget DB");
+
+	rc = open_pool(pool, db_path, num_readers, options);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to open pool: [%d:%s]",
+			rc, error_to_string(rc));
+		return rc;
+	}
+
+	/* Readers pick up the new schema on their next statement */
+	rc = migrate_schema(&pool->writer);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to migrate budget DB schema");
+		close_pool(pool);
+		return rc;
+	}
+
+	return ERR_OK;
+}
+
+int32_t close_budget_pool(db_pool* pool) {
+	int32_t rc;
+
+	DEBUG_LOG("Closing pool to budget DB");
+
+	rc = close_pool(pool);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to close pool to budget DB: [%d:%s]",
+			rc, error_to_string(rc));
+	}
+
+	return rc;
+}
+
+int32_t close_budget_db(db_connection* db) {
+	int32_t rc;
+
+	if (!db) {
+		ERR_LOG("DB db is NULL");
+		return ERR_INVALID;
+	}
+
+	DEBUG_LOG("Closing db to budget DB");
+
+	if (db->handle) {
+		rc = close_db(db);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to close db to budget DB: [%d:%s]",
+				rc, error_to_string(rc));
+			return rc;
+		}
+	}
+	else {
+		WARN_LOG("DB handle is NULL");
+		return ERR_INVALID;
+	}
+
+	return ERR_OK;
+}
+
+/* Values are filled in per total by flush_rollup */
+static const query_param UPSERT_MONTHLY_TOTAL_PARAMS[NUM_UPSERT_PARAMS] = {
+	[UPSERT_YEAR_MONTH_INDEX] =
+		{ YEAR_MONTH_PARAM, { .type = INT }, UPSERT_YEAR_MONTH_POSITION },
+	[UPSERT_EXPENSE_TYPE_INDEX] =
+		{ EXPENSE_TYPE_PARAM, { .type = INT }, UPSERT_EXPENSE_TYPE_POSITION },
+	[UPSERT_PAYMENT_TYPE_INDEX] =
+		{ PAYMENT_TYPE_PARAM, { .type = INT }, UPSERT_PAYMENT_TYPE_POSITION },
+	[UPSERT_COUNT_INDEX] =
+		{ COUNT_PARAM, { .type = INT }, UPSERT_COUNT_POSITION },
+	[UPSERT_TOTAL_INDEX] =
+		{ TOTAL_PARAM, { .type = INT64 }, UPSERT_TOTAL_POSITION }
+};
+
+/* Must agree with strftime('%Y%m', date, 'unixepoch') in FILL_MONTHLY_TOTALS */
+static int32_t monthly_total_key(monthly_rollup* rollup, time_t date) {
+	struct tm month = {0};
+
+	if (rollup->month_start <= date && date < rollup->month_end) {
+		return rollup->year_month;
+	}
+
+	gmtime_r(&date, &month);
+	rollup->year_month = (month.tm_year + 1900) * 100 + month.tm_mon + 1;
+
+	month.tm_mday = 1;
+	month.tm_hour = 0;
+	month.tm_min = 0;
+	month.tm_sec = 0;
+	rollup->month_start = timegm(&month);
+
+	++month.tm_mon;
+	rollup->month_end = timegm(&month);
+
+	return rollup->year_month;
+}
+
+static size_t hash_monthly_total(
+	int32_t year_month,
+	uint32_t expense_type,
+	uint32_t payment_type) {
+
+	uint64_t hash = (uint64_t)(uint32_t)year_month;
+
+	hash = hash * 31 + expense_type;
+	hash = hash * 31 + payment_type;
+	hash *= 0x9E3779B97F4A7C15ULL;
+
+	return (size_t)(hash >> 32);
+}
+
+static monthly_total* find_monthly_total(
+	monthly_total* totals,
+	size_t capacity,
+	int32_t year_month,
+	uint32_t expense_type,
+	uint32_t payment_type) {
+
+	size_t slot = hash_monthly_total(year_month, expense_type, payment_type) &
+		(capacity - 1);
+
+	while (totals[slot].count &&
+		(totals[slot].year_month != year_month ||
+		totals[slot].expense_type != expense_type ||
+		totals[slot].payment_type != payment_type)) {
+
+		slot = (slot + 1) & (capacity - 1);
+	}
+
+	return &totals[slot];
+}
+
+static int32_t grow_rollup(monthly_rollup* rollup) {
+	size_t capacity = rollup->capacity ?
+		rollup->capacity * 2 : ROLLUP_INITIAL_CAPACITY;
+	monthly_total* totals;
+	monthly_total* slot;
+	size_t i;
+
+	totals = (monthly_total*)calloc(capacity, sizeof(monthly_total));
+	if (!totals) {
+		ERR_LOG("Unable to allocate [%zu] monthly totals", capacity);
+		return ERR_NOMEM;
+	}
+
+	for (i = 0; i < rollup->capacity; ++i) {
+		if (!rollup->totals[i].count) {
+			continue;
+		}
+
+		slot = find_monthly_total(
+			totals,
+			capacity,
+			rollup->totals[i].year_month,
+			rollup->totals[i].expense_type,
+			rollup->totals[i].payment_type);
+		*slot = rollup->totals[i];
+	}
+
+	free(rollup->totals);
+	rollup->totals = totals;
+	rollup->capacity = capacity;
+
+	return ERR_OK;
+}
+
+static int32_t add_to_rollup(monthly_rollup* rollup, const expense* expense) {
+	int32_t year_month = monthly_total_key(rollup, expense->date);
+	monthly_total* total;
+	int32_t rc;
+
+	/* Grow at 75% load */
+	if ((rollup->num_totals + 1) * 4 > rollup->capacity * 3) {
+		rc = grow_rollup(rollup);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	total = find_monthly_total(
+		rollup->totals,
+		rollup->capacity,
+		year_month,
+		expense->expense_type,
+		expense->payment_type);
+
+	if (!total->count) {
+		total->year_month = year_month;
+		total->expense_type = expense->expense_type;
+		total->payment_type = expense->payment_type;
+		++rollup->num_totals;
+	}
+
+	++total->count;
+	total->total += expense->amount;
+
+	return ERR_OK;
+}
+
+/* Must be called inside the transaction that inserted the expenses */
+static int32_t flush_rollup(db_connection* db, monthly_rollup* rollup) {
+	db_query query = {0};
+	query_param params[NUM_UPSERT_PARAMS];
+	db_cursor cursor = {0};
+	monthly_total* total;
+	bool has_row;
+	int32_t rc;
+	size_t i;
+
+	if (!rollup->num_totals) {
+		return ERR_OK;
+	}
+
+	memcpy(params, UPSERT_MONTHLY_TOTAL_PARAMS, sizeof(UPSERT_MONTHLY_TOTAL_PARAMS));
+
+	query.connection = db;
+	query.query = UPSERT_MONTHLY_TOTAL;
+	query.num_params = NUM_UPSERT_PARAMS;
+	query.params = params;
+	query.positional_params = true;
+	rc = open_cursor(&query, &cursor);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to prepare monthly total upsert");
+		return rc;
+	}
+
+	for (i = 0; i < rollup->capacity; ++i) {
+		total = &rollup->totals[i];
+		if (!total->count) {
+			continue;
+		}
+
+		params[UPSERT_YEAR_MONTH_INDEX].param.value.int_val = total->year_month;
+		params[UPSERT_EXPENSE_TYPE_INDEX].param.value.int_val = total->expense_type;
+		params[UPSERT_PAYMENT_TYPE_INDEX].param.value.int_val = total->payment_type;
+		params[UPSERT_COUNT_INDEX].param.value.int_val = total->count;
+		params[UPSERT_TOTAL_INDEX].param.value.int64_val = total->total;
+
+		rc = reset_cursor(&cursor);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to bind monthly total [%d]", total->year_month);
+			goto CLEAN_UP;
+		}
+
+		rc = cursor_next(&cursor, &has_row);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to update monthly total [%d]", total->year_month);
+			goto CLEAN_UP;
+		}
+	}
+
+	DEBUG_LOG("Updated [%zu] monthly totals", rollup->num_totals);
+
+	memset(rollup->totals, 0, sizeof(monthly_total) * rollup->capacity);
+	rollup->num_totals = 0;
+
+CLEAN_UP:
+
+	close_cursor(&cursor);
+
+	return rc;
+}
+
+/* Values are filled in per row by set_expense_params */
+static const query_param INSERT_EXPENSE_PARAMS[NUM_INSERT_PARAMS] = {
+	[INSERT_AMOUNT_INDEX] =
+		{ AMOUNT_PARAM, { .type = INT64 }, INSERT_AMOUNT_POSITION },
+	[INSERT_DATE_INDEX] =
+		{ DATE_PARAM, { .type = INT64 }, INSERT_DATE_POSITION },
+	[INSERT_PAYMENT_TYPE_INDEX] =
+		{ PAYMENT_TYPE_PARAM, { .type = INT }, INSERT_PAYMENT_TYPE_POSITION },
+	[INSERT_EXPENSE_TYPE_INDEX] =
+		{ EXPENSE_TYPE_PARAM, { .type = INT }, INSERT_EXPENSE_TYPE_POSITION },
+	[INSERT_DESCRIPTION_INDEX] =
+		{ DESCRIPTION_PARAM, { .type = STATIC_TEXT }, INSERT_DESCRIPTION_POSITION }
+};
+
+static void set_expense_params(
+	query_param* restrict params,
+	const expense* restrict expense) {
+
+	params[INSERT_AMOUNT_INDEX].param.value.int64_val = expense->amount;
+	params[INSERT_DATE_INDEX].param.value.int64_val = expense->date;
+	params[INSERT_PAYMENT_TYPE_INDEX].param.value.int_val = expense->payment_type;
+	params[INSERT_EXPENSE_TYPE_INDEX].param.value.int_val = expense->expense_type;
+	params[INSERT_DESCRIPTION_INDEX].param.value.string_val = expense->description;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int32_t insert_expenses(db_connection* db, expense_list* expenses) {
+	return insert_expenses_bulk(db, expenses, NULL, NULL);
+}
+
+int32_t insert_expenses_bulk(
+	db_connection* db,
+	expense_list* expenses,
+	const bulk_insert_options* options,
+	bulk_insert_stats* stats) {
+
+	db_query query = {0};
+	query_param params[NUM_INSERT_PARAMS] = {0};
+	db_cursor cursor = {0};
+	monthly_rollup rollup = {0};
+	struct timespec start;
+	size_t batch_size = options ? options->batch_size : 0;
+	size_t batches_committed = 0;
+	bool has_row;
+	int32_t rc;
+	size_t i;
+	bool transaction_started = false;
+
+	if (!db) {
+		ERR_LOG("DB connection is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!db->handle) {
+		ERR_LOG("No conection to DB available");
+		return ERR_NOT_READY;
+	}
+
+	if (!expenses) {
+		ERR_LOG("Expenses structure is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!expenses->num_expenses ||
+		!expenses->expenses) {
+		ERR_LOG("No expenses to add");
+		return ERR_INVALID;
+	}
+
+	/* Outside it the monthly keys, here and in FILL_MONTHLY_TOTALS,
+	 * cannot be computed */
+	for (i = 0; i < expenses->num_expenses; ++i) {
+		if (expenses->expenses[i].date < MIN_EXPENSE_DATE ||
+			expenses->expenses[i].date > MAX_EXPENSE_DATE) {
+			ERR_LOG("Expense [%zu] date [%lld] is out of range",
+				i, (long long)expenses->expenses[i].date);
+			return ERR_INVALID;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rc = execute_statement(db, BEGIN_TRANSACTION);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to begin SQL transaction");
+		goto CLEAN_UP;
+	}
+	transaction_started = true;
+
+	memcpy(params, INSERT_EXPENSE_PARAMS, sizeof(INSERT_EXPENSE_PARAMS));
+
+	query.connection = db;
+	query.query = INSERT_EXPENSE;
+	query.num_params = NUM_INSERT_PARAMS;
+	query.params = params;
+	query.positional_params = true;
+	rc = open_cursor(&query, &cursor);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to prepare expense insert");
+		goto CLEAN_UP;
+	}
+
+	for (i = 0; i < expenses->num_expenses; ++i) {
+		set_expense_params(params, &expenses->expenses[i]);
+
+		rc = reset_cursor(&cursor);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to bind expense [%u]", i);
+			goto CLEAN_UP;
+		}
+
+		rc = cursor_next(&cursor, &has_row);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to insert expense");
+			goto CLEAN_UP;
+		}
+
+		rc = add_to_rollup(&rollup, &expenses->expenses[i]);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to add expense [%u] to monthly totals", i);
+			goto CLEAN_UP;
+		}
+
+		if (batch_size &&
+			0 == (i + 1) % batch_size &&
+			i + 1 < expenses->num_expenses) {
+
+			rc = flush_rollup(db, &rollup);
+			if (ERR_OK != rc) {
+				ERR_LOG("Failed to update monthly totals");
+				goto CLEAN_UP;
+			}
+
+			rc = execute_statement(db, END_TRANSACTION);
+			if (ERR_OK != rc) {
+				ERR_LOG("Failed to commit batch ending at expense [%u]", i);
+				goto CLEAN_UP;
+			}
+			transaction_started = false;
+			++batches_committed;
+
+			rc = execute_statement(db, BEGIN_TRANSACTION);
+			if (ERR_OK != rc) {
+				ERR_LOG("Failed to begin SQL transaction");
+				goto CLEAN_UP;
+			}
+			transaction_started = true;
+		}
+	}
+
+	close_cursor(&cursor);
+
+	rc = flush_rollup(db, &rollup);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to update monthly totals");
+		goto CLEAN_UP;
+	}
+
+	rc = execute_statement(db, END_TRANSACTION);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to end transaction");
+		goto CLEAN_UP;
+	}
+	transaction_started = false;
+	++batches_committed;
+
+CLEAN_UP:
+
+	close_cursor(&cursor);
+	free(rollup.totals);
+
+	/* Batches may have been committed even on failure */
+	if (batches_committed) {
+		invalidate_result_cache(db->result_cache);
+	}
+
+	if (transaction_started) {
+		WARN_LOG("Rolling back uncommitted expenses");
+		if (ERR_OK != execute_statement(db, ROLLBACK_TRANSACTION)) {
+			WARN_LOG("Failed to roll back transaction");
+		}
+	}
+
+	if (ERR_OK == rc) {
+		double elapsed = elapsed_seconds(&start);
+
+		INFO_LOG("Inserted [%u] expenses in [%u] batches in [%f]s [%f rows/s]",
+			expenses->num_expenses, batches_committed, elapsed,
+			elapsed > 0 ? expenses->num_expenses / elapsed : 0);
+
+		if (stats) {
+			stats->rows_inserted = expenses->num_expenses;
+			stats->batches_committed = batches_committed;
+			stats->elapsed_sec = elapsed;
+			stats->rows_per_sec =
+				elapsed > 0 ? expenses->num_expenses / elapsed : 0;
+		}
+	}
+
+	return rc;
+}
+
+/* Rounds up to a power of two so type sets of similar size share a
+ * statement shape */
+static size_t padded_type_count(size_t num_types) {
+	size_t padded = 1;
+
+	if (!num_types) {
+		return 0;
+	}
+
+	while (padded < num_types) {
+		padded <<= 1;
+	}
+
+	return padded;
+}
+
+static void add_filter_param(
+	filter_query* filter_query,
+	const char* name,
+	db_type type,
+	int64_t value) {
+
+	query_param* param;
+
+	if (filter_query->query.num_params == filter_query->max_params) {
+		filter_query->overflow = true;
+		return;
+	}
+
+	param = &filter_query->query.params[filter_query->query.num_params];
+	param->name = name;
+	param->index = ++filter_query->query.num_params;
+	param->param.type = type;
+	if (INT64 == type) {
+		param->param.value.int64_val = value;
+	}
+	else {
+		param->param.value.int_val = (int32_t)value;
+	}
+}
+
+static void append_filter_sql(filter_query* filter_query, const char* format, ...) {
+	size_t remaining = filter_query->sql_capacity - filter_query->sql_length;
+	va_list args;
+	int length;
+
+	if (filter_query->overflow) {
+		return;
+	}
+
+	va_start(args, format);
+	length = vsnprintf(filter_query->sql + filter_query->sql_length, remaining, format, args);
+	va_end(args);
+
+	if (length < 0 || (size_t)length >= remaining) {
+		filter_query->overflow = true;
+		return;
+	}
+
+	filter_query->sql_length += length;
+}
+
+static const char* next_clause(const filter_query* filter_query) {
+	return filter_query->query.num_params ? " AND " : " WHERE ";
+}
+
+static void add_filter_clause(filter_query* filter_query, const char* clause) {
+	append_filter_sql(filter_query, "%s%s", next_clause(filter_query), clause);
+}
+
+/* Adds the bounds selected by flags on column. lower and upper are
+ * the flags that keep values above the low bound and below the high
+ * bound, and equals makes either bound inclusive or selects values
+ * equal to the low bound on its own. */
+static void add_bound_clauses(
+	filter_query* filter_query,
+	const char* column,
+	uint8_t flags,
+	uint8_t equals,
+	uint8_t lower,
+	uint8_t upper,
+	const char* low_name,
+	const char* high_name,
+	int64_t low,
+	int64_t high) {
+
+	const char* equal = flags & equals ? "=" : "";
+
+	if (!(flags & (lower | upper))) {
+		if (*equal) {
+			append_filter_sql(filter_query, "%s%s=?", next_clause(filter_query), column);
+			add_filter_param(filter_query, low_name, INT64, low);
+		}
+		return;
+	}
+
+	if (flags & lower) {
+		append_filter_sql(filter_query, "%s%s>%s?", next_clause(filter_query), column, equal);
+		add_filter_param(filter_query, low_name, INT64, low);
+	}
+
+	if (flags & upper) {
+		append_filter_sql(filter_query, "%s%s<%s?", next_clause(filter_query), column, equal);
+		add_filter_param(filter_query, high_name, INT64, high);
+	}
+}
+
+static void add_type_set_clause(
+	filter_query* filter_query,
+	const char* column,
+	const char* name,
+	const uint32_t* types,
+	size_t num_types) {
+
+	size_t padded = padded_type_count(num_types);
+	size_t i;
+
+	if (!padded) {
+		return;
+	}
+
+	append_filter_sql(filter_query, "%s%s IN (", next_clause(filter_query), column);
+
+	/* Padding repeats the last type, which does not change the result */
+	for (i = 0; i < padded; ++i) {
+		append_filter_sql(filter_query, "%s?", i ? "," : "");
+		add_filter_param(filter_query, name, INT,
+			types[i < num_types ? i : num_types - 1]);
+	}
+
+	append_filter_sql(filter_query, ")");
+}
+
+static void free_filter_query(filter_query* filter_query) {
+	free(filter_query->sql);
+	free(filter_query->query.params);
+	filter_query->sql = NULL;
+	filter_query->query.params = NULL;
+}
+
+/* Builds the statement for the shape of filter, i.e. which predicates
+ * are set and how many types each set holds, and binds its values as
+ * positional parameters. Filters of the same shape produce the same
+ * text so they share one cached statement. With a key the expenses
+ * after it are returned oldest first, page_size at a time. */
+static int32_t build_filter_query(
+	db_connection* db,
+	const expense_filter* filter,
+	const expense_page_key* key,
+	size_t page_size,
+	filter_query* filter_query) {
+
+	size_t num_payment_types = padded_type_count(filter->num_payment_types);
+	size_t num_expense_types = padded_type_count(filter->num_expense_types);
+	size_t max_params = MAX_BOUND_PARAMS + MAX_PAGE_PARAMS +
+		num_payment_types + num_expense_types;
+
+	memset(filter_query, 0, sizeof(*filter_query));
+
+	if (filter->date_flags & ~(ON_DATE | BEFORE_DATE | AFTER_DATE) ||
+		filter->amount_flags & ~(EQUALS_AMOUNT | LESS_THAN_AMOUNT | GREATER_THAN_AMOUNT)) {
+		ERR_LOG("Unknown filter flags [%#x:%#x]",
+			filter->date_flags, filter->amount_flags);
+		return ERR_INVALID;
+	}
+
+	if ((filter->num_payment_types && !filter->payment_types) ||
+		(filter->num_expense_types && !filter->expense_types) ||
+		filter->num_payment_types > MAX_FILTER_TYPES ||
+		filter->num_expense_types > MAX_FILTER_TYPES) {
+		ERR_LOG("Invalid filter type sets [%zu:%zu]",
+			filter->num_payment_types, filter->num_expense_types);
+		return ERR_INVALID;
+	}
+
+	filter_query->sql_capacity =
+		MAX_FILTER_QUERY_LENGTH + FILTER_TYPE_LENGTH * (num_payment_types + num_expense_types);
+	filter_query->max_params = max_params;
+	filter_query->sql = (char*)malloc(filter_query->sql_capacity);
+	filter_query->query.params = (query_param*)malloc(sizeof(query_param) * max_params);
+	if (!filter_query->sql || !filter_query->query.params) {
+		ERR_LOG("Failed to allocate filter query");
+		free_filter_query(filter_query);
+		return ERR_NOMEM;
+	}
+
+	filter_query->query.connection = db;
+	filter_query->query.positional_params = true;
+	append_filter_sql(filter_query, SELECT_EXPENSES);
+
+	add_bound_clauses(filter_query, "date", filter->date_flags,
+		ON_DATE, AFTER_DATE, BEFORE_DATE, START_DATE_PARAM, END_DATE_PARAM,
+		filter->range.start, filter->range.end);
+
+	add_bound_clauses(filter_query, "amount", filter->amount_flags,
+		EQUALS_AMOUNT, GREATER_THAN_AMOUNT, LESS_THAN_AMOUNT, MIN_AMOUNT_PARAM, MAX_AMOUNT_PARAM,
+		filter->min_amount, filter->max_amount);
+
+	add_type_set_clause(filter_query, "payment_type", PAYMENT_TYPE_PARAM,
+		filter->payment_types, filter->num_payment_types);
+	add_type_set_clause(filter_query, "expense_type", EXPENSE_TYPE_PARAM,
+		filter->expense_types, filter->num_expense_types);
 
-	rc = open_db(db);
-	if (ERR_OK != rc) {
-		ERR_LOG("Failed to open db: [%d:%s]",
-			rc, error_to_string(rc));
-		return rc;
+	if (key) {
+		/* Seeks in the date index rather than skipping earlier pages */
+		add_filter_clause(filter_query, EXPENSES_AFTER_KEY);
+		add_filter_param(filter_query, KEY_DATE_PARAM, INT64, key->date);
+		add_filter_param(filter_query, KEY_ID_PARAM, INT64, key->id);
+
+		append_filter_sql(filter_query, ORDER_EXPENSES_BY_KEY);
+		add_filter_param(filter_query, LIMIT_PARAM, INT,
+			page_size > INT32_MAX ? INT32_MAX : page_size);
+	}
+	else {
+		append_filter_sql(filter_query, ORDER_EXPENSES_NEWEST_FIRST);
 	}
 
-	query.handle = db->handle;
-	query.query = CREATE_EXPENSES_TABLE;
-	rc = execute_query(&query, NULL);
-	if (ERR_OK != rc) {
-		ERR_LOG("Failed to create expenses table");
-		return rc;
+	if (filter_query->overflow) {
+		ERR_LOG("Filter query does not fit in [%zu] bytes and [%zu] params",
+			filter_query->sql_capacity, filter_query->max_params);
+		free_filter_query(filter_query);
+		return ERR_KO;
 	}
 
+	filter_query->query.query = filter_query->sql;
+
+	DEBUG_LOG("Built filter query [%s] with [%u] params",
+		filter_query->sql, filter_query->query.num_params);
 
 	return ERR_OK;
 }
 
-int32_t close_budget_db(db_connection* db) {
+int32_t get_expenses_matching(
+	db_connection* db,
+	const expense_filter* filter,
+	expense_list* expenses) {
+
+	filter_query filter_query;
 	int32_t rc;
 
 	if (!db) {
-		ERR_LOG("DB db is NULL");
+		ERR_LOG("DB connection is NULL");
 		return ERR_INVALID;
 	}
 
-	DEBUG_LOG("Closing db to budget DB");
+	if (!db->handle) {
+		ERR_LOG("No conection to DB available");
+		return ERR_NOT_READY;
+	}
 
-	if (db->handle) {
-		rc = close_db(db);
-		if (ERR_OK != rc) {
-			ERR_LOG("Failed to close db to budget DB: [%d:%s]",
-				rc, error_to_string(rc));
-			return rc;
-		}
+	if (!expenses) {
+		ERR_LOG("Expenses structure is NULL");
+		return ERR_INVALID;
 	}
-	else {
-		WARN_LOG("DB handle is NULL");
+
+	if (!filter) {
+		ERR_LOG("Expense filter is NULL");
 		return ERR_INVALID;
 	}
 
-	return ERR_OK;
+	rc = build_filter_query(db, filter, NULL, 0, &filter_query);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	rc = query_expenses(&filter_query.query, NULL, expenses);
+
+	free_filter_query(&filter_query);
+
+	return rc;
 }
 
-int32_t insert_expenses(db_connection* db, expense_list* expenses) {
-	db_query query = {0};
-	db_query_result result = {0};
+int32_t get_expenses_page(
+	db_connection* db,
+	const expense_filter* filter,
+	size_t page_size,
+	expense_page_key* key,
+	expense_list* expenses) {
+
+	filter_query filter_query;
+	expense_page_key last;
 	int32_t rc;
-	size_t i;
-	uint32_t next_id;
-	size_t description_length;
-	bool transaction_started = false;
 
 	if (!db) {
 		ERR_LOG("DB connection is NULL");
@@ -124,119 +1247,129 @@ int32_t insert_expenses(db_connection* db, expense_list* expenses) {
 		return ERR_NOT_READY;
 	}
 
-	if (!expenses) {
-		ERR_LOG("Expenses structure is NULL");
+	if (!expenses || !filter || !key) {
+		ERR_LOG("Expenses structure, filter or page key is NULL");
 		return ERR_INVALID;
 	}
 
-	if (!expenses->num_expenses ||
-		!expenses->expenses) {
-		ERR_LOG("No expenses to add");
+	if (!page_size) {
+		ERR_LOG("Page size is 0");
 		return ERR_INVALID;
 	}
 
-	query.handle = db->handle;
-	query.query = SELECT_NUM_ROWS;
-	rc = execute_query(&query, &result);
+	rc = build_filter_query(db, filter, key, page_size, &filter_query);
 	if (ERR_OK != rc) {
-		ERR_LOG("Failed to get current number of rows");
-		goto CLEAN_UP;
+		return rc;
 	}
 
-	if (1 != result.num_rows) {
-		ERR_LOG("Result is empty");
-		rc = ERR_INVALID;
-		goto CLEAN_UP;
-	}
+	DEBUG_LOG("Getting [%zu] expenses after [%ld:%ld]",
+		page_size, (long)key->date, (long)key->id);
 
-	if (INT != result.values[0][0].type) {
-		ERR_LOG("Received a non integer for number of rows query");
-		rc = ERR_INVALID;
-		goto CLEAN_UP;
+	last = *key;
+	rc = query_expenses(&filter_query.query, &last, expenses);
+	if (ERR_OK == rc) {
+		*key = last;
 	}
-	next_id = result.values[0][0].value.int_val + 1;
 
-	query.query = BEGIN_TRANSACTION;
-	rc = execute_query(&query, NULL);
-	if (ERR_OK != rc) {
-		ERR_LOG("Failed to begin SQL transaction");
-		goto CLEAN_UP;
-	}
+	free_filter_query(&filter_query);
 
-	query.query = INSERT_EXPENSE;
-	query.num_params = NUM_EXPENSE_PARAMS;
-	query.params = (query_param*)malloc(sizeof(query_param) * NUM_EXPENSE_PARAMS);
-	if (!query.params) {
-		ERR_LOG("Failed to allocate query params");
-		rc = ERR_NOMEM;
-		goto CLEAN_UP;
+	return rc;
+}
+
+/* The range functions are filters including both ends of the range */
+static int32_t get_expenses_in_range_with_types(
+	db_connection* db,
+	date_range* range,
+	const uint32_t* payment_type,
+	const uint32_t* expense_type,
+	expense_list* expenses) {
+
+	expense_filter filter = {0};
+
+	if (!range) {
+		ERR_LOG("Date range is NULL");
+		return ERR_INVALID;
 	}
 
-	for (i = 0; i < expenses->num_expenses; ++i) {
-		query.params[ID_INDEX].name = ID_PARAM;
-		query.params[ID_INDEX].param.type = INT;
-		query.params[ID_INDEX].param.value.int_val = next_id + i;
+	filter.date_flags = ON_DATE | AFTER_DATE | BEFORE_DATE;
+	filter.range = *range;
+	filter.payment_types = payment_type;
+	filter.num_payment_types = payment_type ? 1 : 0;
+	filter.expense_types = expense_type;
+	filter.num_expense_types = expense_type ? 1 : 0;
+
+	DEBUG_LOG("Getting expenses in date range [%ld:%ld]", range->start, range->end);
+
+	return get_expenses_matching(db, &filter, expenses);
+}
+
+int32_t get_expenses_in_range(
+	db_connection* db,
+	date_range* range,
+	expense_list* expenses) {
 
-		query.params[AMOUNT_INDEX].name = AMOUNT_PARAM;
-		query.params[AMOUNT_INDEX].param.type = DOUBLE;
-		query.params[AMOUNT_INDEX].param.value.double_val = expenses->expenses[i].amount; 
+	return get_expenses_in_range_with_types(db, range, NULL, NULL, expenses);
+}
 
-		query.params[DATE_INDEX].name = DATE_PARAM;
-		query.params[DATE_INDEX].param.type = INT;
-		query.params[DATE_INDEX].param.value.int_val = expenses->expenses[i].date; 
+int32_t get_expenses_in_range_with_payment_type(
+	db_connection* db,
+	date_range* range,
+	uint32_t payment_type,
+	expense_list* expenses) {
 
-		query.params[PAYMENT_TYPE_INDEX].name = PAYMENT_TYPE_PARAM;
-		query.params[PAYMENT_TYPE_INDEX].param.type = INT;
-		query.params[PAYMENT_TYPE_INDEX].param.value.int_val = expenses->expenses[i].payment_type; 
+	return get_expenses_in_range_with_types(db, range, &payment_type, NULL, expenses);
+}
 
-		query.params[EXPENSE_TYPE_INDEX].name = EXPENSE_TYPE_PARAM;
-		query.params[EXPENSE_TYPE_INDEX].param.type = INT;
-		query.params[EXPENSE_TYPE_INDEX].param.value.int_val = expenses->expenses[i].expense_type; 
+int32_t get_expenses_in_range_with_expense_type(
+	db_connection* db,
+	date_range* range,
+	uint32_t expense_type,
+	expense_list* expenses) {
 
-		description_length = strlen(expenses->expenses[i].description) + 1;
-		query.params[DESCRIPTION_INDEX].name = DESCRIPTION_PARAM;
-		query.params[DESCRIPTION_INDEX].param.type = TEXT;
-		query.params[DESCRIPTION_INDEX].param.value.string_val = (char*)malloc(sizeof(char) * description_length);
-		strncpy(query.params[DESCRIPTION_INDEX].param.value.string_val, expenses->expenses[i].description, description_length);
+	return get_expenses_in_range_with_types(db, range, NULL, &expense_type, expenses);
+}
 
-		rc = execute_query(&query, NULL);
-		if (ERR_OK != rc) {
-			ERR_LOG("Failed to insert expense");
-			goto CLEAN_UP;
-		}
 
-		free_params(query.params, query.num_params);
-	}
+/** @struct expense_stream
+  *
+  * @details
+  *		Caller's callback for for_each_expense_in_range
+  */
+struct expense_stream {
+	expense_callback callback;
+	void* ctx;
+} typedef expense_stream;
 
-CLEAN_UP:
+static int32_t stream_expense(db_cursor* row, void* ctx) {
+	expense_stream* stream = (expense_stream*)ctx;
+	expense decoded;
 
-	if (query.params) {
-		free_params(query.params, query.num_params);
-		free(query.params);
+	if (NUM_EXPENSE_COLS != row->num_cols) {
+		ERR_LOG("Received [%zu] result columns but was expecting [%u]",
+			row->num_cols, NUM_EXPENSE_COLS);
+		return ERR_INVALID;
 	}
 
-	free_results(&result);
+	decoded.amount = cursor_column_int64(row, AMOUNT_INDEX);
+	decoded.date = cursor_column_int64(row, DATE_INDEX);
+	decoded.payment_type = cursor_column_int(row, PAYMENT_TYPE_INDEX);
+	decoded.expense_type = cursor_column_int(row, EXPENSE_TYPE_INDEX);
 
-	if (transaction_started) {
-		query.query = END_TRANSACTION;
-		query.params = NULL;
-		query.num_params = 0;
-		if (ERR_OK != execute_query(&query, NULL)) {
-			WARN_LOG("Failed to end transaction");
-			rc = (rc == ERR_OK) ? ERR_KO : rc;
-		}
-	}
+	/* Owned by the statement, valid until the next step */
+	decoded.description = (char*)cursor_column_text(row, DESCRIPTION_INDEX, NULL);
 
-	return rc;
+	return stream->callback(&decoded, stream->ctx);
 }
 
-int32_t get_expenses_in_range(
+int32_t for_each_expense_in_range(
 	db_connection* db,
 	date_range* range,
-	expense_list* expenses) {
+	expense_callback callback,
+	void* ctx) {
 
-	db_query query = {0};
-	db_query_result result = {0};
+	expense_filter filter = {0};
+	filter_query filter_query;
+	expense_stream stream;
 	int32_t rc;
 
 	if (!db) {
@@ -249,74 +1382,55 @@ int32_t get_expenses_in_range(
 		return ERR_NOT_READY;
 	}
 
-	if (!expenses) {
-		ERR_LOG("Expenses structure is NULL");
-		return ERR_INVALID;
-	}
-
-	if (!range) {
-		ERR_LOG("Date range is NULL");
+	if (!range || !callback) {
+		ERR_LOG("Date range or callback is NULL");
 		return ERR_INVALID;
 	}
 
-	query.handle = db->handle;
-	query.query = SELECT_EXPENSES_IN_RANGE;
-	query.num_params = NUM_RANGE_PARAMS;
-	query.params = (query_param*)malloc(sizeof(query_param) * NUM_RANGE_PARAMS);
+	/* Shares the cached statement with get_expenses_in_range */
+	filter.date_flags = ON_DATE | AFTER_DATE | BEFORE_DATE;
+	filter.range = *range;
 
-	if (!query.params) {
-		ERR_LOG("Failed to allocate memory for params");
-		return ERR_NOMEM;
+	rc = build_filter_query(db, &filter, NULL, 0, &filter_query);
+	if (ERR_OK != rc) {
+		return rc;
 	}
 
-	query.params[START_DATE_INDEX].name = START_DATE_PARAM;
-	query.params[START_DATE_INDEX].param.type = INT;
-	query.params[START_DATE_INDEX].param.value.int_val = range->start;
-
-	query.params[END_DATE_INDEX].name = END_DATE_PARAM;
-	query.params[END_DATE_INDEX].param.type = INT;
-	query.params[END_DATE_INDEX].param.value.int_val = range->end;
+	stream.callback = callback;
+	stream.ctx = ctx;
 
-	DEBUG_LOG("Getting expenses in date range [%d:%d]", range->start, range->end);
+	DEBUG_LOG("Streaming expenses in date range [%ld:%ld]", range->start, range->end);
 
-	rc = execute_query(&query, &result);
-	if (ERR_OK != rc) {
-		ERR_LOG("Failed to get expenses");
-		goto CLEAN_UP;
-	}
-
-	if (!result.num_rows) {
-		INFO_LOG("No expenses matching query found");
-		return ERR_OK;
-	}
+	rc = execute_query_with_callback(&filter_query.query, stream_expense, &stream);
 
-	if (NUM_EXPENSE_PARAMS != result.num_cols) {
-		ERR_LOG("Received [%u] result columns but was expecting [%u]", result.num_cols, NUM_EXPENSE_PARAMS);
-		goto CLEAN_UP;
-	}
+	free_filter_query(&filter_query);
 
-	result_to_expense(&result, expenses);
+	return rc;
+}
 
-CLEAN_UP:
+static int32_t decode_monthly_total(sqlite3_stmt* stmt, void* row, void* ctx) {
+	monthly_total* total = (monthly_total*)row;
 
-	if (query.params) {
-		free(query.params);
-	}
+	(void)ctx;
 
-	free_results(&result);
+	total->year_month = sqlite3_column_int(stmt, MONTHLY_YEAR_MONTH_INDEX);
+	total->expense_type = sqlite3_column_int(stmt, MONTHLY_EXPENSE_TYPE_INDEX);
+	total->payment_type = sqlite3_column_int(stmt, MONTHLY_PAYMENT_TYPE_INDEX);
+	total->count = sqlite3_column_int64(stmt, MONTHLY_COUNT_INDEX);
+	total->total = sqlite3_column_int64(stmt, MONTHLY_TOTAL_INDEX);
 
-	return rc;
+	return ERR_OK;
 }
 
-int32_t get_expenses_in_range_with_payment_type(
+int32_t get_monthly_totals(
 	db_connection* db,
-	date_range* range,
-	uint32_t payment_type,
-	expense_list* expenses) {
+	int32_t start_month,
+	int32_t end_month,
+	monthly_total_list* totals) {
 
-	int32_t rc;
 	db_query query = {0};
-	db_query_result result = {0};
+	query_param params[NUM_RANGE_PARAMS] = {0};
+	int32_t rc;
 
 	if (!db) {
 		ERR_LOG("DB connection is NULL");
@@ -328,78 +1442,140 @@ int32_t get_expenses_in_range_with_payment_type(
 		return ERR_NOT_READY;
 	}
 
-	if (!expenses) {
-		ERR_LOG("Expenses structure is NULL");
+	if (!totals) {
+		ERR_LOG("Monthly totals structure is NULL");
 		return ERR_INVALID;
 	}
 
-	if (!range) {
-		ERR_LOG("Date range is NULL");
-		return ERR_INVALID;
-	}
+	params[START_DATE_INDEX].name = START_DATE_PARAM;
+	params[START_DATE_INDEX].index = START_DATE_POSITION;
+	params[START_DATE_INDEX].param.type = INT;
+	params[START_DATE_INDEX].param.value.int_val = start_month;
 
-	query.handle = db->handle;
-	query.query = SELECT_EXPENSES_IN_RANGE_WITH_PAYMENT_TYPE;
-	query.num_params = NUM_RANGE_PARAMS_WITH_TYPE;
-	query.params = (query_param*)malloc(sizeof(query_param) * NUM_RANGE_PARAMS_WITH_TYPE);
+	params[END_DATE_INDEX].name = END_DATE_PARAM;
+	params[END_DATE_INDEX].index = END_DATE_POSITION;
+	params[END_DATE_INDEX].param.type = INT;
+	params[END_DATE_INDEX].param.value.int_val = end_month;
 
-	if (!query.params) {
-		ERR_LOG("Failed to allocate memory for params");
-		return ERR_NOMEM;
+	query.connection = db;
+	query.query = SELECT_MONTHLY_TOTALS_IN_RANGE;
+	query.num_params = NUM_RANGE_PARAMS;
+	query.params = params;
+	query.positional_params = true;
+
+	DEBUG_LOG("Getting monthly totals in [%d:%d]", start_month, end_month);
+
+	totals->totals = NULL;
+	totals->num_totals = 0;
+
+	rc = execute_cached_query(
+		&query,
+		decode_monthly_total,
+		sizeof(monthly_total),
+		NULL,
+		(void**)&totals->totals,
+		&totals->num_totals);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to get monthly totals");
+		free_monthly_totals(totals);
+		return rc;
 	}
 
-	query.params[START_DATE_INDEX].name = START_DATE_PARAM;
-	query.params[START_DATE_INDEX].param.type = INT;
-	query.params[START_DATE_INDEX].param.value.int_val = range->start;
+	return ERR_OK;
+}
 
-	query.params[END_DATE_INDEX].name = END_DATE_PARAM;
-	query.params[END_DATE_INDEX].param.type = INT;
-	query.params[END_DATE_INDEX].param.value.int_val = range->end;
+int32_t rebuild_monthly_totals(db_connection* db) {
+	int32_t rc;
 
-	query.params[TYPE_INDEX].name = PAYMENT_TYPE_PARAM;
-	query.params[TYPE_INDEX].param.type = INT;
-	query.params[TYPE_INDEX].param.value.int_val = payment_type;
+	if (!db) {
+		ERR_LOG("DB connection is NULL");
+		return ERR_INVALID;
+	}
 
-	DEBUG_LOG("Getting expenses in date range [%d:%d] with payment type [%u]", range->start, range->end, payment_type);
+	if (!db->handle) {
+		ERR_LOG("No conection to DB available");
+		return ERR_NOT_READY;
+	}
 
-	rc = execute_query(&query, &result);
+	rc = execute_statement(db, BEGIN_TRANSACTION);
 	if (ERR_OK != rc) {
-		ERR_LOG("Failed to get expenses");
+		ERR_LOG("Failed to begin SQL transaction");
+		return rc;
+	}
+
+	rc = execute_statement(db, CLEAR_MONTHLY_TOTALS);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to clear monthly totals");
 		goto CLEAN_UP;
 	}
 
-	if (!result.num_rows) {
-		INFO_LOG("No expenses matching query found");
-		return ERR_OK;
+	rc = execute_statement(db, FILL_MONTHLY_TOTALS);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to fill monthly totals");
+		goto CLEAN_UP;
 	}
 
-	if (NUM_EXPENSE_PARAMS != result.num_cols) {
-		ERR_LOG("Received [%u] result columns but was expecting [%u]", result.num_cols, NUM_EXPENSE_PARAMS);
+	rc = execute_statement(db, END_TRANSACTION);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to end transaction");
 		goto CLEAN_UP;
 	}
 
-	result_to_expense(&result, expenses);
+	invalidate_result_cache(db->result_cache);
+
+	NOTICE_LOG("Rebuilt monthly totals");
+
+	return ERR_OK;
 
 CLEAN_UP:
 
-	if (query.params) {
-		free(query.params);
+	if (ERR_OK != execute_statement(db, ROLLBACK_TRANSACTION)) {
+		WARN_LOG("Failed to roll back transaction");
 	}
 
-	free_results(&result);
-
 	return rc;
 }
 
-int32_t get_expenses_in_range_with_expense_type(
+void free_monthly_totals(monthly_total_list* restrict totals) {
+	if (!totals) {
+		return;
+	}
+
+	free(totals->totals);
+	totals->totals = NULL;
+	totals->num_totals = 0;
+}
+
+static int32_t decode_summary(sqlite3_stmt* stmt, void* row, void* ctx) {
+	expense_summary* summary = (expense_summary*)row;
+
+	(void)ctx;
+
+	summary->type = sqlite3_column_int(stmt, SUMMARY_TYPE_INDEX);
+	summary->count = sqlite3_column_int64(stmt, SUMMARY_COUNT_INDEX);
+	summary->total = sqlite3_column_int64(stmt, SUMMARY_TOTAL_INDEX);
+	summary->min = sqlite3_column_int64(stmt, SUMMARY_MIN_INDEX);
+	summary->max = sqlite3_column_int64(stmt, SUMMARY_MAX_INDEX);
+
+	DEBUG_LOG("Got summary [%u, %zu, %ld, %ld, %ld]",
+		summary->type,
+		summary->count,
+		(long)summary->total,
+		(long)summary->min,
+		(long)summary->max);
+
+	return ERR_OK;
+}
+
+static int32_t get_expense_summary(
 	db_connection* db,
 	date_range* range,
-	uint32_t expense_type,
-	expense_list* expenses) {
+	const char* sql,
+	expense_summary_list* summaries) {
 
-	int32_t rc;
 	db_query query = {0};
-	db_query_result result = {0};
+	query_param params[NUM_RANGE_PARAMS] = {0};
+	int32_t rc;
 
 	if (!db) {
 		ERR_LOG("DB connection is NULL");
@@ -411,8 +1587,8 @@ int32_t get_expenses_in_range_with_expense_type(
 		return ERR_NOT_READY;
 	}
 
-	if (!expenses) {
-		ERR_LOG("Expenses structure is NULL");
+	if (!summaries) {
+		ERR_LOG("Summary structure is NULL");
 		return ERR_INVALID;
 	}
 
@@ -421,56 +1597,84 @@ int32_t get_expenses_in_range_with_expense_type(
 		return ERR_INVALID;
 	}
 
-	query.handle = db->handle;
-	query.query = SELECT_EXPENSES_IN_RANGE_WITH_EXPENSE_TYPE;
-	query.num_params = NUM_RANGE_PARAMS_WITH_TYPE;
-	query.params = (query_param*)malloc(sizeof(query_param) * NUM_RANGE_PARAMS_WITH_TYPE);
-
-	if (!query.params) {
-		ERR_LOG("Failed to allocate memory for params");
-		return ERR_NOMEM;
-	}
+	params[START_DATE_INDEX].name = START_DATE_PARAM;
+	params[START_DATE_INDEX].index = START_DATE_POSITION;
+	params[START_DATE_INDEX].param.type = INT64;
+	params[START_DATE_INDEX].param.value.int64_val = range->start;
 
-	query.params[START_DATE_INDEX].name = START_DATE_PARAM;
-	query.params[START_DATE_INDEX].param.type = INT;
-	query.params[START_DATE_INDEX].param.value.int_val = range->start;
+	params[END_DATE_INDEX].name = END_DATE_PARAM;
+	params[END_DATE_INDEX].index = END_DATE_POSITION;
+	params[END_DATE_INDEX].param.type = INT64;
+	params[END_DATE_INDEX].param.value.int64_val = range->end;
 
-	query.params[END_DATE_INDEX].name = END_DATE_PARAM;
-	query.params[END_DATE_INDEX].param.type = INT;
-	query.params[END_DATE_INDEX].param.value.int_val = range->end;
+	query.connection = db;
+	query.query = sql;
+	query.num_params = NUM_RANGE_PARAMS;
+	query.params = params;
+	query.positional_params = true;
 
-	query.params[TYPE_INDEX].name = EXPENSE_TYPE_PARAM;
-	query.params[TYPE_INDEX].param.type = INT;
-	query.params[TYPE_INDEX].param.value.int_val = expense_type;
+	DEBUG_LOG("Summarizing expenses in date range [%ld:%ld]", range->start, range->end);
 
-	DEBUG_LOG("Getting expenses in date range [%d:%d] with expense type [%u]" , range->start, range->end, expense_type);
+	summaries->summaries = NULL;
+	summaries->num_summaries = 0;
 
-	rc = execute_query(&query, &result);
+	rc = execute_cached_query(
+		&query,
+		decode_summary,
+		sizeof(expense_summary),
+		NULL,
+		(void**)&summaries->summaries,
+		&summaries->num_summaries);
 	if (ERR_OK != rc) {
-		ERR_LOG("Failed to get expenses");
-		goto CLEAN_UP;
+		ERR_LOG("Failed to summarize expenses");
+		free_expense_summaries(summaries);
+		return rc;
 	}
 
-	if (!result.num_rows) {
-		INFO_LOG("No expenses matching query found");
-		return ERR_OK;
-	}
+	return ERR_OK;
+}
 
-	if (NUM_EXPENSE_PARAMS != result.num_cols) {
-		ERR_LOG("Received [%u] result columns but was expecting [%u]", result.num_cols, NUM_EXPENSE_PARAMS);
-		goto CLEAN_UP;
+int32_t get_expense_summary_by_expense_type(
+	db_connection* db,
+	date_range* range,
+	expense_summary_list* summaries) {
+
+	return get_expense_summary(
+		db, range, SELECT_SUMMARY_BY_EXPENSE_TYPE, summaries);
+}
+
+int32_t get_expense_summary_by_payment_type(
+	db_connection* db,
+	date_range* range,
+	expense_summary_list* summaries) {
+
+	return get_expense_summary(
+		db, range, SELECT_SUMMARY_BY_PAYMENT_TYPE, summaries);
+}
+
+void free_expense_summaries(expense_summary_list* restrict summaries) {
+	if (!summaries) {
+		return;
 	}
 
-	result_to_expense(&result, expenses);
+	free(summaries->summaries);
+	summaries->summaries = NULL;
+	summaries->num_summaries = 0;
+}
 
-CLEAN_UP:
+void free_expenses(expense_list* restrict expenses) {
+	size_t i;
 
-	if (query.params) {
-		free(query.params);
+	if (!expenses ||
+		!expenses->expenses) {
+		return;
 	}
 
-	free_results(&result);
+	for (i = 0; i < expenses->num_expenses; ++i) {
+		free(expenses->expenses[i].description);
+	}
 
-	return rc;
+	free(expenses->expenses);
+	expenses->expenses = NULL;
+	expenses->num_expenses = 0;
 }
-
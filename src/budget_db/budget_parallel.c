@@ -0,0 +1,514 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <budget_db/budget_db.h>
+#include <budget_db/budget_db_queries.h>
+#include <sql/sql_pool.h>
+#include <error.h>
+#include <log.h>
+
+/** @brief partition_query
+  *
+  * @details
+  *		Runs a report over one sub-range on a reader checked out of the
+  *		pool, storing its partial result in result
+  */
+typedef int32_t (*partition_query)(db_connection* reader, date_range* range, void* result);
+
+/** @struct report_partition
+  *
+  * @details
+  *		Sub-range of a report run by one worker thread
+  */
+struct report_partition {
+	db_pool* pool;
+	date_range range;
+	partition_query query;
+	void* result;
+	int32_t rc;
+	pthread_t thread;
+} typedef report_partition;
+
+static void* run_partition(void* arg) {
+	report_partition* partition = (report_partition*)arg;
+	db_connection* reader;
+
+	partition->rc = checkout_reader(partition->pool, &reader);
+	if (ERR_OK != partition->rc) {
+		ERR_LOG("Unable to check out reader for partition [%ld:%ld]",
+			(long)partition->range.start, (long)partition->range.end);
+		return NULL;
+	}
+
+	partition->rc = partition->query(reader, &partition->range, partition->result);
+
+	checkin(partition->pool, reader);
+
+	return NULL;
+}
+
+/* Reads the first column of the first row of sql, run over the expenses
+ * in [start, end]. found is cleared when there is no row. */
+static int32_t query_date_index(
+	db_connection* db,
+	const char* sql,
+	uint32_t num_params,
+	time_t start,
+	time_t end,
+	int64_t offset,
+	int64_t* value,
+	bool* found) {
+
+	db_query query = {0};
+	query_param params[NUM_OFFSET_PARAMS] = {0};
+	db_cursor cursor;
+	int32_t rc;
+
+	params[START_DATE_INDEX].name = START_DATE_PARAM;
+	params[START_DATE_INDEX].index = START_DATE_POSITION;
+	params[START_DATE_INDEX].param.type = INT64;
+	params[START_DATE_INDEX].param.value.int64_val = start;
+
+	params[END_DATE_INDEX].name = END_DATE_PARAM;
+	params[END_DATE_INDEX].index = END_DATE_POSITION;
+	params[END_DATE_INDEX].param.type = INT64;
+	params[END_DATE_INDEX].param.value.int64_val = end;
+
+	params[OFFSET_INDEX].name = OFFSET_PARAM;
+	params[OFFSET_INDEX].index = OFFSET_POSITION;
+	params[OFFSET_INDEX].param.type = INT64;
+	params[OFFSET_INDEX].param.value.int64_val = offset;
+
+	query.connection = db;
+	query.query = sql;
+	query.num_params = num_params;
+	query.params = params;
+	query.positional_params = true;
+
+	rc = open_cursor(&query, &cursor);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	rc = cursor_next(&cursor, found);
+	if (ERR_OK == rc && *found) {
+		*value = cursor_column_int64(&cursor, 0);
+	}
+
+	close_cursor(&cursor);
+
+	return rc;
+}
+
+int32_t split_date_range(
+	db_connection* db,
+	const date_range* range,
+	size_t max_partitions,
+	date_range* partitions,
+	size_t* num_partitions) {
+
+	int64_t count = 0;
+	int64_t offset = 0;
+	int64_t date;
+	time_t previous;
+	size_t num_splits;
+	size_t i;
+	bool found;
+	int32_t rc;
+
+	if (!db || !range || !partitions || !num_partitions || !max_partitions) {
+		ERR_LOG("DB, date range or partitions is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!db->handle) {
+		ERR_LOG("No conection to DB available");
+		return ERR_NOT_READY;
+	}
+
+	partitions[0] = *range;
+	*num_partitions = 1;
+
+	if (1 == max_partitions || range->end < range->start) {
+		return ERR_OK;
+	}
+
+	rc = query_date_index(db, COUNT_EXPENSES_IN_RANGE, NUM_RANGE_PARAMS,
+		range->start, range->end, 0, &count, &found);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to count expenses in date range [%ld:%ld]",
+			(long)range->start, (long)range->end);
+		return rc;
+	}
+
+	num_splits = count < (int64_t)max_partitions ? (size_t)count : max_partitions;
+
+	/* Each split is found from the previous one, so the index is walked
+	 * about once. Rows sharing a date are never split, which can leave
+	 * fewer partitions. */
+	previous = range->start;
+	for (i = 1; i < num_splits; ++i) {
+		offset += count * i / num_splits - count * (i - 1) / num_splits;
+
+		rc = query_date_index(db, SELECT_DATE_AT_OFFSET, NUM_OFFSET_PARAMS,
+			previous, range->end, offset, &date, &found);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to find split [%zu] of date range [%ld:%ld]",
+				i, (long)range->start, (long)range->end);
+			return rc;
+		}
+
+		/* Rows were deleted since they were counted */
+		if (!found) {
+			break;
+		}
+
+		if (date > previous) {
+			partitions[*num_partitions - 1].end = date - 1;
+			partitions[*num_partitions].start = date;
+			partitions[*num_partitions].end = range->end;
+			++*num_partitions;
+
+			previous = date;
+			offset = 0;
+		}
+	}
+
+	DEBUG_LOG("Split [%ld] expenses in date range [%ld:%ld] into [%zu] partitions",
+		(long)count, (long)range->start, (long)range->end, *num_partitions);
+
+	return ERR_OK;
+}
+
+/* Runs query on each partition concurrently. results holds one
+ * result_size entry per partition. */
+static int32_t run_partitions(
+	db_pool* pool,
+	const date_range* ranges,
+	size_t num_partitions,
+	partition_query query,
+	void* results,
+	size_t result_size) {
+
+	report_partition* partitions;
+	int32_t rc = ERR_OK;
+	size_t i;
+
+	partitions = (report_partition*)calloc(num_partitions, sizeof(report_partition));
+	if (!partitions) {
+		ERR_LOG("Unable to allocate [%zu] report partitions", num_partitions);
+		return ERR_NOMEM;
+	}
+
+	DEBUG_LOG("Running report over [%ld:%ld] in [%zu] partitions",
+		(long)ranges[0].start, (long)ranges[num_partitions - 1].end, num_partitions);
+
+	for (i = 0; i < num_partitions; ++i) {
+		partitions[i].pool = pool;
+		partitions[i].range = ranges[i];
+		partitions[i].query = query;
+		partitions[i].result = (char*)results + result_size * i;
+
+		/* Without a thread the partition still runs, just serially */
+		if (0 != pthread_create(&partitions[i].thread, NULL, run_partition, &partitions[i])) {
+			WARN_LOG("Unable to start thread for partition [%zu]", i);
+			run_partition(&partitions[i]);
+			partitions[i].pool = NULL;
+		}
+	}
+
+	for (i = 0; i < num_partitions; ++i) {
+		if (partitions[i].pool) {
+			pthread_join(partitions[i].thread, NULL);
+		}
+
+		if (ERR_OK == rc && ERR_OK != partitions[i].rc) {
+			ERR_LOG("Report partition [%zu] failed: [%d:%s]",
+				i, partitions[i].rc, error_to_string(partitions[i].rc));
+			rc = partitions[i].rc;
+		}
+	}
+
+	free(partitions);
+
+	return rc;
+}
+
+/* One partition per reader unless asked otherwise, split on a reader
+ * of the pool. ranges is allocated for the caller. */
+static int32_t plan_partitions(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	date_range** ranges,
+	size_t* count) {
+
+	db_connection* reader;
+	int32_t rc;
+
+	*ranges = NULL;
+
+	if (!pool || !range) {
+		ERR_LOG("Pool or date range is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!pool->num_readers) {
+		ERR_LOG("Pool is not open");
+		return ERR_NOT_READY;
+	}
+
+	*count = num_partitions ? num_partitions : pool->num_readers;
+
+	*ranges = (date_range*)malloc(sizeof(date_range) * *count);
+	if (!*ranges) {
+		ERR_LOG("Unable to allocate [%zu] partition ranges", *count);
+		return ERR_NOMEM;
+	}
+
+	rc = checkout_reader(pool, &reader);
+	if (ERR_OK != rc) {
+		ERR_LOG("Unable to check out reader to split date range");
+		goto CLEAN_UP;
+	}
+
+	rc = split_date_range(reader, range, *count, *ranges, count);
+
+	checkin(pool, reader);
+
+CLEAN_UP:
+
+	if (ERR_OK != rc) {
+		free(*ranges);
+		*ranges = NULL;
+	}
+
+	return rc;
+}
+
+static int32_t query_expense_partition(db_connection* reader, date_range* range, void* result) {
+	return get_expenses_in_range(reader, range, (expense_list*)result);
+}
+
+static int32_t query_expense_type_partition(db_connection* reader, date_range* range, void* result) {
+	return get_expense_summary_by_expense_type(reader, range, (expense_summary_list*)result);
+}
+
+static int32_t query_payment_type_partition(db_connection* reader, date_range* range, void* result) {
+	return get_expense_summary_by_payment_type(reader, range, (expense_summary_list*)result);
+}
+
+int32_t get_expenses_in_range_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_list* expenses) {
+
+	expense_list* partials = NULL;
+	date_range* ranges;
+	size_t num_expenses = 0;
+	size_t i;
+	int32_t rc;
+
+	if (!expenses) {
+		ERR_LOG("Expenses structure is NULL");
+		return ERR_INVALID;
+	}
+
+	expenses->expenses = NULL;
+	expenses->num_expenses = 0;
+
+	rc = plan_partitions(pool, range, num_partitions, &ranges, &num_partitions);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	partials = (expense_list*)calloc(num_partitions, sizeof(expense_list));
+	if (!partials) {
+		ERR_LOG("Unable to allocate [%zu] partial results", num_partitions);
+		free(ranges);
+		return ERR_NOMEM;
+	}
+
+	rc = run_partitions(pool, ranges, num_partitions,
+		query_expense_partition, partials, sizeof(expense_list));
+	if (ERR_OK != rc) {
+		goto CLEAN_UP;
+	}
+
+	for (i = 0; i < num_partitions; ++i) {
+		num_expenses += partials[i].num_expenses;
+	}
+
+	if (!num_expenses) {
+		goto CLEAN_UP;
+	}
+
+	expenses->expenses = (expense*)malloc(sizeof(expense) * num_expenses);
+	if (!expenses->expenses) {
+		ERR_LOG("Unable to allocate [%zu] expenses", num_expenses);
+		rc = ERR_NOMEM;
+		goto CLEAN_UP;
+	}
+
+	/* Partitions are oldest first and each is newest first, so taking
+	 * them in reverse keeps the serial order. The descriptions move
+	 * with the expenses. */
+	for (i = num_partitions; i-- > 0;) {
+		if (!partials[i].num_expenses) {
+			continue;
+		}
+
+		memcpy(expenses->expenses + expenses->num_expenses,
+			partials[i].expenses,
+			sizeof(expense) * partials[i].num_expenses);
+		expenses->num_expenses += partials[i].num_expenses;
+
+		free(partials[i].expenses);
+		partials[i].expenses = NULL;
+		partials[i].num_expenses = 0;
+	}
+
+CLEAN_UP:
+
+	for (i = 0; i < num_partitions; ++i) {
+		free_expenses(&partials[i]);
+	}
+	free(partials);
+	free(ranges);
+
+	return rc;
+}
+
+static int compare_summaries(const void* a, const void* b) {
+	const expense_summary* left = (const expense_summary*)a;
+	const expense_summary* right = (const expense_summary*)b;
+
+	return (left->type > right->type) - (left->type < right->type);
+}
+
+static int32_t get_expense_summary_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	partition_query query,
+	expense_summary_list* summaries) {
+
+	expense_summary_list* partials = NULL;
+	expense_summary* merged;
+	date_range* ranges;
+	size_t num_summaries = 0;
+	size_t i;
+	size_t j;
+	int32_t rc;
+
+	if (!summaries) {
+		ERR_LOG("Summary structure is NULL");
+		return ERR_INVALID;
+	}
+
+	summaries->summaries = NULL;
+	summaries->num_summaries = 0;
+
+	rc = plan_partitions(pool, range, num_partitions, &ranges, &num_partitions);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	partials = (expense_summary_list*)calloc(num_partitions, sizeof(expense_summary_list));
+	if (!partials) {
+		ERR_LOG("Unable to allocate [%zu] partial summaries", num_partitions);
+		free(ranges);
+		return ERR_NOMEM;
+	}
+
+	rc = run_partitions(pool, ranges, num_partitions,
+		query, partials, sizeof(expense_summary_list));
+	if (ERR_OK != rc) {
+		goto CLEAN_UP;
+	}
+
+	for (i = 0; i < num_partitions; ++i) {
+		num_summaries += partials[i].num_summaries;
+	}
+
+	if (!num_summaries) {
+		goto CLEAN_UP;
+	}
+
+	merged = (expense_summary*)malloc(sizeof(expense_summary) * num_summaries);
+	if (!merged) {
+		ERR_LOG("Unable to allocate [%zu] summaries", num_summaries);
+		rc = ERR_NOMEM;
+		goto CLEAN_UP;
+	}
+
+	num_summaries = 0;
+	for (i = 0; i < num_partitions; ++i) {
+		if (!partials[i].num_summaries) {
+			continue;
+		}
+
+		memcpy(merged + num_summaries,
+			partials[i].summaries,
+			sizeof(expense_summary) * partials[i].num_summaries);
+		num_summaries += partials[i].num_summaries;
+	}
+
+	/* Fold the partial aggregates of each type together */
+	qsort(merged, num_summaries, sizeof(expense_summary), compare_summaries);
+
+	for (i = 0, j = 0; i < num_summaries; ++i) {
+		if (j && merged[j - 1].type == merged[i].type) {
+			merged[j - 1].count += merged[i].count;
+			merged[j - 1].total += merged[i].total;
+			if (merged[i].min < merged[j - 1].min) {
+				merged[j - 1].min = merged[i].min;
+			}
+			if (merged[i].max > merged[j - 1].max) {
+				merged[j - 1].max = merged[i].max;
+			}
+		}
+		else {
+			merged[j++] = merged[i];
+		}
+	}
+
+	summaries->summaries = merged;
+	summaries->num_summaries = j;
+
+CLEAN_UP:
+
+	for (i = 0; i < num_partitions; ++i) {
+		free_expense_summaries(&partials[i]);
+	}
+	free(partials);
+	free(ranges);
+
+	return rc;
+}
+
+int32_t get_expense_summary_by_expense_type_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_summary_list* summaries) {
+
+	return get_expense_summary_parallel(
+		pool, range, num_partitions, query_expense_type_partition, summaries);
+}
+
+int32_t get_expense_summary_by_payment_type_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_summary_list* summaries) {
+
+	return get_expense_summary_parallel(
+		pool, range, num_partitions, query_payment_type_partition, summaries);
+}
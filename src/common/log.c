@@ -6,19 +6,344 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <log.h>
+#include <error.h>
 
 #define FILENAME_AND_LINE_FORMATTING "[%s:%d]:"
 
+/* Must be a power of two */
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 232
+#define LOG_WAIT_TIMEOUT_NS 100000000L
+
+/** @struct log_record
+  *
+  * @details
+  *		Slot in the async ring. sequence tells producers and the
+  *		consumer who owns the slot (Vyukov bounded queue).
+  */
+struct log_record {
+	atomic_size_t sequence;
+	int32_t level;
+	int32_t line;
+	const char* file;
+	char message[LOG_MESSAGE_SIZE];
+} typedef log_record;
+
+/** @struct async_log
+  *
+  * @details
+  *		State of the asynchronous logging backend
+  */
+struct async_log {
+	log_record* ring;
+	atomic_size_t enqueue_pos;
+	size_t dequeue_pos;
+	atomic_uint_fast64_t dropped;
+	uint64_t reported_dropped;
+	atomic_bool consumer_waiting;
+	atomic_bool running;
+	sem_t wakeup;
+	pthread_t thread;
+	FILE* file;
+} typedef async_log;
+
+/* Published with release so producers that load it with acquire see
+ * the initialized ring */
+static _Atomic(async_log*) async_backend = NULL;
+
+_Atomic int32_t log_runtime_level = LOG_DEBUG;
+
+static const char* LEVEL_TO_STRING[] = {
+	"EMERG",
+	"ALERT",
+	"CRIT",
+	"ERR",
+	"WARNING",
+	"NOTICE",
+	"INFO",
+	"DEBUG"
+};
+
+static bool enqueue_record(
+	async_log* backend,
+	int32_t level,
+	const char* msg,
+	const char* file,
+	int32_t line,
+	va_list args)
+{
+	log_record* record;
+	size_t pos = atomic_load_explicit(&backend->enqueue_pos, memory_order_relaxed);
+	size_t sequence;
+	intptr_t diff;
+	int saved_errno = errno;
+
+	for (;;) {
+		record = &backend->ring[pos & (LOG_RING_SIZE - 1)];
+		sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+		diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if (0 == diff) {
+			if (atomic_compare_exchange_weak_explicit(
+					&backend->enqueue_pos,
+					&pos,
+					pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (0 > diff) {
+			atomic_fetch_add_explicit(&backend->dropped, 1, memory_order_relaxed);
+			return false;
+		}
+		else {
+			pos = atomic_load_explicit(&backend->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	record->level = level;
+	record->file = file;
+	record->line = line;
+
+	/* Keep %m pointing at the caller's errno */
+	errno = saved_errno;
+	vsnprintf(record->message, LOG_MESSAGE_SIZE, msg, args);
+
+	atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+
+	if (atomic_load(&backend->consumer_waiting)) {
+		sem_post(&backend->wakeup);
+	}
+
+	return true;
+}
+
+static void deliver_record(async_log* backend, const log_record* record)
+{
+	struct timespec now;
+	struct tm local;
+	char timestamp[32];
+
+	if (!backend->file) {
+		syslog(record->level, FILENAME_AND_LINE_FORMATTING "%s",
+			record->file, record->line, record->message);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &local);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &local);
+
+	fprintf(backend->file, "%s.%06ld %s " FILENAME_AND_LINE_FORMATTING "%s\n",
+		timestamp,
+		now.tv_nsec / 1000,
+		LEVEL_TO_STRING[record->level & LOG_PRIMASK],
+		record->file,
+		record->line,
+		record->message);
+}
+
+static void report_dropped(async_log* backend)
+{
+	uint64_t dropped = atomic_load_explicit(&backend->dropped, memory_order_relaxed);
+	log_record record = {0};
+
+	if (dropped == backend->reported_dropped) {
+		return;
+	}
+
+	record.level = LOG_WARNING;
+	record.file = __FILE__;
+	record.line = __LINE__;
+	snprintf(record.message, LOG_MESSAGE_SIZE,
+		"Dropped [%lu] log messages", dropped - backend->reported_dropped);
+	deliver_record(backend, &record);
+
+	backend->reported_dropped = dropped;
+}
+
+static size_t drain_records(async_log* backend)
+{
+	log_record* record;
+	size_t sequence;
+	size_t delivered = 0;
+
+	for (;;) {
+		record = &backend->ring[backend->dequeue_pos & (LOG_RING_SIZE - 1)];
+		sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+		if (sequence != backend->dequeue_pos + 1) {
+			break;
+		}
+
+		deliver_record(backend, record);
+
+		atomic_store_explicit(
+			&record->sequence,
+			backend->dequeue_pos + LOG_RING_SIZE,
+			memory_order_release);
+		++backend->dequeue_pos;
+		++delivered;
+	}
+
+	report_dropped(backend);
+
+	if (delivered && backend->file) {
+		fflush(backend->file);
+	}
+
+	return delivered;
+}
+
+static void* log_consumer(void* arg)
+{
+	async_log* backend = (async_log*)arg;
+	struct timespec deadline;
+
+	while (atomic_load(&backend->running)) {
+		if (drain_records(backend)) {
+			continue;
+		}
+
+		atomic_store(&backend->consumer_waiting, true);
+
+		/* A producer may have published before seeing the flag */
+		if (!drain_records(backend)) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_WAIT_TIMEOUT_NS;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_nsec -= 1000000000L;
+				++deadline.tv_sec;
+			}
+			sem_timedwait(&backend->wakeup, &deadline);
+		}
+
+		atomic_store(&backend->consumer_waiting, false);
+	}
+
+	drain_records(backend);
+
+	return NULL;
+}
+
 void open_log(const char* name)
 {
 	openlog(name, LOG_ODELAY | LOG_PID, LOG_USER);
 }
 
+/* Drains the ring and frees the backend */
+static void stop_backend(async_log* backend)
+{
+	atomic_store(&backend->running, false);
+	sem_post(&backend->wakeup);
+	pthread_join(backend->thread, NULL);
+
+	sem_destroy(&backend->wakeup);
+	if (backend->file) {
+		fclose(backend->file);
+	}
+	free(backend->ring);
+	free(backend);
+}
+
+int32_t open_log_async(const char* name, const char* file_path)
+{
+	async_log* backend;
+	async_log* expected = NULL;
+	size_t i;
+
+	if (atomic_load_explicit(&async_backend, memory_order_acquire)) {
+		return ERR_IN_USE;
+	}
+
+	open_log(name);
+
+	backend = (async_log*)calloc(1, sizeof(async_log));
+	if (!backend) {
+		syslog(LOG_CRIT, "Unable to allocate async log");
+		return ERR_NOMEM;
+	}
+
+	backend->ring = (log_record*)calloc(LOG_RING_SIZE, sizeof(log_record));
+	if (!backend->ring) {
+		syslog(LOG_CRIT, "Unable to allocate async log ring");
+		free(backend);
+		return ERR_NOMEM;
+	}
+
+	for (i = 0; i < LOG_RING_SIZE; ++i) {
+		atomic_init(&backend->ring[i].sequence, i);
+	}
+
+	if (file_path) {
+		backend->file = fopen(file_path, "a");
+		if (!backend->file) {
+			syslog(LOG_ERR, "Unable to open log file [%s]: [%m]", file_path);
+			free(backend->ring);
+			free(backend);
+			return ERR_KO;
+		}
+	}
+
+	sem_init(&backend->wakeup, 0, 0);
+	atomic_store(&backend->running, true);
+
+	if (0 != pthread_create(&backend->thread, NULL, log_consumer, backend)) {
+		syslog(LOG_CRIT, "Unable to start async log thread");
+		sem_destroy(&backend->wakeup);
+		if (backend->file) {
+			fclose(backend->file);
+		}
+		free(backend->ring);
+		free(backend);
+		return ERR_KO;
+	}
+
+	if (!atomic_compare_exchange_strong_explicit(&async_backend, &expected, backend,
+		memory_order_release, memory_order_relaxed)) {
+		stop_backend(backend);
+		return ERR_IN_USE;
+	}
+
+	return ERR_OK;
+}
+
+void set_log_level(int32_t level)
+{
+	atomic_store_explicit(&log_runtime_level, level, memory_order_relaxed);
+	setlogmask(LOG_UPTO(level));
+}
+
+uint64_t get_log_dropped()
+{
+	async_log* backend = atomic_load_explicit(&async_backend, memory_order_acquire);
+
+	if (!backend) {
+		return 0;
+	}
+
+	return atomic_load(&backend->dropped);
+}
+
 void close_log()
 {
+	/* Only one caller takes the backend so it is stopped once */
+	async_log* backend = atomic_exchange_explicit(
+		&async_backend, NULL, memory_order_acq_rel);
+
+	if (backend) {
+		stop_backend(backend);
+	}
+
 	closelog();
 }
 
@@ -26,6 +351,17 @@ void write_log(int32_t level, const char* msg, const char* file, int32_t line, .
 {
 
 	char* message = NULL;
+	async_log* backend = atomic_load_explicit(&async_backend, memory_order_acquire);
+
+	if (backend) {
+		va_list args;
+		va_start(args, line);
+
+		enqueue_record(backend, level, msg, file, line, args);
+
+		va_end(args);
+		return;
+	}
 
 	int32_t len = snprintf(
 		NULL,
@@ -33,7 +369,7 @@ void write_log(int32_t level, const char* msg, const char* file, int32_t line, .
 		FILENAME_AND_LINE_FORMATTING,
 		file,
 		line);
-	len += strlen(msg) + 1; 
+	len += strlen(msg) + 1;
 	message = (char*)malloc(sizeof(char) * len);
 	if (!message)
 	{
@@ -65,4 +401,3 @@ void write_log(int32_t level, const char* msg, const char* file, int32_t line, .
 
 	free(message);
 }
-
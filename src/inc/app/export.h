@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <budget_db/budget_db.h>
+
+enum export_format {
+	EXPORT_FORMAT_CSV,
+	EXPORT_FORMAT_JSON
+} typedef export_format;
+
+/** @struct export_options
+  *
+  * @details
+  *		Settings for exporting expenses. CSV is written with a header
+  *		and the columns read by import_csv, with dates as seconds since
+  *		the epoch. JSON is an array with one object per line.
+  */
+struct export_options {
+	int fd;
+	export_format format;
+	date_range range;
+	size_t buffer_size;
+} typedef export_options;
+
+/** @struct export_stats
+  *
+  * @details
+  *		Outcome of an export. writes is the number of write calls made.
+  */
+struct export_stats {
+	size_t rows_exported;
+	size_t bytes_written;
+	size_t writes;
+	double elapsed_sec;
+	double rows_per_sec;
+} typedef export_stats;
+
+/** @brief export_expenses
+  *
+  * @details
+  *		Streams the expenses in the range, newest first, from the
+  *		statement into an output buffer that is written to the file
+  *		descriptor each time it fills. No list of expenses is built so
+  *		memory use is bounded by the buffer size.
+  *
+  * @param[in] db
+  *		Open budget DB connection
+  *
+  * @param[in] options
+  *		Export settings. A 0 buffer size uses a default.
+  *
+  * @param[out] stats
+  *		Outcome of the export. May be NULL.
+  *
+  * @retval ERR_OK if every expense was written
+  */
+int32_t export_expenses(
+	db_connection* db,
+	const export_options* options,
+	export_stats* stats);
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <budget_db/budget_db.h>
+
+/** @struct import_options
+  *
+  * @details
+  *		Settings for importing a CSV bank export. Each line is
+  *		date,amount,description[,payment_type,expense_type] where date
+  *		is YYYY-MM-DD (UTC) or seconds since the epoch. amount is
+  *		converted exactly to cents, so fractions of a cent are
+  *		rejected. Fields may be double quoted with "" escaping a quote,
+  *		and quoted fields may span lines, as export writes them. Rows
+  *		without types use the default types.
+  */
+struct import_options {
+	const char* path;
+	size_t num_threads;
+	size_t batch_size;
+	uint32_t payment_type;
+	uint32_t expense_type;
+} typedef import_options;
+
+/** @struct import_stats
+  *
+  * @details
+  *		Outcome of an import. Malformed rows are skipped.
+  */
+struct import_stats {
+	size_t rows_imported;
+	size_t rows_skipped;
+	size_t batches;
+	double elapsed_sec;
+	double rows_per_sec;
+} typedef import_stats;
+
+/** @brief parse_calendar_date
+  *
+  * @details
+  *		Parses a YYYY-MM-DD date, with one or two digit month and day,
+  *		into the seconds since the epoch at its start in UTC. Dates
+  *		that do not exist, such as 2024-02-30, are rejected rather than
+  *		moved to the next month.
+  *
+  * @param[in] text
+  *		Date without surrounding spaces
+  *
+  * @param[out] date
+  *		Start of the day
+  *
+  * @retval true if text is a valid date
+  */
+bool parse_calendar_date(const char* text, time_t* date);
+
+/** @brief import_csv
+  *
+  * @details
+  *		Maps the file and splits it into one chunk per thread at row
+  *		boundaries, found by walking the rows since a quoted field may
+  *		hold newlines. Worker threads parse their chunk into batches of
+  *		expenses which the calling thread inserts with
+  *		insert_expenses_bulk, so parsing runs in parallel with the
+  *		single writer. Each batch is committed on its own, so on
+  *		failure the batches already inserted are kept.
+  *
+  * @param[in] db
+  *		Open budget DB connection
+  *
+  * @param[in] options
+  *		Import settings. 0 threads uses one per online CPU and a 0 batch
+  *		size uses a default.
+  *
+  * @param[out] stats
+  *		Outcome of the import. May be NULL.
+  *
+  * @retval ERR_OK if every batch was inserted
+  */
+int32_t import_csv(
+	db_connection* db,
+	const import_options* options,
+	import_stats* stats);
+
+#endif
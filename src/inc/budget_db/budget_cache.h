@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#ifndef BUDGET_CACHE_H
+#define BUDGET_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <budget_db/budget_db.h>
+#include <sql/sql_db.h>
+
+/** @struct cached_row_ops
+  *
+  * @details
+  *		Deep copies rows holding pointers into and out of the result
+  *		cache. pack copies decoded rows, and everything they point at,
+  *		into a single allocation of size bytes owned by the cache. copy
+  *		copies packed rows into allocations owned by the caller, as if
+  *		they had just been decoded.
+  */
+struct cached_row_ops {
+	int32_t (*pack)(const void* rows, size_t num_rows, void** packed, size_t* size);
+	int32_t (*copy)(const void* packed, size_t num_rows, void** rows);
+} typedef cached_row_ops;
+
+/** @brief execute_cached_query
+  *
+  * @details
+  *		Same as execute_mapped_query but returns a copy of the rows from
+  *		the result cache of the query's connection when it holds them
+  *		for the current generation, and caches the rows read otherwise.
+  *		Without a cache the query is simply executed.
+  *
+  *		Every lookup first calls check_db_changed on the connection, so
+  *		even a hit runs PRAGMA data_version in SQLite. A hit saves the
+  *		query and decoding its rows, not the trip to SQLite.
+  *
+  * @param[in] ops
+  *		How to copy rows holding pointers. NULL for rows that can be
+  *		copied byte for byte.
+  *
+  * @retval 0 if query was executed or served from the cache
+  */
+int32_t execute_cached_query(
+	db_query* query,
+	db_row_mapper mapper,
+	size_t row_size,
+	const cached_row_ops* ops,
+	void** rows,
+	size_t* num_rows);
+
+#endif
@@ -8,13 +8,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <sql/sql_db.h>
+#include <sql/sql_pool.h>
 
 #define ON_DATE 0x01
 #define BEFORE_DATE 0x02
 #define AFTER_DATE 0x04
 
+/* 0000-01-01T00:00:00Z to 9999-12-31T23:59:59Z, what SQLite's date
+ * functions handle */
+#define MIN_EXPENSE_DATE (-62167219200LL)
+#define MAX_EXPENSE_DATE 253402300799LL
+
 #define EQUALS_AMOUNT 0x01
 #define LESS_THAN_AMOUNT 0x02
 #define GREATER_THAN_AMOUNT 0x04
@@ -22,10 +29,12 @@
 /** @struct expense
   *
   * @details
-  *		Struct containing all information of an expense
+  *		Struct containing all information of an expense. amount is in
+  *		cents. date is in seconds since the epoch, from
+  *		MIN_EXPENSE_DATE to MAX_EXPENSE_DATE.
   */
 struct expense {
-	double amount;
+	int64_t amount;
 	uint32_t payment_type;
 	uint32_t expense_type;
 	time_t date;
@@ -43,16 +52,155 @@ struct expense_list {
 	size_t num_expenses;
 } typedef expense_list;
 
+/** @struct bulk_insert_options
+  *
+  * @details
+  *		Options for insert_expenses_bulk. A batch_size of 0 inserts all
+  *		expenses in a single transaction.
+  */
+struct bulk_insert_options {
+	size_t batch_size;
+} typedef bulk_insert_options;
+
+/** @struct bulk_insert_stats
+  *
+  * @details
+  *		Throughput of a completed insert_expenses_bulk call
+  */
+struct bulk_insert_stats {
+	size_t rows_inserted;
+	size_t batches_committed;
+	double elapsed_sec;
+	double rows_per_sec;
+} typedef bulk_insert_stats;
+
+/** @struct expense_summary
+  *
+  * @details
+  *		Aggregate of the expenses sharing an expense or payment type,
+  *		with amounts in cents
+  */
+struct expense_summary {
+	uint32_t type;
+	size_t count;
+	int64_t total;
+	int64_t min;
+	int64_t max;
+} typedef expense_summary;
+
+/** @struct expense_summary_list
+  *
+  * @details
+  *		Contains a list of summaries ordered by type and the number of
+  *		summaries in the list
+  */
+struct expense_summary_list {
+	expense_summary* summaries;
+	size_t num_summaries;
+} typedef expense_summary_list;
+
+/** @struct monthly_total
+  *
+  * @details
+  *		Rollup of the expenses in one month for an expense and payment
+  *		type. year_month is the UTC year * 100 + month, e.g. 202003.
+  *		total is in cents.
+  */
+struct monthly_total {
+	int32_t year_month;
+	uint32_t expense_type;
+	uint32_t payment_type;
+	size_t count;
+	int64_t total;
+} typedef monthly_total;
+
+/** @struct monthly_total_list
+  *
+  * @details
+  *		Contains a list of monthly totals and the number of totals in
+  *		the list
+  */
+struct monthly_total_list {
+	monthly_total* totals;
+	size_t num_totals;
+} typedef monthly_total_list;
+
 struct date_range {
 	time_t start;
 	time_t end;
 } typedef date_range;
 
+/** @struct result_cache
+  *
+  * @details
+  *		LRU cache of the decoded results of expense, summary and monthly
+  *		total queries, keyed by statement text and parameter values. It
+  *		is used by every connection whose result_cache points at it, so
+  *		the connections of a pool can share one. generation is bumped by
+  *		insert_expenses and rebuild_monthly_totals, and before a lookup
+  *		whenever check_db_changed reports the database changed since that
+  *		connection's last lookup, so writes through any connection or
+  *		another process are seen. Entries from an older generation are
+  *		never returned.
+  */
+struct result_cache {
+	struct result_cache_entry** buckets;
+	size_t num_buckets;
+	struct result_cache_entry* newest;
+	struct result_cache_entry* oldest;
+	size_t num_entries;
+	size_t capacity;
+	size_t num_bytes;
+	size_t max_bytes;
+	uint64_t generation;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	pthread_mutex_t lock;
+} typedef result_cache;
+
+/** @struct expense_filter
+  *
+  * @details
+  *		Predicates an expense must all match. AFTER_DATE keeps expenses
+  *		after range.start and BEFORE_DATE those before range.end, with
+  *		ON_DATE making the bounds inclusive. ON_DATE on its own keeps
+  *		expenses dated range.start. GREATER_THAN_AMOUNT,
+  *		LESS_THAN_AMOUNT and EQUALS_AMOUNT apply the same way to
+  *		min_amount and max_amount, in cents. An empty type set matches
+  *		every type, so a zeroed filter matches every expense.
+  */
+struct expense_filter {
+	uint8_t date_flags;
+	date_range range;
+	uint8_t amount_flags;
+	int64_t min_amount;
+	int64_t max_amount;
+	const uint32_t* payment_types;
+	size_t num_payment_types;
+	const uint32_t* expense_types;
+	size_t num_expense_types;
+} typedef expense_filter;
+
+/** @struct expense_page_key
+  *
+  * @details
+  *		Position of the last expense of a page in (date, id) order.
+  *		Starting from a date with an id of 0 includes the expenses on
+  *		that date, as ids start at 1.
+  */
+struct expense_page_key {
+	time_t date;
+	int64_t id;
+} typedef expense_page_key;
+
 /** @brief open_budget_db
   *
   * @details
   *		Opens a db to the underlying database for reading and
-  *		writing. Caller is responsible for calling close_budget_db when
+  *		writing. Storage settings are taken from db->options, which
+  *		may be NULL or a preset such as DB_OPTIONS_HIGH_THROUGHPUT.
+  *		Caller is responsible for calling close_budget_db when
   *		finished
   *
   * @param[in] db
@@ -74,6 +222,86 @@ int32_t open_budget_db(db_connection* db);
   */
 int32_t close_budget_db(db_connection* db);
 
+/** @brief open_budget_pool
+  *
+  * @details
+  *		Opens a pool of connections to the budget database in WAL mode
+  *		and migrates the schema through the writer. Queries on readers
+  *		checked out of the pool run concurrently with each other and
+  *		with inserts on the writer. Caller is responsible for calling
+  *		close_budget_pool when finished.
+  *
+  * @param[in] pool
+  *		Pool to open
+  *
+  * @param[in] db_path
+  *		Directory containing the database
+  *
+  * @param[in] num_readers
+  *		Number of reader connections. 0 opens one per online CPU.
+  *
+  * @param[in] options
+  *		Storage options for every connection, e.g.
+  *		DB_OPTIONS_HIGH_THROUGHPUT. May be NULL.
+  *
+  * @retval ERR_OK if pool opened
+  */
+int32_t open_budget_pool(
+	db_pool* pool,
+	const char* db_path,
+	size_t num_readers,
+	const db_options* options);
+
+/** @brief close_budget_pool
+  *
+  * @details
+  *		Closes every connection in the pool
+  *
+  * @param[in] pool
+  *		Pool to close
+  *
+  * @retval ERR_OK if pool closed
+  */
+int32_t close_budget_pool(db_pool* pool);
+
+/** @brief open_result_cache
+  *
+  * @details
+  *		Initializes an empty result cache. Point db_connection's
+  *		result_cache at it to cache that connection's results. Caller
+  *		is responsible for calling close_result_cache once no connection
+  *		uses it.
+  *
+  * @param[in] cache
+  *		Cache to initialize
+  *
+  * @param[in] capacity
+  *		Maximum number of results kept. 0 uses a default.
+  *
+  * @param[in] max_bytes
+  *		Maximum memory used by the results. Larger results are not
+  *		cached. 0 uses a default.
+  *
+  * @retval ERR_OK if cache initialized
+  */
+int32_t open_result_cache(result_cache* cache, size_t capacity, size_t max_bytes);
+
+/** @brief close_result_cache
+  *
+  * @details
+  *		Frees every cached result
+  */
+void close_result_cache(result_cache* cache);
+
+/** @brief invalidate_result_cache
+  *
+  * @details
+  *		Bumps the generation of the cache so results read before now
+  *		are no longer returned. Called by the budget DB after writes and
+  *		when a lookup finds the database changed. cache may be NULL.
+  */
+void invalidate_result_cache(result_cache* cache);
+
 /** @brief insert_expenses
   *
   * @details
@@ -86,13 +314,102 @@ int32_t close_budget_db(db_connection* db);
   *		The expenses to insert
   *
   * @retval ERR_OK if all expenses added
+  * @retval ERR_INVALID if a date is out of range, nothing is added
   */
 int32_t insert_expenses(db_connection* db, expense_list* expenses);
 
+/** @brief insert_expenses_bulk
+  *
+  * @details
+  *		Inserts the expenses into the database reusing a single prepared
+  *		statement. Descriptions are bound without being copied. When a
+  *		batch size is given a transaction is committed every batch_size
+  *		rows, so on failure only the current batch is rolled back. The
+  *		monthly rollups are updated in the same transaction as each
+  *		batch.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] expenses
+  *		The expenses to insert
+  *
+  * @param[in] options
+  *		Insert options. May be NULL to use a single transaction.
+  *
+  * @param[out] stats
+  *		Throughput of the insert. May be NULL.
+  *
+  * @retval ERR_OK if all expenses added
+  * @retval ERR_INVALID if a date is out of range, nothing is added
+  */
+int32_t insert_expenses_bulk(
+	db_connection* db,
+	expense_list* expenses,
+	const bulk_insert_options* options,
+	bulk_insert_stats* stats);
+
+/** @brief get_expenses_matching
+  *
+  * @details
+  *		Gets the expenses matching filter, newest first. The statement
+  *		is built from the predicates set in the filter so they can use
+  *		the date and type indexes, and is cached per filter shape. Type
+  *		sets are padded to a power of two to limit the number of shapes.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] filter
+  *		Predicates to match
+  *
+  * @param[out] expenses
+  *		The expenses retrieved
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t get_expenses_matching(
+	db_connection* db,
+	const expense_filter* filter,
+	expense_list* expenses);
+
+/** @brief get_expenses_page
+  *
+  * @details
+  *		Gets the next page of expenses matching filter after key,
+  *		oldest first. The query seeks straight to key in the date index
+  *		so every page costs the same however deep it is. key is
+  *		advanced to the last expense returned. A page with fewer than
+  *		page_size expenses is the last.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] filter
+  *		Predicates to match
+  *
+  * @param[in] page_size
+  *		Maximum number of expenses to return
+  *
+  * @param[in,out] key
+  *		Position to continue after
+  *
+  * @param[out] expenses
+  *		The expenses retrieved
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t get_expenses_page(
+	db_connection* db,
+	const expense_filter* filter,
+	size_t page_size,
+	expense_page_key* key,
+	expense_list* expenses);
+
 /** @brief get_expenses_in_range
   *
   * @details
-  *		Gets expenses from the specified date range
+  *		Gets expenses from the specified date range, newest first
   *
   * @param[in] db
   *		db_connection information
@@ -111,7 +428,7 @@ int32_t get_expenses_in_range(db_connection* db, date_range* range, expense_list
   *
   * @details
   *		Gets expenses from the specified date range with the specified
-  *		payment type
+  *		payment type, newest first
   *
   * @param[in] db
   *		db_connection information
@@ -137,7 +454,7 @@ int32_t get_expenses_in_range_with_payment_type(
   *
   * @details
   *		Gets expenses from the specified date range with the specified
-  *		expense type
+  *		expense type, newest first
   *
   * @param[in] db
   *		db_connection information
@@ -159,5 +476,282 @@ int32_t get_expenses_in_range_with_expense_type(
 	uint32_t expense_type,
 	expense_list* expenses);
 
+/** @brief expense_callback
+  *
+  * @details
+  *		Called for every expense found by for_each_expense_in_range. The
+  *		expense and its description are only valid until the callback
+  *		returns. Returning anything but ERR_OK stops the query and the
+  *		value is returned to the caller.
+  */
+typedef int32_t (*expense_callback)(const expense* expense, void* ctx);
+
+/** @brief for_each_expense_in_range
+  *
+  * @details
+  *		Streams expenses from the specified date range, newest first,
+  *		to callback as they are stepped from the statement. Nothing is
+  *		allocated per row so memory use does not grow with the range.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] range
+  *		Date range to check for expenses in
+  *
+  * @param[in] callback
+  *		Called once per expense
+  *
+  * @param[in] ctx
+  *		Passed through to callback
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t for_each_expense_in_range(
+	db_connection* db,
+	date_range* range,
+	expense_callback callback,
+	void* ctx);
+
+/** @brief get_expense_summary_by_expense_type
+  *
+  * @details
+  *		Gets the count, total, minimum and maximum of the expenses in the
+  *		specified date range for each expense type. Aggregation is done
+  *		by the database so only one row per type is returned.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] range
+  *		Date range to summarize
+  *
+  * @param[out] summaries
+  *		One summary per expense type found in the range
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t get_expense_summary_by_expense_type(
+	db_connection* db,
+	date_range* range,
+	expense_summary_list* summaries);
+
+/** @brief get_expense_summary_by_payment_type
+  *
+  * @details
+  *		Gets the count, total, minimum and maximum of the expenses in the
+  *		specified date range for each payment type
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] range
+  *		Date range to summarize
+  *
+  * @param[out] summaries
+  *		One summary per payment type found in the range
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t get_expense_summary_by_payment_type(
+	db_connection* db,
+	date_range* range,
+	expense_summary_list* summaries);
+
+/** @brief split_date_range
+  *
+  * @details
+  *		Splits the date range into contiguous sub-ranges, oldest first,
+  *		holding about as many expenses each, however they are spread
+  *		over the range. Splits are read from the date index with
+  *		OFFSET, so this walks the index entries in the range about
+  *		twice. Expenses sharing a date stay in one sub-range, and there
+  *		are never more sub-ranges than expenses, so fewer than
+  *		max_partitions may be returned. The first and last sub-ranges
+  *		reach the ends of range.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] range
+  *		Date range to split
+  *
+  * @param[in] max_partitions
+  *		Most sub-ranges to return, at least 1
+  *
+  * @param[out] partitions
+  *		Room for max_partitions sub-ranges
+  *
+  * @param[out] num_partitions
+  *		Number of sub-ranges returned
+  *
+  * @retval ERR_OK if the range was split
+  */
+int32_t split_date_range(
+	db_connection* db,
+	const date_range* range,
+	size_t max_partitions,
+	date_range* partitions,
+	size_t* num_partitions);
+
+/** @brief get_expenses_in_range_parallel
+  *
+  * @details
+  *		Splits the date range with split_date_range and gets the
+  *		expenses of each sub-range on its own thread and reader checked
+  *		out of the pool. The partial results are merged so expenses are
+  *		returned newest first, as by get_expenses_in_range.
+  *
+  *		Each reader reads in its own transaction, so while the writer
+  *		commits the partial results may come from different snapshots
+  *		and the merged result is not one consistent view.
+  *
+  * @param[in] pool
+  *		Open budget DB pool
+  *
+  * @param[in] range
+  *		Date range to check for expenses in
+  *
+  * @param[in] num_partitions
+  *		Most sub-ranges to use. 0 uses one per reader in the pool.
+  *
+  * @param[out] expenses
+  *		The expenses retrieved
+  *
+  * @retval ERR_OK if every partition succeeded
+  */
+int32_t get_expenses_in_range_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_list* expenses);
+
+/** @brief get_expense_summary_by_expense_type_parallel
+  *
+  * @details
+  *		Summarizes each sub-range of the date range, split as by
+  *		get_expenses_in_range_parallel and with the same snapshot
+  *		caveat, on its own reader and combines the partial aggregates
+  *		per expense type
+  *
+  * @param[in] pool
+  *		Open budget DB pool
+  *
+  * @param[in] range
+  *		Date range to summarize
+  *
+  * @param[in] num_partitions
+  *		Most sub-ranges to use. 0 uses one per reader in the pool.
+  *
+  * @param[out] summaries
+  *		One summary per expense type found in the range
+  *
+  * @retval ERR_OK if every partition succeeded
+  */
+int32_t get_expense_summary_by_expense_type_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_summary_list* summaries);
+
+/** @brief get_expense_summary_by_payment_type_parallel
+  *
+  * @details
+  *		Summarizes each sub-range of the date range, split as by
+  *		get_expenses_in_range_parallel and with the same snapshot
+  *		caveat, on its own reader and combines the partial aggregates
+  *		per payment type
+  *
+  * @param[in] pool
+  *		Open budget DB pool
+  *
+  * @param[in] range
+  *		Date range to summarize
+  *
+  * @param[in] num_partitions
+  *		Most sub-ranges to use. 0 uses one per reader in the pool.
+  *
+  * @param[out] summaries
+  *		One summary per payment type found in the range
+  *
+  * @retval ERR_OK if every partition succeeded
+  */
+int32_t get_expense_summary_by_payment_type_parallel(
+	db_pool* pool,
+	date_range* range,
+	size_t num_partitions,
+	expense_summary_list* summaries);
+
+/** @brief get_monthly_totals
+  *
+  * @details
+  *		Gets the precomputed monthly rollups between two months,
+  *		inclusive, ordered by month then expense and payment type. The
+  *		rollups are kept up to date by insert_expenses so expenses are
+  *		not rescanned.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @param[in] start_month
+  *		First month as year * 100 + month
+  *
+  * @param[in] end_month
+  *		Last month as year * 100 + month
+  *
+  * @param[out] totals
+  *		The monthly totals retrieved
+  *
+  * @retval ERR_OK if no errors
+  */
+int32_t get_monthly_totals(
+	db_connection* db,
+	int32_t start_month,
+	int32_t end_month,
+	monthly_total_list* totals);
+
+/** @brief rebuild_monthly_totals
+  *
+  * @details
+  *		Recomputes the monthly rollups from the expenses table. Only
+  *		needed if expenses were changed outside of insert_expenses.
+  *
+  * @param[in] db
+  *		db_connection information
+  *
+  * @retval ERR_OK if rollups rebuilt
+  */
+int32_t rebuild_monthly_totals(db_connection* db);
+
+/** @brief free_monthly_totals
+  *
+  * @details
+  *		Helper to free monthly totals retrieved from the database
+  *
+  * @param[in] totals
+  *		The totals to free
+  */
+void free_monthly_totals(monthly_total_list* restrict totals);
+
+/** @brief free_expense_summaries
+  *
+  * @details
+  *		Helper to free summaries retrieved from the database
+  *
+  * @param[in] summaries
+  *		The summaries to free
+  */
+void free_expense_summaries(expense_summary_list* restrict summaries);
+
+/** @brief free_expenses
+  *
+  * @details
+  *		Helper to free expenses retrieved from the database
+  *
+  * @param[in] expenses
+  *		The expenses to free
+  */
+void free_expenses(expense_list* restrict expenses);
+
 #endif
 
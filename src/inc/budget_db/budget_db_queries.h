@@ -12,7 +12,6 @@
 #define EXPENSE_TYPE_COL "expense_type"
 #define DESCRIPTION_COL "description"
 
-#define ID_PARAM "$id"
 #define AMOUNT_PARAM "$amount"
 #define DATE_PARAM "$date"
 #define PAYMENT_TYPE_PARAM "$payment_type"
@@ -26,22 +25,45 @@
 #define EXPENSE_TYPE_INDEX 4
 #define DESCRIPTION_INDEX 5
 
-#define NUM_EXPENSE_PARAMS 6
+#define NUM_EXPENSE_COLS 6
+
+#define INSERT_AMOUNT_INDEX 0
+#define INSERT_DATE_INDEX 1
+#define INSERT_PAYMENT_TYPE_INDEX 2
+#define INSERT_EXPENSE_TYPE_INDEX 3
+#define INSERT_DESCRIPTION_INDEX 4
+
+#define NUM_INSERT_PARAMS 5
+
+/* Bind positions follow the order parameters first appear in the query */
+#define INSERT_AMOUNT_POSITION 1
+#define INSERT_DATE_POSITION 2
+#define INSERT_PAYMENT_TYPE_POSITION 3
+#define INSERT_EXPENSE_TYPE_POSITION 4
+#define INSERT_DESCRIPTION_POSITION 5
 
 #define START_DATE_PARAM "$start"
 #define END_DATE_PARAM "$end"
+#define MIN_AMOUNT_PARAM "$min_amount"
+#define MAX_AMOUNT_PARAM "$max_amount"
+#define KEY_DATE_PARAM "$key_date"
+#define KEY_ID_PARAM "$key_id"
+#define LIMIT_PARAM "$limit"
 
 #define NUM_RANGE_PARAMS 2
-#define NUM_RANGE_PARAMS_WITH_TYPE 3
 
 #define START_DATE_INDEX 0
 #define END_DATE_INDEX 1
-#define TYPE_INDEX 2
+
+#define START_DATE_POSITION 1
+#define END_DATE_POSITION 2
 
 #define BEGIN_TRANSACTION "BEGIN TRANSACTION"
 
 #define END_TRANSACTION "END TRANSACTION"
 
+#define ROLLBACK_TRANSACTION "ROLLBACK TRANSACTION"
+
 #define CREATE_EXPENSES_TABLE \
 	"CREATE TABLE IF NOT EXISTS expenses(" \
 	"id INT PRIMARY KEY NOT NULL," \
@@ -51,29 +73,196 @@
 	"expense_type INT NOT NULL," \
 	"description TEXT NOT NULL);"
 
+/* id is an alias for the rowid so SQLite assigns it on insert */
+#define CREATE_EXPENSES_ROWID_TABLE \
+	"CREATE TABLE expenses_rowid(" \
+	"id INTEGER PRIMARY KEY," \
+	"amount REAL NOT NULL," \
+	"date INT NOT NULL," \
+	"payment_type INT NOT NULL," \
+	"expense_type INT NOT NULL," \
+	"description TEXT NOT NULL);"
+
+#define COPY_EXPENSES_TO_ROWID_TABLE \
+	"INSERT INTO expenses_rowid " \
+	"SELECT id, amount, date, payment_type, expense_type, description " \
+	"FROM expenses ORDER BY id;"
+
+#define DROP_EXPENSES_TABLE "DROP TABLE expenses;"
+
+#define RENAME_EXPENSES_ROWID_TABLE \
+	"ALTER TABLE expenses_rowid RENAME TO expenses;"
+
+/* Amounts are stored as integer cents */
+#define CREATE_EXPENSES_CENTS_TABLE \
+	"CREATE TABLE expenses_cents(" \
+	"id INTEGER PRIMARY KEY," \
+	"amount INT NOT NULL," \
+	"date INT NOT NULL," \
+	"payment_type INT NOT NULL," \
+	"expense_type INT NOT NULL," \
+	"description TEXT NOT NULL);"
+
+#define COPY_EXPENSES_TO_CENTS_TABLE \
+	"INSERT INTO expenses_cents " \
+	"SELECT id, CAST(ROUND(amount * 100) AS INT), date, payment_type, expense_type, description " \
+	"FROM expenses ORDER BY id;"
+
+#define RENAME_EXPENSES_CENTS_TABLE \
+	"ALTER TABLE expenses_cents RENAME TO expenses;"
+
+#define CREATE_DATE_INDEX \
+	"CREATE INDEX IF NOT EXISTS expenses_date_idx " \
+	"ON expenses(date);"
+
+#define CREATE_PAYMENT_TYPE_DATE_INDEX \
+	"CREATE INDEX IF NOT EXISTS expenses_payment_type_date_idx " \
+	"ON expenses(payment_type, date);"
+
+#define CREATE_EXPENSE_TYPE_DATE_INDEX \
+	"CREATE INDEX IF NOT EXISTS expenses_expense_type_date_idx " \
+	"ON expenses(expense_type, date);"
+
+/* The schema every migration leads to, created directly on a new
+ * database. Must be kept in step with the last migration. */
+#define CREATE_CURRENT_EXPENSES_TABLE \
+	"CREATE TABLE expenses(" \
+	"id INTEGER PRIMARY KEY," \
+	"amount INT NOT NULL," \
+	"date INT NOT NULL," \
+	"payment_type INT NOT NULL," \
+	"expense_type INT NOT NULL," \
+	"description TEXT NOT NULL);"
+
+#define COUNT_EXPENSES_TABLES \
+	"SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='expenses';"
+
+#define SELECT_SCHEMA_VERSION "PRAGMA user_version;"
+
+#define SET_SCHEMA_VERSION "PRAGMA user_version = %d;"
+
 #define INSERT_EXPENSE \
 	"INSERT INTO expenses (" \
-	"id, " \
 	"amount, " \
 	"date, " \
 	"payment_type, " \
 	"expense_type, " \
 	"description) "\
-	"VALUES ($id, $amount, $date, $payment_type, $expense_type, $description);"
+	"VALUES ($amount, $date, $payment_type, $expense_type, $description);"
+
+#define SELECT_EXPENSES "SELECT * FROM expenses"
+
+/* Part of the range functions' contract. Index entries end with the
+ * rowid, so with one type or none this is a backward index scan; an IN
+ * list of types needs a sort. */
+#define ORDER_EXPENSES_NEWEST_FIRST " ORDER BY date DESC, id DESC;"
+
+#define EXPENSES_AFTER_KEY "(date,id)>(?,?)"
+
+#define ORDER_EXPENSES_BY_KEY " ORDER BY date, id LIMIT ?;"
+
+#define SUMMARY_TYPE_INDEX 0
+#define SUMMARY_COUNT_INDEX 1
+#define SUMMARY_TOTAL_INDEX 2
+#define SUMMARY_MIN_INDEX 3
+#define SUMMARY_MAX_INDEX 4
+
+#define NUM_SUMMARY_COLS 5
+
+#define SELECT_SUMMARY_BY_EXPENSE_TYPE \
+	"SELECT expense_type, COUNT(*), SUM(amount), MIN(amount), MAX(amount) " \
+	"FROM expenses WHERE date>=$start AND date<=$end " \
+	"GROUP BY expense_type ORDER BY expense_type;"
+
+#define SELECT_SUMMARY_BY_PAYMENT_TYPE \
+	"SELECT payment_type, COUNT(*), SUM(amount), MIN(amount), MAX(amount) " \
+	"FROM expenses WHERE date>=$start AND date<=$end " \
+	"GROUP BY payment_type ORDER BY payment_type;"
+
+/* Both walk the date index only, never the table */
+#define COUNT_EXPENSES_IN_RANGE \
+	"SELECT COUNT(*) FROM expenses WHERE date>=$start AND date<=$end;"
+
+#define SELECT_DATE_AT_OFFSET \
+	"SELECT date FROM expenses WHERE date>=$start AND date<=$end " \
+	"ORDER BY date LIMIT 1 OFFSET $offset;"
+
+#define OFFSET_PARAM "$offset"
+
+#define OFFSET_INDEX 2
+#define NUM_OFFSET_PARAMS 3
+#define OFFSET_POSITION 3
+
+#define YEAR_MONTH_PARAM "$year_month"
+#define COUNT_PARAM "$count"
+#define TOTAL_PARAM "$total"
 
-#define SELECT_EXPENSES_IN_RANGE \
-	"SELECT * FROM expenses WHERE date>=$start AND date<=$end;"
+#define UPSERT_YEAR_MONTH_INDEX 0
+#define UPSERT_EXPENSE_TYPE_INDEX 1
+#define UPSERT_PAYMENT_TYPE_INDEX 2
+#define UPSERT_COUNT_INDEX 3
+#define UPSERT_TOTAL_INDEX 4
 
-#define SELECT_EXPENSES_IN_RANGE_WITH_PAYMENT_TYPE \
-	"SELECT * FROM expenses WHERE date>=$start AND date<=$end AND " \
-	"payment_type=$payment_type;"
+#define NUM_UPSERT_PARAMS 5
 
-#define SELECT_EXPENSES_IN_RANGE_WITH_EXPENSE_TYPE \
-	"SELECT * FROM expenses WHERE date>=$start AND date<=$end AND " \
-	"expense_type=$expense_type;"
+#define UPSERT_YEAR_MONTH_POSITION 1
+#define UPSERT_EXPENSE_TYPE_POSITION 2
+#define UPSERT_PAYMENT_TYPE_POSITION 3
+#define UPSERT_COUNT_POSITION 4
+#define UPSERT_TOTAL_POSITION 5
+
+#define MONTHLY_YEAR_MONTH_INDEX 0
+#define MONTHLY_EXPENSE_TYPE_INDEX 1
+#define MONTHLY_PAYMENT_TYPE_INDEX 2
+#define MONTHLY_COUNT_INDEX 3
+#define MONTHLY_TOTAL_INDEX 4
+
+#define NUM_MONTHLY_COLS 5
+
+/* Keyed so a range of months is a single primary key range scan */
+#define CREATE_MONTHLY_TOTALS_TABLE \
+	"CREATE TABLE IF NOT EXISTS monthly_totals(" \
+	"year_month INT NOT NULL," \
+	"expense_type INT NOT NULL," \
+	"payment_type INT NOT NULL," \
+	"count INT NOT NULL," \
+	"total REAL NOT NULL," \
+	"PRIMARY KEY (year_month, expense_type, payment_type)) WITHOUT ROWID;"
+
+#define DROP_MONTHLY_TOTALS_TABLE "DROP TABLE monthly_totals;"
+
+#define CREATE_MONTHLY_TOTALS_CENTS_TABLE \
+	"CREATE TABLE monthly_totals(" \
+	"year_month INT NOT NULL," \
+	"expense_type INT NOT NULL," \
+	"payment_type INT NOT NULL," \
+	"count INT NOT NULL," \
+	"total INT NOT NULL," \
+	"PRIMARY KEY (year_month, expense_type, payment_type)) WITHOUT ROWID;"
+
+/* year_month is YYYYMM in UTC, matching monthly_total_key in budget_db.c */
+#define FILL_MONTHLY_TOTALS \
+	"INSERT INTO monthly_totals " \
+	"SELECT CAST(strftime('%Y%m', date, 'unixepoch') AS INT), " \
+	"expense_type, payment_type, COUNT(*), SUM(amount) " \
+	"FROM expenses GROUP BY 1, 2, 3;"
+
+#define CLEAR_MONTHLY_TOTALS "DELETE FROM monthly_totals;"
+
+#define UPSERT_MONTHLY_TOTAL \
+	"INSERT INTO monthly_totals (" \
+	"year_month, " \
+	"expense_type, " \
+	"payment_type, " \
+	"count, " \
+	"total) " \
+	"VALUES ($year_month, $expense_type, $payment_type, $count, $total) " \
+	"ON CONFLICT (year_month, expense_type, payment_type) DO UPDATE SET " \
+	"count = count + excluded.count, total = total + excluded.total;"
 
-#define SELECT_NUM_ROWS \
-	"SELECT COUNT(*) FROM expenses;"
+#define SELECT_MONTHLY_TOTALS_IN_RANGE \
+	"SELECT * FROM monthly_totals WHERE year_month>=$start AND year_month<=$end " \
+	"ORDER BY year_month, expense_type, payment_type;"
 
 #endif
 
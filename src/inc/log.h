@@ -7,24 +7,86 @@
 
 #include <syslog.h>
 #include <stdint.h>
+#include <stdatomic.h>
+
+/* Messages less severe than this are compiled out entirely */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+extern _Atomic int32_t log_runtime_level;
 
 
 void write_log(int32_t level, const char* msg, const char* file, int32_t line, ...);
 
 void open_log(const char* name);
 
+/** @brief open_log_async
+  *
+  * @details
+  *		Opens the log in asynchronous mode. write_log formats messages
+  *		into fixed size records in a lock-free ring buffer and a
+  *		background thread delivers them. Messages are dropped and
+  *		counted rather than blocking when the ring is full.
+  *
+  * @param[in] name
+  *		Name used for syslog
+  *
+  * @param[in] file_path
+  *		File to append messages to. NULL to deliver to syslog.
+  *
+  * @retval 0 if the background thread was started
+  */
+int32_t open_log_async(const char* name, const char* file_path);
+
+/** @brief get_log_dropped
+  *
+  * @details
+  *		Number of messages dropped because the async ring was full
+  */
+uint64_t get_log_dropped();
+
+/** @brief set_log_level
+  *
+  * @details
+  *		Sets the least severe level that is logged at runtime. Messages
+  *		below it are skipped before their arguments are evaluated.
+  *
+  * @param[in] level
+  *		syslog level such as LOG_INFO
+  */
+void set_log_level(int32_t level);
+
+/** @brief close_log
+  *
+  * @details
+  *		Closes the log. In async mode pending messages are delivered
+  *		before the background thread exits, so other threads must have
+  *		stopped logging.
+  */
 void close_log();
 
 /* Macros to easily handle logging */
 
-#define EMERG_LOG(msg, ...) write_log(LOG_EMERG, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define ALERT_LOG(msg, ...) write_log(LOG_ALERT, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define CRIT_LOG(msg, ...) write_log(LOG_CRIT, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define ERR_LOG(msg, ...) write_log(LOG_ERR, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define WARN_LOG(msg, ...) write_log(LOG_WARNING, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define NOTICE_LOG(msg, ...) write_log(LOG_NOTICE, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define INFO_LOG(msg, ...) write_log(LOG_INFO, msg, __FILE__, __LINE__, ##__VA_ARGS__);
-#define DEBUG_LOG(msg, ...) write_log(LOG_DEBUG, msg, __FILE__, __LINE__, ##__VA_ARGS__);
+#define LOG_ENABLED(level) \
+	((level) <= LOG_COMPILE_LEVEL && \
+	 (level) <= atomic_load_explicit(&log_runtime_level, memory_order_relaxed))
+
+#define LOG_AT_LEVEL(level, msg, ...) \
+	do { \
+		if (LOG_ENABLED(level)) { \
+			write_log(level, msg, __FILE__, __LINE__, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define EMERG_LOG(msg, ...) LOG_AT_LEVEL(LOG_EMERG, msg, ##__VA_ARGS__)
+#define ALERT_LOG(msg, ...) LOG_AT_LEVEL(LOG_ALERT, msg, ##__VA_ARGS__)
+#define CRIT_LOG(msg, ...) LOG_AT_LEVEL(LOG_CRIT, msg, ##__VA_ARGS__)
+#define ERR_LOG(msg, ...) LOG_AT_LEVEL(LOG_ERR, msg, ##__VA_ARGS__)
+#define WARN_LOG(msg, ...) LOG_AT_LEVEL(LOG_WARNING, msg, ##__VA_ARGS__)
+#define NOTICE_LOG(msg, ...) LOG_AT_LEVEL(LOG_NOTICE, msg, ##__VA_ARGS__)
+#define INFO_LOG(msg, ...) LOG_AT_LEVEL(LOG_INFO, msg, ##__VA_ARGS__)
+#define DEBUG_LOG(msg, ...) LOG_AT_LEVEL(LOG_DEBUG, msg, ##__VA_ARGS__)
 
 #endif
 
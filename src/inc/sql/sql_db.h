@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <sqlite3.h>
 
 #include <log.h>
@@ -14,12 +16,21 @@
 /** @enum db_param_type
   *
   * @details
-  *		enum for the different parameters type supported for query
+  *		enum for the different parameters type supported for query.
+  *		STATIC_TEXT is only valid for parameters and binds text owned by
+  *		the caller without copying it. The text must stay valid until the
+  *		statement is reset and is not freed by free_params.
+  *
+  *		INT64 holds integers that do not fit in an INT, such as dates
+  *		and amounts in minor units. Integer results are returned as INT
+  *		when they fit and as INT64 otherwise.
   */
 enum db_type {
 	INT,
 	DOUBLE,
-	TEXT
+	TEXT,
+	STATIC_TEXT,
+	INT64
 } typedef db_type;
 
 /** @struct db_value
@@ -31,6 +42,7 @@ struct db_value {
 	db_type type;
 	union {
 		int32_t int_val;
+		int64_t int64_val;
 		double double_val;
 		char* string_val;
 	} value;
@@ -40,11 +52,16 @@ struct db_value {
   *
   * @details
   *		struct which contains all necessary information for 
-  *		a query parameter
+  *		a query parameter. The position of the parameter in the query
+  *		is looked up by name once per cached statement. index is only
+  *		read for queries with positional_params set, where a non-zero
+  *		index is used as the 1-based position of the parameter and name
+  *		is only used for logging, and 0 still resolves by name.
   */
 struct query_param {
 	const char* name;
 	db_value param;
+	int32_t index;
 } typedef query_param;
 
 /** @struct db_query_result
@@ -62,33 +79,314 @@ struct db_query_result {
 
 } typedef db_query_result;
 
+/** @struct db_arena_block
+  *
+  * @details
+  *		Block of memory handed out by a db_arena
+  */
+struct db_arena_block {
+	struct db_arena_block* next;
+	size_t size;
+	size_t used;
+	char data[];
+} typedef db_arena_block;
+
+/** @struct db_arena
+  *
+  * @details
+  *		Bump allocator used to store the text of a column result.
+  *		Blocks double in size and are only released all at once.
+  */
+struct db_arena {
+	db_arena_block* head;
+	size_t total_bytes;
+} typedef db_arena;
+
+/** @struct db_column
+  *
+  * @details
+  *		Contiguous array of values for one result column. The column
+  *		type is taken from the first row and later values are
+  *		converted to it, except that an INT column is widened to INT64
+  *		once a value does not fit.
+  */
+struct db_column {
+	db_type type;
+	union {
+		void* ptr;
+		int32_t* int_vals;
+		int64_t* int64_vals;
+		double* double_vals;
+		const char** string_vals;
+	} values;
+} typedef db_column;
+
+/** @struct db_column_result
+  *
+  * @details
+  *		Columnar query result. Each column is a single typed array
+  *		indexed by row and all text values live in one arena, so
+  *		building a result costs O(columns) allocations rather than one
+  *		per row and text cell.
+  *
+  *		Caller is responsible for calling free_column_result
+  */
+struct db_column_result {
+	size_t num_rows;
+	size_t num_cols;
+	size_t capacity;
+	db_column* columns;
+	db_arena text;
+} typedef db_column_result;
+
+#define DB_LATENCY_BUCKETS 32
+
+/** @struct db_query_stats
+  *
+  * @details
+  *		Execution statistics of one query. Bucket 0 of the latency
+  *		histogram counts executions under 1us and bucket i those taking
+  *		[2^(i-1), 2^i) us, the last bucket also holding anything
+  *		slower. text_bytes is the text copied into results, which is
+  *		not known for mapped queries and cursors.
+  */
+struct db_query_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t prepare_ns;
+	uint64_t step_ns;
+	uint64_t rows;
+	uint64_t text_bytes;
+	uint64_t latency_histogram[DB_LATENCY_BUCKETS];
+} typedef db_query_stats;
+
+/** @struct db_stmt_cache_entry
+  *
+  * @details
+  *		A prepared statement owned by a connection's statement cache
+  *		along with the positions of the named parameters bound to it
+  *		and its statistics
+  */
+struct db_stmt_cache_entry {
+	char* query;
+	uint32_t hash;
+	sqlite3_stmt* stmt;
+	bool in_use;
+	char** param_names;
+	int32_t* param_indexes;
+	size_t num_param_indexes;
+	db_query_stats stats;
+} typedef db_stmt_cache_entry;
+
+/** @struct db_stmt_cache
+  *
+  * @details
+  *		Hash table of prepared statements keyed by query text. Statements
+  *		are prepared once and reset between executions instead of being
+  *		finalized.
+  */
+struct db_stmt_cache {
+	db_stmt_cache_entry** entries;
+	size_t capacity;
+	size_t num_entries;
+	uint64_t hits;
+	uint64_t misses;
+} typedef db_stmt_cache;
+
+/** @enum db_journal_mode
+  *
+  * @details
+  *		Values for PRAGMA journal_mode. DEFAULT leaves SQLite's setting.
+  */
+enum db_journal_mode {
+	JOURNAL_MODE_DEFAULT,
+	JOURNAL_MODE_DELETE,
+	JOURNAL_MODE_TRUNCATE,
+	JOURNAL_MODE_PERSIST,
+	JOURNAL_MODE_MEMORY,
+	JOURNAL_MODE_WAL,
+	JOURNAL_MODE_OFF
+} typedef db_journal_mode;
+
+/** @enum db_synchronous
+  *
+  * @details
+  *		Values for PRAGMA synchronous. DEFAULT leaves SQLite's setting.
+  */
+enum db_synchronous {
+	SYNCHRONOUS_DEFAULT,
+	SYNCHRONOUS_OFF,
+	SYNCHRONOUS_NORMAL,
+	SYNCHRONOUS_FULL,
+	SYNCHRONOUS_EXTRA
+} typedef db_synchronous;
+
+/** @enum db_temp_store
+  *
+  * @details
+  *		Values for PRAGMA temp_store. DEFAULT leaves SQLite's setting.
+  */
+enum db_temp_store {
+	TEMP_STORE_DEFAULT,
+	TEMP_STORE_FILE,
+	TEMP_STORE_MEMORY
+} typedef db_temp_store;
+
+/** @enum db_locking_mode
+  *
+  * @details
+  *		Values for PRAGMA locking_mode. DEFAULT leaves SQLite's setting.
+  */
+enum db_locking_mode {
+	LOCKING_MODE_DEFAULT,
+	LOCKING_MODE_NORMAL,
+	LOCKING_MODE_EXCLUSIVE
+} typedef db_locking_mode;
+
+/** @struct db_options
+  *
+  * @details
+  *		Storage settings applied by open_db. A zeroed struct leaves
+  *		every setting at SQLite's default. cache_size follows the
+  *		pragma: positive is pages and negative is KiB. page_size only
+  *		takes effect when the database is created. journal_mode and
+  *		page_size are ignored on read only connections.
+  *
+  *		busy_timeout_ms is how long a statement waits for a lock held by
+  *		another connection before failing with ERR_BUSY. 0 uses the
+  *		default of 5 seconds and a negative value fails immediately.
+  */
+struct db_options {
+	db_journal_mode journal_mode;
+	db_synchronous synchronous;
+	int32_t cache_size;
+	int64_t mmap_size;
+	db_temp_store temp_store;
+	int32_t page_size;
+	db_locking_mode locking_mode;
+	int32_t busy_timeout_ms;
+} typedef db_options;
+
+/* SQLite defaults */
+extern const db_options DB_OPTIONS_DEFAULT;
+
+/* WAL with NORMAL sync, 64 MiB page cache, 256 MiB of mmap reads and
+ * temporary tables in memory */
+extern const db_options DB_OPTIONS_HIGH_THROUGHPUT;
+
+/** @struct db_busy_stats
+  *
+  * @details
+  *		Lock contention seen by a connection. busy_events counts the
+  *		statements that found the database locked, retries the backoff
+  *		sleeps taken waiting for it and wait_ns the time spent asleep.
+  */
+struct db_busy_stats {
+	uint64_t busy_events;
+	uint64_t retries;
+	uint64_t timeouts;
+	uint64_t wait_ns;
+} typedef db_busy_stats;
+
+/** @struct db_connection
+  *
+  * @details
+  *		Used when interacting with the database. A read_only
+  *		connection is opened without a mutex and must only be used by
+  *		one thread at a time, see db_pool. options may be NULL to use
+  *		SQLite's defaults.
+  *
+  *		The busy handler keeps a pointer to the connection so it must
+  *		not be moved while open.
+  *
+  *		When collect_stats is set every query run through the statement
+  *		cache is timed, see get_query_stats.
+  *
+  *		data_version and total_changes are what check_db_changed last
+  *		saw, valid once data_version_stmt is prepared.
+  *
+  *		result_cache is not used by this layer. It lets the layer above
+  *		keep decoded results per connection, or share them between the
+  *		connections of a pool, and may be NULL.
+  */
+struct db_connection {
+	sqlite3* handle;
+	char* db_path;
+	db_stmt_cache stmt_cache;
+	bool read_only;
+	const db_options* options;
+	db_busy_stats busy_stats;
+	uint64_t busy_start_ns;
+	bool collect_stats;
+	sqlite3_stmt* data_version_stmt;
+	int64_t data_version;
+	int64_t total_changes;
+	struct result_cache* result_cache;
+} typedef db_connection;
+
 /** @struct db_query
   *
   * @details
   *		Contains all information required to make a query
-  *		to the data base
+  *		to the data base. When connection is set the statement is
+  *		taken from the connection's statement cache and handle is
+  *		ignored, otherwise the statement is prepared on handle and
+  *		finalized once the query completes.
+  *
+  *		positional_params opts in to binding params by their index.
+  *		Binding fails with ERR_INVALID if an index is past the number of
+  *		parameters in the query.
   */
 struct db_query {
 	sqlite3* handle;
 	const char* query;
 	size_t num_params;
 	query_param* params;
+	db_connection* connection;
+	bool positional_params;
 } typedef db_query;
 
-/** @struct db_connection
+/** @struct db_cursor
   *
   * @details
-  *		Used when interacting with the database
+  *		Streams the rows of a query one at a time. Values returned by
+  *		the column accessors are only valid until the next call to
+  *		cursor_next or close_cursor.
   */
-struct db_connection {
-	sqlite3* handle;
-	char* db_path;
-} typedef db_connection;
+struct db_cursor {
+	db_query* query;
+	sqlite3_stmt* stmt;
+	db_stmt_cache_entry* entry;
+	size_t num_cols;
+	bool done;
+	uint64_t step_ns;
+	uint64_t num_rows;
+	bool failed;
+} typedef db_cursor;
+
+/** @brief db_row_callback
+  *
+  * @details
+  *		Called for every row returned by execute_query_with_callback.
+  *		Returning anything but ERR_OK stops the query and the value is
+  *		returned to the caller.
+  */
+typedef int32_t (*db_row_callback)(db_cursor* row, void* ctx);
+
+/** @brief db_row_mapper
+  *
+  * @details
+  *		Decodes the current row of stmt into row, which points at
+  *		row_size bytes inside the array built by execute_mapped_query.
+  *		Returning anything but ERR_OK stops the query.
+  */
+typedef int32_t (*db_row_mapper)(sqlite3_stmt* stmt, void* row, void* ctx);
 
 /** @brief open_db
  *
  * @details
- *		Opens connection to database at the path provided
+ *		Opens connection to database at the path provided and applies
+ *		the connection's options
  *
  * @param[in] db_path
  *		The path to the object
@@ -103,7 +401,7 @@ int32_t open_db(db_connection* connection);
 /** @brief close_db
   *
   * @details
-  *		Closes connection to database
+  *		Finalizes all cached statements and closes connection to database
   *
   * @param[in] db
   *		Database connection to close
@@ -127,6 +425,275 @@ int32_t close_db(db_connection* connection);
   */
 int32_t execute_query(db_query* query, db_query_result* result);
 
+/** @brief execute_columnar_query
+  *
+  * @details
+  *		Executes database query and stores the result by column
+  *
+  * @param[in] query
+  *		Query to execute
+  *
+  * @param[out] result
+  *		The result of the query
+  *
+  * @retval 0 if query was executed successfully
+  */
+int32_t execute_columnar_query(db_query* query, db_column_result* result);
+
+/** @brief execute_query_with_callback
+  *
+  * @details
+  *		Executes database query and passes each row to callback without
+  *		storing the result
+  *
+  * @param[in] query
+  *		Query to execute
+  *
+  * @param[in] callback
+  *		Called once per result row
+  *
+  * @param[in] ctx
+  *		Passed through to callback
+  *
+  * @retval 0 if query was executed successfully
+  */
+int32_t execute_query_with_callback(
+	db_query* query,
+	db_row_callback callback,
+	void* ctx);
+
+/** @brief execute_mapped_query
+  *
+  * @details
+  *		Executes database query and decodes each row straight from the
+  *		statement into a caller defined struct using mapper. The rows
+  *		are stored in a single array that grows as rows are returned.
+  *		On failure rows holds the rows decoded so far so the caller can
+  *		release anything the mapper allocated.
+  *
+  * @param[in] query
+  *		Query to execute
+  *
+  * @param[in] mapper
+  *		Decodes a row
+  *
+  * @param[in] row_size
+  *		Size of the struct a row is decoded into
+  *
+  * @param[in] ctx
+  *		Passed through to mapper
+  *
+  * @param[out] rows
+  *		Array of decoded rows. Caller is responsible for freeing it.
+  *
+  * @param[out] num_rows
+  *		Number of rows decoded
+  *
+  * @retval 0 if query was executed successfully
+  */
+int32_t execute_mapped_query(
+	db_query* query,
+	db_row_mapper mapper,
+	size_t row_size,
+	void* ctx,
+	void** rows,
+	size_t* num_rows);
+
+/** @brief open_cursor
+  *
+  * @details
+  *		Prepares query and binds its parameters. Query must remain valid
+  *		until the cursor is closed. Caller is responsible for calling
+  *		close_cursor.
+  *
+  * @param[in] query
+  *		Query to execute
+  *
+  * @param[out] cursor
+  *		The opened cursor
+  *
+  * @retval 0 if cursor was opened successfully
+  */
+int32_t open_cursor(db_query* query, db_cursor* cursor);
+
+/** @brief cursor_next
+  *
+  * @details
+  *		Advances cursor to the next row
+  *
+  * @param[in] cursor
+  *		Cursor to advance
+  *
+  * @param[out] has_row
+  *		Set to false once all rows have been returned
+  *
+  * @retval 0 if no errors
+  */
+int32_t cursor_next(db_cursor* cursor, bool* has_row);
+
+/** @brief cursor_column_type
+  *
+  * @details
+  *		Gets the type of a column in the current row
+  */
+db_type cursor_column_type(const db_cursor* cursor, size_t col);
+
+/** @brief cursor_column_int
+  *
+  * @details
+  *		Gets a column of the current row as an integer
+  */
+int32_t cursor_column_int(const db_cursor* cursor, size_t col);
+
+/** @brief cursor_column_int64
+  *
+  * @details
+  *		Gets a column of the current row as a 64 bit integer
+  */
+int64_t cursor_column_int64(const db_cursor* cursor, size_t col);
+
+/** @brief cursor_column_double
+  *
+  * @details
+  *		Gets a column of the current row as a double
+  */
+double cursor_column_double(const db_cursor* cursor, size_t col);
+
+/** @brief cursor_column_text
+  *
+  * @details
+  *		Gets a column of the current row as text. The string is owned by
+  *		the cursor.
+  *
+  * @param[out] len
+  *		Length of the text in bytes. May be NULL.
+  */
+const char* cursor_column_text(const db_cursor* cursor, size_t col, size_t* len);
+
+/** @brief reset_cursor
+  *
+  * @details
+  *		Rewinds cursor and binds the current values of the query
+  *		parameters so the same statement can be executed again
+  *
+  * @param[in] cursor
+  *		Cursor to reset
+  *
+  * @retval 0 if cursor was reset
+  */
+int32_t reset_cursor(db_cursor* cursor);
+
+/** @brief close_cursor
+  *
+  * @details
+  *		Releases the statement held by cursor
+  *
+  * @retval 0 if cursor closed
+  */
+int32_t close_cursor(db_cursor* cursor);
+
+/** @brief clear_stmt_cache
+  *
+  * @details
+  *		Finalizes all statements held in the connection's statement
+  *		cache. Must not be called while a query on the connection is
+  *		executing.
+  *
+  * @param[in] connection
+  *		Connection owning the cache
+  */
+void clear_stmt_cache(db_connection* connection);
+
+/** @brief check_db_changed
+  *
+  * @details
+  *		Reports whether the database may have changed since the last
+  *		check on this connection, whether by a commit of any other
+  *		connection, including one from another process, or by rows
+  *		changed through this one. The first check always reports a
+  *		change.
+  *
+  *		Each check runs PRAGMA data_version, which reads no table but
+  *		is still a statement step on the connection. It holds the
+  *		connection's mutex, so a connection opened with one, such as a
+  *		pool's writer, may be checked from several threads.
+  *
+  * @param[in] connection
+  *		Open connection to check
+  *
+  * @param[out] changed
+  *		Set if the database may have changed
+  *
+  * @retval ERR_OK if checked
+  */
+int32_t check_db_changed(db_connection* connection, bool* changed);
+
+/** @brief get_busy_stats
+  *
+  * @details
+  *		Copies the lock contention counters of an open connection
+  *
+  * @param[in] connection
+  *		Connection to read the counters of
+  *
+  * @param[out] stats
+  *		The counters
+  *
+  * @retval ERR_OK if counters copied
+  */
+int32_t get_busy_stats(db_connection* connection, db_busy_stats* stats);
+
+/** @brief get_query_stats
+  *
+  * @details
+  *		Copies the statistics collected for a query. Only queries run
+  *		through the statement cache of a connection with collect_stats
+  *		set are tracked and a cursor's execution is counted once it is
+  *		reset or closed. For cursors only the time spent stepping is
+  *		counted as latency.
+  *
+  * @param[in] connection
+  *		Connection the query ran on
+  *
+  * @param[in] query
+  *		Query text
+  *
+  * @param[out] stats
+  *		The statistics
+  *
+  * @retval ERR_NOT_FOUND if the query is not in the statement cache
+  */
+int32_t get_query_stats(
+	db_connection* connection,
+	const char* query,
+	db_query_stats* stats);
+
+/** @brief dump_query_stats
+  *
+  * @details
+  *		Writes the statistics of every cached query, either to the log
+  *		or as a JSON array to file
+  *
+  * @param[in] connection
+  *		Connection to dump the statistics of
+  *
+  * @param[in] file
+  *		File to write JSON to. NULL writes to the log instead.
+  *
+  * @retval ERR_OK if statistics written
+  */
+int32_t dump_query_stats(db_connection* connection, FILE* file);
+
+/** @brief reset_query_stats
+  *
+  * @details
+  *		Zeroes the statistics of every cached query
+  *
+  * @param[in] connection
+  *		Connection to reset the statistics of
+  */
+void reset_query_stats(db_connection* connection);
+
 /** @brief free_results
   *
   * @details
@@ -137,6 +704,16 @@ int32_t execute_query(db_query* query, db_query_result* result);
   */
 void free_results(db_query_result* restrict results);
 
+/** @brief free_column_result
+  *
+  * @details
+  *		Helper to free a column result once it is no longer needed
+  *
+  * @param[in] result
+  *		The result to free
+  */
+void free_column_result(db_column_result* restrict result);
+
 /** @brief free_params
   *
   * @details
@@ -0,0 +1,131 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+#ifndef SQL_POOL_H
+#define SQL_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <sql/sql_db.h>
+
+/** @struct db_pool
+  *
+  * @details
+  *		One writer connection and num_readers read only connections to
+  *		the same database in WAL mode, so readers do not block the
+  *		writer or each other. Connections are handed out one thread at
+  *		a time with checkout and returned with checkin.
+  */
+struct db_pool {
+	char* db_path;
+	db_options options;
+	db_connection writer;
+	db_connection* readers;
+	size_t num_readers;
+	size_t* free_readers;
+	size_t num_free_readers;
+	bool writer_in_use;
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+} typedef db_pool;
+
+/** @brief open_pool
+  *
+  * @details
+  *		Opens the writer connection, switches the database to WAL mode
+  *		and opens the reader connections. Caller is responsible for
+  *		calling close_pool when finished.
+  *
+  * @param[in] pool
+  *		Pool to open
+  *
+  * @param[in] db_path
+  *		Directory containing the database
+  *
+  * @param[in] num_readers
+  *		Number of reader connections. 0 opens one per online CPU.
+  *
+  * @param[in] options
+  *		Options applied to every connection. May be NULL. The journal
+  *		mode is always WAL.
+  *
+  * @retval ERR_OK if all connections opened
+  */
+int32_t open_pool(
+	db_pool* pool,
+	const char* db_path,
+	size_t num_readers,
+	const db_options* options);
+
+/** @brief close_pool
+  *
+  * @details
+  *		Closes every connection in the pool. No connection may be
+  *		checked out.
+  *
+  * @param[in] pool
+  *		Pool to close
+  *
+  * @retval ERR_OK if all connections closed
+  */
+int32_t close_pool(db_pool* pool);
+
+/** @brief checkout_reader
+  *
+  * @details
+  *		Takes a reader connection from the pool, waiting until one is
+  *		checked in if they are all in use
+  *
+  * @param[in] pool
+  *		Pool to take the connection from
+  *
+  * @param[out] connection
+  *		The reader connection
+  *
+  * @retval ERR_OK if a connection was checked out
+  */
+int32_t checkout_reader(db_pool* pool, db_connection** connection);
+
+/** @brief try_checkout_reader
+  *
+  * @details
+  *		Same as checkout_reader but does not wait
+  *
+  * @retval ERR_IN_USE if every reader is checked out
+  */
+int32_t try_checkout_reader(db_pool* pool, db_connection** connection);
+
+/** @brief checkout_writer
+  *
+  * @details
+  *		Takes the writer connection from the pool, waiting until it is
+  *		checked in if it is in use
+  *
+  * @param[in] pool
+  *		Pool to take the connection from
+  *
+  * @param[out] connection
+  *		The writer connection
+  *
+  * @retval ERR_OK if the connection was checked out
+  */
+int32_t checkout_writer(db_pool* pool, db_connection** connection);
+
+/** @brief checkin
+  *
+  * @details
+  *		Returns a reader or the writer connection to the pool
+  *
+  * @param[in] pool
+  *		Pool the connection was taken from
+  *
+  * @param[in] connection
+  *		The connection to return
+  *
+  * @retval ERR_OK if the connection was returned
+  */
+int32_t checkin(db_pool* pool, db_connection* connection);
+
+#endif
@@ -3,19 +3,304 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
 
+#include <app/import.h>
+#include <app/export.h>
+#include <budget_db/budget_db.h>
+#include <error.h>
 #include <log.h>
 
+#define HOME_ENV "HOME"
+#define DEFAULT_DB_DIR "/.budget_app"
+#define SECONDS_IN_A_DAY 86400
+
+typedef int32_t (*command_handler)(db_connection* db, int argc, char** argv);
+
+/** @struct command
+  *
+  * @details
+  *		Sub command of budget_app
+  */
+struct command {
+	const char* name;
+	const char* usage;
+	command_handler handler;
+} typedef command;
+
+static int32_t parse_uint(const char* arg, size_t* value) {
+	char* end;
+
+	if ('-' == arg[0]) {
+		return ERR_INVALID;
+	}
+
+	*value = strtoul(arg, &end, 10);
+
+	return '\0' == *end && end != arg ? ERR_OK : ERR_INVALID;
+}
+
+static int32_t run_import(db_connection* db, int argc, char** argv) {
+	import_options options = {0};
+	import_stats stats = {0};
+	size_t value;
+	int opt;
+	int32_t rc;
+
+	while (-1 != (opt = getopt(argc, argv, "t:b:p:e:"))) {
+		/* Every option takes a number */
+		if ('?' == opt || ERR_OK != parse_uint(optarg, &value)) {
+			return ERR_INVALID;
+		}
+
+		switch (opt) {
+			case 't':
+				options.num_threads = value;
+				break;
+			case 'b':
+				options.batch_size = value;
+				break;
+			case 'p':
+				options.payment_type = value;
+				break;
+			case 'e':
+				options.expense_type = value;
+				break;
+			default:
+				return ERR_INVALID;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		return ERR_INVALID;
+	}
+
+	options.path = argv[optind];
+
+	rc = import_csv(db, &options, &stats);
+
+	printf("Imported %zu rows (%zu skipped) in %.3fs, %.0f rows/s\n",
+		stats.rows_imported,
+		stats.rows_skipped,
+		stats.elapsed_sec,
+		stats.rows_per_sec);
+
+	return rc;
+}
+
+/* Dates are YYYY-MM-DD (UTC) or seconds since the epoch. A day given as
+ * the end of a range includes the whole day. */
+static int32_t parse_date(const char* arg, bool end_of_day, time_t* date) {
+	char* end;
+
+	/* A leading minus is a date before the epoch in seconds */
+	if (*arg && strchr(arg + 1, '-')) {
+		if (!parse_calendar_date(arg, date)) {
+			return ERR_INVALID;
+		}
+
+		*date += end_of_day ? SECONDS_IN_A_DAY - 1 : 0;
+
+		return ERR_OK;
+	}
+
+	*date = strtoll(arg, &end, 10);
+
+	return '\0' == *end && end != arg ? ERR_OK : ERR_INVALID;
+}
+
+static int32_t run_export(db_connection* db, int argc, char** argv) {
+	export_options options = {0};
+	export_stats stats = {0};
+	const char* path = NULL;
+	int opt;
+	int32_t rc = ERR_OK;
+
+	options.fd = STDOUT_FILENO;
+	options.format = EXPORT_FORMAT_CSV;
+	options.range.start = INT64_MIN;
+	options.range.end = INT64_MAX;
+
+	while (ERR_OK == rc && -1 != (opt = getopt(argc, argv, "f:s:e:o:"))) {
+		switch (opt) {
+			case 'f':
+				if (!strcmp(optarg, "csv")) {
+					options.format = EXPORT_FORMAT_CSV;
+				}
+				else if (!strcmp(optarg, "json")) {
+					options.format = EXPORT_FORMAT_JSON;
+				}
+				else {
+					rc = ERR_INVALID;
+				}
+				break;
+			case 's':
+				rc = parse_date(optarg, false, &options.range.start);
+				break;
+			case 'e':
+				rc = parse_date(optarg, true, &options.range.end);
+				break;
+			case 'o':
+				path = optarg;
+				break;
+			default:
+				rc = ERR_INVALID;
+				break;
+		}
+	}
+
+	if (ERR_OK != rc || optind != argc) {
+		return ERR_INVALID;
+	}
+
+	if (path) {
+		options.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (-1 == options.fd) {
+			fprintf(stderr, "Unable to open [%s]\n", path);
+			return ERR_NOT_PERMITTED;
+		}
+	}
+
+	rc = export_expenses(db, &options, &stats);
+
+	if (path && 0 != close(options.fd) && ERR_OK == rc) {
+		rc = ERR_KO;
+	}
+
+	/* stdout may be carrying the export */
+	fprintf(stderr, "Exported %zu rows (%zu bytes, %zu writes) in %.3fs, %.0f rows/s\n",
+		stats.rows_exported,
+		stats.bytes_written,
+		stats.writes,
+		stats.elapsed_sec,
+		stats.rows_per_sec);
+
+	return rc;
+}
+
+static const command COMMANDS[] = {
+	{
+		"import",
+		"import [-t threads] [-b batch_size] [-p payment_type] "
+			"[-e expense_type] file.csv",
+		run_import
+	},
+	{
+		"export",
+		"export [-f csv|json] [-s start] [-e end] [-o file]",
+		run_export
+	}
+};
+
+#define NUM_COMMANDS (sizeof(COMMANDS) / sizeof(COMMANDS[0]))
+
+static void usage(const char* name) {
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [-d db_dir] <command>\n", name);
+	for (i = 0; i < NUM_COMMANDS; ++i) {
+		fprintf(stderr, "  %s\n", COMMANDS[i].usage);
+	}
+	fprintf(stderr, "Dates are YYYY-MM-DD (UTC) or seconds since the epoch\n");
+}
+
+static char* default_db_dir() {
+	const char* home_dir = getenv(HOME_ENV);
+	char* db_dir;
+
+	if (!home_dir) {
+		return NULL;
+	}
+
+	db_dir = (char*)malloc(strlen(home_dir) + strlen(DEFAULT_DB_DIR) + 1);
+	if (db_dir) {
+		strcpy(db_dir, home_dir);
+		strcat(db_dir, DEFAULT_DB_DIR);
+	}
+
+	return db_dir;
+}
+
 int main(int argc, char** argv) {
+	db_connection db = {0};
+	const char* name = argv[0];
+	const command* cmd = NULL;
+	const char* db_dir = NULL;
+	char* home_db_dir = NULL;
+	int32_t rc = ERR_INVALID;
+	int opt;
+	size_t i;
+
+	open_log(name);
+
+	/* + stops at the command so its options are parsed separately */
+	while (-1 != (opt = getopt(argc, argv, "+d:"))) {
+		switch (opt) {
+			case 'd':
+				db_dir = optarg;
+				break;
+			default:
+				goto CLEAN_UP;
+		}
+	}
+
+	for (i = 0; optind < argc && i < NUM_COMMANDS; ++i) {
+		if (!strcmp(argv[optind], COMMANDS[i].name)) {
+			cmd = &COMMANDS[i];
+		}
+	}
+
+	if (!cmd) {
+		goto CLEAN_UP;
+	}
+
+	if (!db_dir) {
+		home_db_dir = default_db_dir();
+		if (!home_db_dir) {
+			fprintf(stderr, "No DB directory given and " HOME_ENV " is not set\n");
+			goto CLEAN_UP;
+		}
+		db_dir = home_db_dir;
+	}
 
-	(void)argc;
+	db.db_path = (char*)db_dir;
+	db.options = &DB_OPTIONS_HIGH_THROUGHPUT;
+	rc = open_budget_db(&db);
+	if (ERR_OK != rc) {
+		fprintf(stderr, "Unable to open budget DB in [%s]: %s\n",
+			db_dir, error_to_string(rc));
+		goto CLEAN_UP;
+	}
 
-	open_log(argv[0]);
+	argc -= optind;
+	argv += optind;
+	optind = 1;
+
+	rc = cmd->handler(&db, argc, argv);
+	if (ERR_OK != rc) {
+		fprintf(stderr, "%s failed: %s\n", cmd->name, error_to_string(rc));
+	}
+
+	close_budget_db(&db);
+
+CLEAN_UP:
+
+	if (ERR_INVALID == rc && !db.handle) {
+		usage(name);
+	}
+
+	free(home_db_dir);
 
 	NOTICE_LOG("Exiting");
 
 	close_log();
 
-	return 0;
+	return ERR_OK == rc ? 0 : 1;
 }
-
@@ -3,19 +3,91 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
 
 #include <sql/sql_db.h>
 #include <log.h>
 #include <error.h>
 
 #define DB_FILE_PATH "budget.db"
-#define DB_COUNT_RESULT_QUERY "SELECT COUNT(*) FROM (%s);"
 #define DIR_PERM S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
 
+#define STMT_CACHE_INITIAL_CAPACITY 16
+#define RESULT_INITIAL_ROWS 16
+#define COLUMN_RESULT_INITIAL_ROWS 64
+#define ARENA_INITIAL_SIZE 4096
+#define MAX_PRAGMA_LENGTH 64
+#define DATA_VERSION_PRAGMA "PRAGMA data_version;"
+
+#define BUSY_DEFAULT_TIMEOUT_MS 5000
+#define BUSY_INITIAL_DELAY_NS 50000L
+#define BUSY_MAX_DELAY_NS 10000000L
+#define NS_PER_SEC 1000000000L
+#define NS_PER_MS 1000000L
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+const db_options DB_OPTIONS_DEFAULT = {0};
+
+const db_options DB_OPTIONS_HIGH_THROUGHPUT = {
+	.journal_mode = JOURNAL_MODE_WAL,
+	.synchronous = SYNCHRONOUS_NORMAL,
+	.cache_size = -65536,
+	.mmap_size = 268435456,
+	.temp_store = TEMP_STORE_MEMORY,
+	.locking_mode = LOCKING_MODE_NORMAL
+};
+
+/* Indexed by the option enums, DEFAULT has no pragma value */
+static const char* JOURNAL_MODE_NAMES[] = {
+	NULL, "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"
+};
+
+static const char* SYNCHRONOUS_NAMES[] = {
+	NULL, "OFF", "NORMAL", "FULL", "EXTRA"
+};
+
+static const char* TEMP_STORE_NAMES[] = {
+	NULL, "FILE", "MEMORY"
+};
+
+static const char* LOCKING_MODE_NAMES[] = {
+	NULL, "NORMAL", "EXCLUSIVE"
+};
+
+typedef int32_t (*row_handler)(sqlite3_stmt* stmt, void* ctx);
+
+struct result_builder {
+	db_query_result* result;
+	size_t capacity;
+	size_t text_bytes;
+} typedef result_builder;
+
+/* Measurements of one execution of a cached statement */
+struct exec_stats {
+	uint64_t latency_ns;
+	uint64_t step_ns;
+	uint64_t rows;
+	uint64_t text_bytes;
+	bool failed;
+} typedef exec_stats;
+
+struct mapped_builder {
+	db_row_mapper mapper;
+	size_t row_size;
+	void* ctx;
+	char* rows;
+	size_t num_rows;
+	size_t capacity;
+} typedef mapped_builder;
+
 static int32_t sqlite_error_to_error(int32_t sqlite_error)
 {
 	switch(sqlite_error) {
@@ -57,10 +129,93 @@ static void get_full_path(char** full_path, const char* dir_path)
 	strcat(*full_path, DB_FILE_PATH);
 }
 
-static int32_t bind_params(sqlite3_stmt* stmt, size_t num_params, query_param* params)
+static uint64_t monotonic_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/* Returns the 1-based position of param, 0 if the query has no
+ * parameter with its name or -1 if its position is out of range.
+ * Positions looked up by name are cached per statement, keyed by a copy
+ * of the name as callers may build names on the stack or heap. */
+static int32_t resolve_param_index(
+	sqlite3_stmt* stmt,
+	db_stmt_cache_entry* entry,
+	size_t slot,
+	size_t num_params,
+	bool positional,
+	const query_param* param)
+{
+	int32_t* indexes;
+	char** names;
+	char* name;
+	size_t i;
+
+	if (positional && 0 != param->index) {
+		return 0 < param->index &&
+			param->index <= sqlite3_bind_parameter_count(stmt) ? param->index : -1;
+	}
+
+	if (!param->name) {
+		return 0;
+	}
+
+	if (!entry) {
+		return sqlite3_bind_parameter_index(stmt, param->name);
+	}
+
+	if (entry->num_param_indexes < num_params) {
+		indexes = (int32_t*)realloc(
+			entry->param_indexes, sizeof(int32_t) * num_params);
+		if (!indexes) {
+			return sqlite3_bind_parameter_index(stmt, param->name);
+		}
+		entry->param_indexes = indexes;
+
+		names = (char**)realloc(
+			entry->param_names, sizeof(char*) * num_params);
+		if (!names) {
+			return sqlite3_bind_parameter_index(stmt, param->name);
+		}
+		entry->param_names = names;
+
+		for (i = entry->num_param_indexes; i < num_params; ++i) {
+			entry->param_names[i] = NULL;
+			entry->param_indexes[i] = 0;
+		}
+		entry->num_param_indexes = num_params;
+	}
+
+	if (!entry->param_names[slot] ||
+		0 != strcmp(entry->param_names[slot], param->name)) {
+
+		name = strdup(param->name);
+		if (!name) {
+			return sqlite3_bind_parameter_index(stmt, param->name);
+		}
+
+		free(entry->param_names[slot]);
+		entry->param_names[slot] = name;
+		entry->param_indexes[slot] =
+			sqlite3_bind_parameter_index(stmt, param->name);
+	}
+
+	return entry->param_indexes[slot];
+}
+
+static int32_t bind_params(
+	sqlite3_stmt* stmt,
+	db_stmt_cache_entry* entry,
+	const db_query* query)
 {
+	query_param* params = query->params;
+	size_t num_params = query->num_params;
 	int32_t index;
-	int32_t rc;
+	int32_t rc = SQLITE_OK;
 	size_t i;
 
 	if (!params) {
@@ -74,9 +229,15 @@ static int32_t bind_params(sqlite3_stmt* stmt, size_t num_params, query_param* p
 	{
 		query_param* param = &params[i];
 
-		DEBUG_LOG("Binding param [%s]", param->name);
+		index = resolve_param_index(
+			stmt, entry, i, num_params, query->positional_params, param);
+		if (0 > index)
+		{
+			ERR_LOG("Parameter [%s] position [%d] is out of range [1:%d]",
+				param->name, param->index, sqlite3_bind_parameter_count(stmt));
+			return ERR_INVALID;
+		}
 
-		index = sqlite3_bind_parameter_index(stmt, param->name);
 		if (0 == index)
 		{
 			WARN_LOG("No parameter with name [%s] found in query", param->name);
@@ -86,18 +247,23 @@ static int32_t bind_params(sqlite3_stmt* stmt, size_t num_params, query_param* p
 		switch (param->param.type)
 		{
 			case INT:
-				DEBUG_LOG("Binding value [%d] to param [%s]",
-					param->param.value.int_val, param->name);
+				DEBUG_LOG("Binding value [%d] to param [%s:%d]",
+					param->param.value.int_val, param->name, index);
 				rc = sqlite3_bind_int(stmt, index, param->param.value.int_val);
 				break;
+			case INT64:
+				DEBUG_LOG("Binding value [%ld] to param [%s:%d]",
+					(long)param->param.value.int64_val, param->name, index);
+				rc = sqlite3_bind_int64(stmt, index, param->param.value.int64_val);
+				break;
 			case DOUBLE:
-				DEBUG_LOG("Binding value [%f] to param [%s]",
-					param->param.value.double_val, param->name);
+				DEBUG_LOG("Binding value [%f] to param [%s:%d]",
+					param->param.value.double_val, param->name, index);
 				rc = sqlite3_bind_double(stmt, index, param->param.value.double_val);
 				break;
 			case TEXT:
-				DEBUG_LOG("Binding value [%s] to param [%s]",
-					param->param.value.string_val, param->name);
+				DEBUG_LOG("Binding value [%s] to param [%s:%d]",
+					param->param.value.string_val, param->name, index);
 				rc = sqlite3_bind_text(
 						stmt,
 						index,
@@ -105,12 +271,22 @@ static int32_t bind_params(sqlite3_stmt* stmt, size_t num_params, query_param* p
 						-1,
 						SQLITE_TRANSIENT);
 				break;
+			case STATIC_TEXT:
+				DEBUG_LOG("Binding static value [%s] to param [%s:%d]",
+					param->param.value.string_val, param->name, index);
+				rc = sqlite3_bind_text(
+						stmt,
+						index,
+						param->param.value.string_val,
+						-1,
+						SQLITE_STATIC);
+				break;
 		}
 
 		if (SQLITE_OK != rc)
 		{
-			ERR_LOG("Failed to bind value to parameter [%s]: [%d:%s]",
-				param->name, rc, sqlite3_errstr(rc));
+			ERR_LOG("Failed to bind value to parameter [%s:%d]: [%d:%s]",
+				param->name, index, rc, sqlite3_errstr(rc));
 			return sqlite_error_to_error(rc);
 		}
 	}
@@ -118,24 +294,275 @@ static int32_t bind_params(sqlite3_stmt* stmt, size_t num_params, query_param* p
 	return ERR_OK;
 }
 
-static int32_t generate_sql_statment(db_query* query, sqlite3_stmt** stmt)
+static sqlite3* get_query_handle(db_query* query)
+{
+	return query->connection ? query->connection->handle : query->handle;
+}
+
+static uint32_t hash_query(const char* query)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	for (; *query; ++query) {
+		hash ^= (uint8_t)*query;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static db_stmt_cache_entry** find_cache_slot(
+	db_stmt_cache* cache,
+	const char* query,
+	uint32_t hash)
+{
+	size_t mask = cache->capacity - 1;
+	size_t slot = hash & mask;
+
+	while (cache->entries[slot]) {
+		if (hash == cache->entries[slot]->hash &&
+			0 == strcmp(query, cache->entries[slot]->query)) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return &cache->entries[slot];
+}
+
+static int32_t grow_stmt_cache(db_stmt_cache* cache)
+{
+	db_stmt_cache_entry** old_entries = cache->entries;
+	size_t old_capacity = cache->capacity;
+	size_t i;
+
+	cache->capacity = old_capacity ?
+		old_capacity * 2 : STMT_CACHE_INITIAL_CAPACITY;
+	cache->entries = (db_stmt_cache_entry**)calloc(
+		cache->capacity, sizeof(db_stmt_cache_entry*));
+	if (!cache->entries) {
+		ERR_LOG("Failed to allocate statement cache");
+		cache->entries = old_entries;
+		cache->capacity = old_capacity;
+		return ERR_NOMEM;
+	}
+
+	DEBUG_LOG("Resized statement cache to [%u] entries", cache->capacity);
+
+	for (i = 0; i < old_capacity; ++i) {
+		if (old_entries[i]) {
+			*find_cache_slot(
+				cache,
+				old_entries[i]->query,
+				old_entries[i]->hash) = old_entries[i];
+		}
+	}
+
+	free(old_entries);
+
+	return ERR_OK;
+}
+
+static int32_t prepare_statement(
+	sqlite3* handle,
+	const char* query,
+	uint32_t flags,
+	sqlite3_stmt** stmt)
 {
-	int32_t rc = sqlite3_prepare_v2(query->handle, query->query, -1, stmt, NULL);
+	int32_t rc = sqlite3_prepare_v3(handle, query, -1, flags, stmt, NULL);
 	if (SQLITE_OK != rc) {
 		ERR_LOG("Failed to prepare query [%s]: [%d:%s]",
-			query->query, rc, sqlite3_errstr(rc));
+			query, rc, sqlite3_errmsg(handle));
 		return sqlite_error_to_error(rc);
 	}
 
+	return ERR_OK;
+}
+
+static int32_t get_cached_statement(
+	db_connection* connection,
+	const char* query,
+	sqlite3_stmt** stmt,
+	db_stmt_cache_entry** entry)
+{
+	db_stmt_cache* cache = &connection->stmt_cache;
+	db_stmt_cache_entry** slot;
+	db_stmt_cache_entry* new_entry = NULL;
+	uint32_t hash = hash_query(query);
+	uint64_t start_ns;
+	int32_t rc = ERR_OK;
+
+	*stmt = NULL;
+	*entry = NULL;
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(connection->handle));
+
+	if ((cache->num_entries + 1) * 4 > cache->capacity * 3) {
+		rc = grow_stmt_cache(cache);
+		if (ERR_OK != rc) {
+			goto CLEAN_UP;
+		}
+	}
+
+	slot = find_cache_slot(cache, query, hash);
+	if (*slot && !(*slot)->in_use) {
+		++cache->hits;
+		(*slot)->in_use = true;
+		*stmt = (*slot)->stmt;
+		*entry = *slot;
+		goto CLEAN_UP;
+	}
+
+	++cache->misses;
+
+	if (*slot) {
+		/* Already executing elsewhere (e.g. nested in a callback) so use a
+		 * one-off statement that is finalized on release */
+		DEBUG_LOG("Cached statement for [%s] is in use", query);
+		rc = prepare_statement(connection->handle, query, 0, stmt);
+		goto CLEAN_UP;
+	}
+
+	new_entry = (db_stmt_cache_entry*)calloc(1, sizeof(db_stmt_cache_entry));
+	if (!new_entry) {
+		ERR_LOG("Failed to allocate statement cache entry");
+		rc = ERR_NOMEM;
+		goto CLEAN_UP;
+	}
+
+	new_entry->query = strdup(query);
+	if (!new_entry->query) {
+		ERR_LOG("Failed to copy query for statement cache");
+		rc = ERR_NOMEM;
+		goto CLEAN_UP;
+	}
+
+	start_ns = monotonic_ns();
+	rc = prepare_statement(
+		connection->handle,
+		query,
+		SQLITE_PREPARE_PERSISTENT,
+		&new_entry->stmt);
+	if (ERR_OK != rc) {
+		goto CLEAN_UP;
+	}
+	new_entry->stats.prepare_ns = monotonic_ns() - start_ns;
+
+	new_entry->hash = hash;
+	new_entry->in_use = true;
+	*slot = new_entry;
+	++cache->num_entries;
+
+	*stmt = new_entry->stmt;
+	*entry = new_entry;
+	new_entry = NULL;
+
+CLEAN_UP:
+
+	sqlite3_mutex_leave(sqlite3_db_mutex(connection->handle));
+
+	if (new_entry) {
+		free(new_entry->query);
+		free(new_entry);
+	}
+
+	return rc;
+}
+
+static bool collecting_stats(db_query* query, db_stmt_cache_entry* entry)
+{
+	return entry && query->connection && query->connection->collect_stats;
+}
+
+static size_t latency_bucket(uint64_t latency_ns)
+{
+	uint64_t latency_us = latency_ns / 1000;
+	size_t bucket;
+
+	if (!latency_us) {
+		return 0;
+	}
+
+	bucket = 64 - __builtin_clzll(latency_us);
+
+	return bucket < DB_LATENCY_BUCKETS ? bucket : DB_LATENCY_BUCKETS - 1;
+}
+
+static void record_execution(
+	db_query* query,
+	db_stmt_cache_entry* entry,
+	const exec_stats* exec)
+{
+	db_query_stats* stats = &entry->stats;
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(query->connection->handle));
+
+	++stats->calls;
+	stats->errors += exec->failed;
+	stats->step_ns += exec->step_ns;
+	stats->rows += exec->rows;
+	stats->text_bytes += exec->text_bytes;
+	++stats->latency_histogram[latency_bucket(exec->latency_ns)];
+
+	sqlite3_mutex_leave(sqlite3_db_mutex(query->connection->handle));
+}
+
+static void release_statement(
+	db_query* query,
+	sqlite3_stmt* stmt,
+	db_stmt_cache_entry* entry)
+{
+	if (!stmt) {
+		return;
+	}
+
+	if (!entry) {
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(query->connection->handle));
+	entry->in_use = false;
+	sqlite3_mutex_leave(sqlite3_db_mutex(query->connection->handle));
+}
+
+static int32_t generate_sql_statment(
+	db_query* query,
+	sqlite3_stmt** stmt,
+	db_stmt_cache_entry** entry)
+{
+	int32_t rc;
+
+	*entry = NULL;
+
+	if (query->connection) {
+		if (!query->connection->handle) {
+			ERR_LOG("Connection is not open");
+			return ERR_NOT_READY;
+		}
+		rc = get_cached_statement(query->connection, query->query, stmt, entry);
+	}
+	else {
+		rc = prepare_statement(query->handle, query->query, 0, stmt);
+	}
+
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
 	if (0 < query->num_params)
 	{
-		rc = bind_params(*stmt, query->num_params, query->params);
-		if (SQLITE_OK != rc)
+		rc = bind_params(*stmt, *entry, query);
+		if (ERR_OK != rc)
 		{
 			ERR_LOG("Failed to bind params to query [%s]", query->query);
-			sqlite3_finalize(*stmt);
+			release_statement(query, *stmt, *entry);
 			*stmt = NULL;
-			return sqlite_error_to_error(rc);
+			*entry = NULL;
+			return rc;
 		}
 	}
 
@@ -145,12 +572,14 @@ static int32_t generate_sql_statment(db_query* query, sqlite3_stmt** stmt)
 static int32_t handle_result_row(
 	sqlite3_stmt* stmt,
 	db_query_result* result,
-	size_t row) {
+	size_t row,
+	size_t* text_bytes) {
 
 	size_t num_cols;
 	size_t col;
 	size_t col_len;
 	int32_t col_type;
+	int64_t int_value;
 	const char* col_value;
 
 	if (!result->values) {
@@ -181,9 +610,15 @@ static int32_t handle_result_row(
 		col_type = sqlite3_column_type(stmt, col);
 		switch(col_type) {
 			case SQLITE_INTEGER:
-				value[col].type = INT;
-				value[col].value.int_val =
-					sqlite3_column_int(stmt, col);
+				int_value = sqlite3_column_int64(stmt, col);
+				if (INT32_MIN <= int_value && int_value <= INT32_MAX) {
+					value[col].type = INT;
+					value[col].value.int_val = (int32_t)int_value;
+				}
+				else {
+					value[col].type = INT64;
+					value[col].value.int64_val = int_value;
+				}
 				break;
 			case SQLITE_FLOAT:
 				value[col].type = DOUBLE;
@@ -201,11 +636,17 @@ static int32_t handle_result_row(
 				if (!value[col].value.string_val) {
 					ERR_LOG(
 						"Failed to allocate memory for text value");
+					while (col--) {
+						if (TEXT == value[col].type) {
+							free(value[col].value.string_val);
+						}
+					}
 					free(value);
 					return ERR_NOMEM;
 				}
 
 				strcpy(value[col].value.string_val, col_value);
+				*text_bytes += col_len;
 				break;
 			default:
 				WARN_LOG("Unsupported result type: [%d]", col_type);
@@ -218,259 +659,1316 @@ static int32_t handle_result_row(
 	return ERR_OK;
 }
 
-static int32_t handle_result(sqlite3_stmt* stmt, db_query_result* result)
+static int32_t step_statement(
+	sqlite3_stmt* stmt,
+	row_handler handler,
+	void* ctx,
+	exec_stats* exec)
 {
+	uint64_t start_ns = 0;
 	int32_t rc;
-	size_t rows_processed = 0;
-	bool have_retried = false;
-
-	if (!result) {
-		INFO_LOG("Result is null. Ignoring results returned from query");
-	}
+	int32_t handler_rc;
 
 	do {
+		if (exec) {
+			start_ns = monotonic_ns();
+		}
+
 		rc = sqlite3_step(stmt);
+
+		if (exec) {
+			exec->step_ns += monotonic_ns() - start_ns;
+			exec->rows += SQLITE_ROW == rc;
+		}
+
 		switch (rc) {
 			case SQLITE_ROW:
-				if (!result) {
+				if (!handler) {
 					WARN_LOG("Result is null but results returned");
-					continue;
+					break;
+				}
+				handler_rc = handler(stmt, ctx);
+				if (ERR_OK != handler_rc) {
+					return handler_rc;
 				}
-				handle_result_row(stmt, result, rows_processed);
-				++rows_processed;
 				break;
 			case SQLITE_DONE:
 				break;
-			case SQLITE_BUSY:
-				if (!have_retried) { 
-					WARN_LOG("Database busy trying again");
-					have_retried = true;
-					sleep(1);
-				}
-				break;
 			default:
 				ERR_LOG("Failed to execute query: [%d:%s]",
 					rc, sqlite3_errstr(rc));
 				return sqlite_error_to_error(rc);
 		}
-	} while (
-		(SQLITE_ROW == rc || SQLITE_BUSY == rc) &&
-		rows_processed < result->num_rows);
-
-	if (result &&
-		rows_processed < result->num_rows) {
-		WARN_LOG("Only processed [%u] rows when expecting [%u]",
-			rows_processed, result->num_rows);
-		result->num_rows = rows_processed;
-	}
+	} while (SQLITE_ROW == rc);
 
 	return ERR_OK;
 }
-static int32_t get_num_results(db_query* query, db_query_result* result)
+
+static int32_t append_result_row(sqlite3_stmt* stmt, void* ctx)
 {
-	sqlite3_stmt* stmt = NULL;
-	char* count_query = NULL;
-	char* original_query = NULL;
-	char* split = NULL;
-	int32_t query_len;
+	result_builder* builder = (result_builder*)ctx;
+	db_query_result* result = builder->result;
+	db_value** values;
+	size_t new_capacity;
 	int32_t rc;
 
-	query_len = snprintf(
-		NULL,
-		0,
-		DB_COUNT_RESULT_QUERY,
-		query->query) + 1;
-	count_query = (char*)malloc(sizeof(char) * query_len);
-	if (!count_query) {
-		ERR_LOG("Failed to create count query");
-		rc = ERR_NOMEM;
-		goto CLEAN_UP;
-	}
-
-	original_query = (char*)malloc(sizeof(char) * (strlen(query->query) + 1));
-	if (!original_query) {
-		ERR_LOG("Failed to allocate memory to copy query");
-		rc = ERR_NOMEM;
-		goto CLEAN_UP;
-	}
-
-	strcpy(original_query, query->query);
-	split = strtok(original_query, ";");
-	if (!split) {
-		WARN_LOG("Query [%s] missing ';'",
-			query->query);
-		split = original_query;
-	}
-
-	snprintf(count_query, query_len, DB_COUNT_RESULT_QUERY, split);
-	DEBUG_LOG("Got result count query [%s]", count_query);
+	if (result->num_rows == builder->capacity) {
+		new_capacity = builder->capacity ?
+			builder->capacity * 2 : RESULT_INITIAL_ROWS;
 
-	db_query sql_query = { 
-		query->handle,
-		count_query,
-		query->num_params,
-		query->params};
-	rc = generate_sql_statment(&sql_query, &stmt);
-	if (SQLITE_OK != rc) {
-		ERR_LOG("Failed to generate sql statement: [%d:%s]",
-			rc, sqlite3_errstr(rc));
-		goto CLEAN_UP;
-	}
+		DEBUG_LOG("Growing result to [%u] rows", new_capacity);
 
-	rc = sqlite3_step(stmt);
-	if (SQLITE_ROW != rc) {
-		ERR_LOG("Failed to get count result: [%d:%s]",
-			rc, sqlite3_errstr(rc));
-		if (SQLITE_OK == rc) {
-			WARN_LOG("Query ran successfully but no data returned");
-			rc = ERR_KO;
+		values = (db_value**)realloc(
+			result->values,
+			sizeof(db_value*) * new_capacity);
+		if (!values) {
+			ERR_LOG("Failed to allocate result rows");
+			return ERR_NOMEM;
 		}
-		goto CLEAN_UP;
-	}
 
-	result->num_rows = sqlite3_column_int(stmt, 0);
-
-	DEBUG_LOG("Got [%u] result rows", result->num_rows);
-
-	rc = ERR_OK;
-
-CLEAN_UP:
-	if (count_query) {
-		free(count_query);
-	}
-
-	if (original_query) {
-		free(original_query);
+		result->values = values;
+		builder->capacity = new_capacity;
 	}
 
-	if (stmt)
-	{
-		sqlite3_finalize(stmt);
+	rc = handle_result_row(
+		stmt, result, result->num_rows, &builder->text_bytes);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to store result row [%u]", result->num_rows);
+		return rc;
 	}
 
-	return rc;
+	++result->num_rows;
 
+	return ERR_OK;
 }
 
-int32_t open_db(db_connection* connection)
+static int32_t append_mapped_row(sqlite3_stmt* stmt, void* ctx)
 {
-	char* full_path = NULL;
+	mapped_builder* builder = (mapped_builder*)ctx;
+	size_t new_capacity;
+	char* rows;
 	int32_t rc;
-	if (!connection) {
-		ERR_LOG("connection is NULL");
-		return ERR_INVALID;
-	}
 
-	if (!connection->db_path) {
-		ERR_LOG("DB path is NULL");
-		return ERR_INVALID;
+	if (builder->num_rows == builder->capacity) {
+		new_capacity = builder->capacity ?
+			builder->capacity * 2 : RESULT_INITIAL_ROWS;
+
+		DEBUG_LOG("Growing mapped result to [%u] rows", new_capacity);
+
+		rows = (char*)realloc(builder->rows, builder->row_size * new_capacity);
+		if (!rows) {
+			ERR_LOG("Failed to allocate mapped rows");
+			return ERR_NOMEM;
+		}
+
+		builder->rows = rows;
+		builder->capacity = new_capacity;
 	}
 
-	if (connection->handle) {
-		ERR_LOG("DB is already open");
-		return ERR_IN_USE;
+	rc = builder->mapper(
+		stmt,
+		builder->rows + builder->num_rows * builder->row_size,
+		builder->ctx);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to decode result row [%u]", builder->num_rows);
+		return rc;
 	}
 
-	get_full_path(&full_path, connection->db_path);
+	++builder->num_rows;
 
-	NOTICE_LOG("Opening connection to db [%s]", full_path);
+	return ERR_OK;
+}
 
-	rc = create_db_directory(connection->db_path);
-	if (0 != rc) {
-		ERR_LOG("Failed to create DB directory [%s]: [%d:%m]",
-			connection->db_path, rc);
-		goto CLEAN_UP;
-	}
+static char* arena_alloc(db_arena* arena, size_t size)
+{
+	db_arena_block* block = arena->head;
+	size_t block_size;
+	char* ptr;
+
+	if (!block || block->size - block->used < size) {
+		block_size = block ? block->size * 2 : ARENA_INITIAL_SIZE;
+		if (block_size < size) {
+			block_size = size;
+		}
 
-	rc = sqlite3_open_v2(
-		full_path,
-		(sqlite3**)&connection->handle,
-		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX,
-		NULL);
+		DEBUG_LOG("Allocating [%u] byte arena block", block_size);
 
-	if (SQLITE_OK != rc) {
-		ERR_LOG("Failed to open DB connection to [%s]: [%d:%s]",
-			full_path, rc, sqlite3_errstr(rc));
-		goto CLEAN_UP;
-	}
+		block = (db_arena_block*)malloc(sizeof(db_arena_block) + block_size);
+		if (!block) {
+			ERR_LOG("Failed to allocate arena block");
+			return NULL;
+		}
 
-CLEAN_UP:
+		block->next = arena->head;
+		block->size = block_size;
+		block->used = 0;
+		arena->head = block;
+	}
 
-	free(full_path);
+	ptr = block->data + block->used;
+	block->used += size;
+	arena->total_bytes += size;
 
-	return rc;
+	return ptr;
 }
 
-int32_t close_db(db_connection* connection)
+static void free_arena(db_arena* arena)
 {
-	int32_t rc;
-	NOTICE_LOG("Closing database connection");
+	db_arena_block* block = arena->head;
+	db_arena_block* next;
 
-	rc = sqlite3_close(connection->handle);
-	if (SQLITE_OK != rc)
-	{
-		ERR_LOG("Failed to close database connection: %d", rc);
-		return sqlite_error_to_error(rc);
+	while (block) {
+		next = block->next;
+		free(block);
+		block = next;
 	}
 
-	return ERR_OK;
+	arena->head = NULL;
+	arena->total_bytes = 0;
 }
 
-int32_t execute_query(db_query* query, db_query_result* result)
+static int32_t init_columns(sqlite3_stmt* stmt, db_column_result* result)
 {
-	int32_t rc;
-	if (!query) {
-		ERR_LOG("query is null");
-		return ERR_INVALID;
-	}
+	size_t col;
+
+	result->num_cols = sqlite3_column_count(stmt);
+	result->columns = (db_column*)calloc(result->num_cols, sizeof(db_column));
+	if (!result->columns) {
+		ERR_LOG("Failed to allocate [%u] result columns", result->num_cols);
+		result->num_cols = 0;
+		return ERR_NOMEM;
+	}
+
+	/* Column types are fixed by the first row, later cells are coerced */
+	for (col = 0; col < result->num_cols; ++col) {
+		switch (sqlite3_column_type(stmt, col)) {
+			case SQLITE_FLOAT:
+				result->columns[col].type = DOUBLE;
+				break;
+			case SQLITE_TEXT:
+			case SQLITE_BLOB:
+				result->columns[col].type = TEXT;
+				break;
+			default:
+				result->columns[col].type = INT;
+				break;
+		}
+	}
+
+	return ERR_OK;
+}
+
+static int32_t grow_columns(db_column_result* result)
+{
+	size_t new_capacity = result->capacity ?
+		result->capacity * 2 : COLUMN_RESULT_INITIAL_ROWS;
+	size_t col;
+	size_t elem_size;
+	void* values;
+
+	DEBUG_LOG("Growing column result to [%u] rows", new_capacity);
+
+	for (col = 0; col < result->num_cols; ++col) {
+		switch (result->columns[col].type) {
+			case INT:
+				elem_size = sizeof(int32_t);
+				break;
+			case INT64:
+				elem_size = sizeof(int64_t);
+				break;
+			case DOUBLE:
+				elem_size = sizeof(double);
+				break;
+			default:
+				elem_size = sizeof(const char*);
+				break;
+		}
+
+		values = realloc(result->columns[col].values.ptr, elem_size * new_capacity);
+		if (!values) {
+			ERR_LOG("Failed to allocate values for column [%u]", col);
+			return ERR_NOMEM;
+		}
+		result->columns[col].values.ptr = values;
+	}
+
+	result->capacity = new_capacity;
+
+	return ERR_OK;
+}
+
+/* Converts the first num_rows values of an INT column to INT64 */
+static int32_t widen_column(db_column* column, size_t capacity, size_t num_rows)
+{
+	int64_t* values = (int64_t*)malloc(sizeof(int64_t) * capacity);
+	size_t row;
+
+	if (!values) {
+		ERR_LOG("Failed to widen column of [%zu] rows", capacity);
+		return ERR_NOMEM;
+	}
+
+	for (row = 0; row < num_rows; ++row) {
+		values[row] = column->values.int_vals[row];
+	}
+
+	free(column->values.ptr);
+	column->values.int64_vals = values;
+	column->type = INT64;
+
+	return ERR_OK;
+}
+
+static int32_t append_column_row(sqlite3_stmt* stmt, void* ctx)
+{
+	db_column_result* result = (db_column_result*)ctx;
+	db_column* column;
+	size_t row = result->num_rows;
+	size_t col;
+	size_t col_len;
+	const char* col_value;
+	char* text;
+	int64_t int_value;
+	int32_t rc;
+
+	if (!result->columns) {
+		rc = init_columns(stmt, result);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (row == result->capacity) {
+		rc = grow_columns(result);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	for (col = 0; col < result->num_cols; ++col) {
+		column = &result->columns[col];
+		switch (column->type) {
+			case INT:
+				int_value = sqlite3_column_int64(stmt, col);
+				if (INT32_MIN <= int_value && int_value <= INT32_MAX) {
+					column->values.int_vals[row] = (int32_t)int_value;
+					break;
+				}
+
+				rc = widen_column(column, result->capacity, row);
+				if (ERR_OK != rc) {
+					return rc;
+				}
+				column->values.int64_vals[row] = int_value;
+				break;
+			case INT64:
+				column->values.int64_vals[row] = sqlite3_column_int64(stmt, col);
+				break;
+			case DOUBLE:
+				column->values.double_vals[row] =
+					sqlite3_column_double(stmt, col);
+				break;
+			default:
+				col_value = (const char*)sqlite3_column_text(stmt, col);
+				col_len = sqlite3_column_bytes(stmt, col);
+
+				text = arena_alloc(&result->text, col_len + 1);
+				if (!text) {
+					return ERR_NOMEM;
+				}
+
+				if (col_value) {
+					memcpy(text, col_value, col_len);
+				}
+				text[col_len] = '\0';
+				column->values.string_vals[row] = text;
+				break;
+		}
+	}
+
+	++result->num_rows;
+
+	return ERR_OK;
+}
+
+static int32_t run_query(
+	db_query* query,
+	row_handler handler,
+	void* ctx,
+	const size_t* text_bytes)
+{
+	sqlite3_stmt *stmt;
+	db_stmt_cache_entry* entry;
+	exec_stats exec = {0};
+	uint64_t start_ns;
+	bool collect;
+	int32_t rc;
+
+	if (!query) {
+		ERR_LOG("query is null");
+		return ERR_INVALID;
+	}
+
+	if (!query->query) {
+		ERR_LOG("SQL query is NULL");
+		return ERR_INVALID;
+	}
+
+	DEBUG_LOG("Preparing query [%s]", query->query);
+
+	start_ns = monotonic_ns();
+
+	rc = generate_sql_statment(query, &stmt, &entry);
+	if (ERR_OK != rc)
+	{
+		ERR_LOG("Failed to generate sql statement");
+		return rc;
+	}
+
+	if (!handler) {
+		INFO_LOG("Result is null. Ignoring results returned from query");
+	}
+
+	collect = collecting_stats(query, entry);
+
+	rc = step_statement(stmt, handler, ctx, collect ? &exec : NULL);
+	if (ERR_OK != rc)
+	{
+		ERR_LOG("Failed to execute query [%s]: [%d:%s]",
+			query->query, rc, sqlite3_errmsg(get_query_handle(query)));
+	}
+	else {
+		DEBUG_LOG("Successfully executed query");
+	}
+
+	if (collect) {
+		exec.latency_ns = monotonic_ns() - start_ns;
+		exec.text_bytes = text_bytes ? *text_bytes : 0;
+		exec.failed = ERR_OK != rc;
+		record_execution(query, entry, &exec);
+	}
+
+	release_statement(query, stmt, entry);
+
+	return rc;
+}
+
+/* Called by SQLite with the connection's mutex held whenever a lock is
+ * busy. count is the number of times it was already called for this
+ * lock. Returning 0 gives up and the statement fails with SQLITE_BUSY. */
+static int busy_handler(void* ctx, int count)
+{
+	db_connection* connection = (db_connection*)ctx;
+	db_busy_stats* stats = &connection->busy_stats;
+	int32_t timeout_ms = BUSY_DEFAULT_TIMEOUT_MS;
+	uint64_t now = monotonic_ns();
+	uint64_t deadline;
+	uint64_t delay;
+	struct timespec sleep_time;
+
+	if (connection->options && connection->options->busy_timeout_ms) {
+		timeout_ms = connection->options->busy_timeout_ms;
+	}
+
+	if (0 == count) {
+		connection->busy_start_ns = now;
+		++stats->busy_events;
+	}
+
+	deadline = connection->busy_start_ns + (uint64_t)timeout_ms * NS_PER_MS;
+	if (timeout_ms < 0 || now >= deadline) {
+		WARN_LOG("Database busy for [%d]ms, giving up", timeout_ms);
+		++stats->timeouts;
+		return 0;
+	}
+
+	delay = count < 16 ? (uint64_t)BUSY_INITIAL_DELAY_NS << count : BUSY_MAX_DELAY_NS;
+	if (delay > BUSY_MAX_DELAY_NS) {
+		delay = BUSY_MAX_DELAY_NS;
+	}
+	if (delay > deadline - now) {
+		delay = deadline - now;
+	}
+
+	sleep_time.tv_sec = delay / NS_PER_SEC;
+	sleep_time.tv_nsec = delay % NS_PER_SEC;
+	nanosleep(&sleep_time, NULL);
+
+	++stats->retries;
+	stats->wait_ns += monotonic_ns() - now;
+
+	return 1;
+}
+
+static int32_t execute_pragma(
+	sqlite3* handle,
+	db_query_result* result,
+	const char* format,
+	...)
+{
+	char pragma[MAX_PRAGMA_LENGTH];
+	db_query query = {0};
+	va_list args;
+	int32_t rc;
+
+	va_start(args, format);
+	rc = vsnprintf(pragma, MAX_PRAGMA_LENGTH, format, args);
+	va_end(args);
+	if (0 > rc || MAX_PRAGMA_LENGTH <= rc) {
+		ERR_LOG("Unable to format pragma [%s]", format);
+		return ERR_INVALID;
+	}
+
+	DEBUG_LOG("Applying [%s]", pragma);
+
+	query.handle = handle;
+	query.query = pragma;
+
+	return execute_query(&query, result);
+}
+
+static int32_t set_journal_mode(sqlite3* handle, db_journal_mode journal_mode)
+{
+	db_query_result result = {0};
+	const char* name = JOURNAL_MODE_NAMES[journal_mode];
+	int32_t rc;
+
+	rc = execute_pragma(handle, &result, "PRAGMA journal_mode=%s;", name);
+	if (ERR_OK != rc) {
+		return rc;
+	}
+
+	/* The pragma returns the journal mode in effect, which differs from
+	 * the one asked for if it is not supported, e.g. WAL in memory */
+	if (1 != result.num_rows ||
+		TEXT != result.values[0][0].type ||
+		0 != strcasecmp(name, result.values[0][0].value.string_val)) {
+
+		ERR_LOG("Unable to set journal mode [%s]", name);
+		rc = ERR_NOT_PERMITTED;
+	}
+
+	free_results(&result);
+
+	return rc;
+}
+
+static int32_t apply_options(db_connection* connection)
+{
+	const db_options* options = connection->options;
+	sqlite3* handle = connection->handle;
+	int32_t rc = ERR_OK;
+
+	if (!options) {
+		return ERR_OK;
+	}
+
+	if ((uint32_t)options->journal_mode > JOURNAL_MODE_OFF ||
+		(uint32_t)options->synchronous > SYNCHRONOUS_EXTRA ||
+		(uint32_t)options->temp_store > TEMP_STORE_MEMORY ||
+		(uint32_t)options->locking_mode > LOCKING_MODE_EXCLUSIVE) {
+
+		ERR_LOG("Invalid DB options");
+		return ERR_INVALID;
+	}
+
+	/* page_size must come before anything that creates the database */
+	if (options->page_size && !connection->read_only) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA page_size=%d;", options->page_size);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->locking_mode) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA locking_mode=%s;", LOCKING_MODE_NAMES[options->locking_mode]);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->journal_mode && !connection->read_only) {
+		rc = set_journal_mode(handle, options->journal_mode);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->synchronous) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA synchronous=%s;", SYNCHRONOUS_NAMES[options->synchronous]);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->cache_size) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA cache_size=%d;", options->cache_size);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->mmap_size) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA mmap_size=%lld;", (long long)options->mmap_size);
+		if (ERR_OK != rc) {
+			return rc;
+		}
+	}
+
+	if (options->temp_store) {
+		rc = execute_pragma(handle, NULL,
+			"PRAGMA temp_store=%s;", TEMP_STORE_NAMES[options->temp_store]);
+	}
+
+	return rc;
+}
+
+int32_t open_db(db_connection* connection)
+{
+	char* full_path = NULL;
+	int32_t flags;
+	int32_t rc;
+	if (!connection) {
+		ERR_LOG("connection is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!connection->db_path) {
+		ERR_LOG("DB path is NULL");
+		return ERR_INVALID;
+	}
+
+	if (connection->handle) {
+		ERR_LOG("DB is already open");
+		return ERR_IN_USE;
+	}
+
+	connection->data_version_stmt = NULL;
+
+	get_full_path(&full_path, connection->db_path);
+
+	NOTICE_LOG("Opening connection to db [%s]", full_path);
+
+	rc = create_db_directory(connection->db_path);
+	if (0 != rc) {
+		ERR_LOG("Failed to create DB directory [%s]: [%d:%m]",
+			connection->db_path, rc);
+		goto CLEAN_UP;
+	}
+
+	if (connection->read_only) {
+		flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+	}
+	else {
+		flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+	}
+
+	rc = sqlite3_open_v2(
+		full_path,
+		(sqlite3**)&connection->handle,
+		flags,
+		NULL);
+
+	if (SQLITE_OK != rc) {
+		ERR_LOG("Failed to open DB connection to [%s]: [%d:%s]",
+			full_path, rc, sqlite3_errstr(rc));
+		goto CLEAN_UP;
+	}
+
+	connection->stmt_cache.hits = 0;
+	connection->stmt_cache.misses = 0;
+
+	memset(&connection->busy_stats, 0, sizeof(db_busy_stats));
+	sqlite3_busy_handler(connection->handle, busy_handler, connection);
+
+	rc = apply_options(connection);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to apply DB options");
+		sqlite3_close(connection->handle);
+		connection->handle = NULL;
+	}
+
+CLEAN_UP:
+
+	free(full_path);
+
+	return rc;
+}
+
+int32_t close_db(db_connection* connection)
+{
+	int32_t rc;
+	NOTICE_LOG("Closing database connection");
+
+	if (connection->busy_stats.busy_events) {
+		INFO_LOG("Database was busy [%lu] times, waited [%lu]ns "
+			"over [%lu] retries with [%lu] timeouts",
+			connection->busy_stats.busy_events,
+			connection->busy_stats.wait_ns,
+			connection->busy_stats.retries,
+			connection->busy_stats.timeouts);
+	}
+
+	if (connection->collect_stats) {
+		dump_query_stats(connection, NULL);
+	}
+
+	clear_stmt_cache(connection);
+
+	sqlite3_finalize(connection->data_version_stmt);
+	connection->data_version_stmt = NULL;
+
+	rc = sqlite3_close(connection->handle);
+	if (SQLITE_OK != rc)
+	{
+		ERR_LOG("Failed to close database connection: %d", rc);
+		return sqlite_error_to_error(rc);
+	}
+
+	connection->handle = NULL;
+
+	return ERR_OK;
+}
+
+int32_t execute_query(db_query* query, db_query_result* result)
+{
+	result_builder builder = { result, 0, 0 };
+	int32_t rc;
+
+	if (result) {
+		result->num_rows = 0;
+		result->num_cols = 0;
+		result->values = NULL;
+	}
+
+	rc = run_query(
+		query,
+		result ? append_result_row : NULL,
+		&builder,
+		&builder.text_bytes);
+	if (ERR_OK != rc && result) {
+		free_results(result);
+		result->values = NULL;
+		result->num_rows = 0;
+	}
+
+	return rc;
+}
+
+int32_t execute_columnar_query(db_query* query, db_column_result* result)
+{
+	int32_t rc;
+
+	if (!result) {
+		ERR_LOG("Column result is NULL");
+		return ERR_INVALID;
+	}
+
+	memset(result, 0, sizeof(db_column_result));
+
+	rc = run_query(query, append_column_row, result, &result->text.total_bytes);
+	if (ERR_OK != rc) {
+		free_column_result(result);
+		return rc;
+	}
+
+	DEBUG_LOG("Got [%u] rows with [%u] text bytes",
+		result->num_rows, result->text.total_bytes);
+
+	return ERR_OK;
+}
+
+int32_t execute_mapped_query(
+	db_query* query,
+	db_row_mapper mapper,
+	size_t row_size,
+	void* ctx,
+	void** rows,
+	size_t* num_rows)
+{
+	mapped_builder builder = { mapper, row_size, ctx, NULL, 0, 0 };
+	int32_t rc;
+
+	if (!mapper || !row_size || !rows || !num_rows) {
+		ERR_LOG("Invalid arguments for mapped query");
+		return ERR_INVALID;
+	}
+
+	rc = run_query(query, append_mapped_row, &builder, NULL);
+
+	*rows = builder.rows;
+	*num_rows = builder.num_rows;
+
+	return rc;
+}
+
+int32_t open_cursor(db_query* query, db_cursor* cursor)
+{
+	int32_t rc;
+
+	if (!cursor) {
+		ERR_LOG("Cursor is NULL");
+		return ERR_INVALID;
+	}
+
+	memset(cursor, 0, sizeof(db_cursor));
+
+	if (!query) {
+		ERR_LOG("query is null");
+		return ERR_INVALID;
+	}
 
 	if (!query->query) {
 		ERR_LOG("SQL query is NULL");
 		return ERR_INVALID;
 	}
 
-	if (result) {
-		DEBUG_LOG("Getting result row count");
-		rc = get_num_results(query, result);
-		if (0 != rc) {
-			ERR_LOG("Failed to get result count");
+	DEBUG_LOG("Opening cursor for query [%s]", query->query);
+
+	rc = generate_sql_statment(query, &cursor->stmt, &cursor->entry);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to generate sql statement");
+		return rc;
+	}
+
+	cursor->query = query;
+	cursor->num_cols = sqlite3_column_count(cursor->stmt);
+
+	return ERR_OK;
+}
+
+int32_t cursor_next(db_cursor* cursor, bool* has_row)
+{
+	uint64_t start_ns;
+	int32_t rc;
+
+	if (!cursor || !has_row) {
+		ERR_LOG("Cursor or row flag is NULL");
+		return ERR_INVALID;
+	}
+
+	*has_row = false;
+
+	if (!cursor->stmt) {
+		ERR_LOG("Cursor is not open");
+		return ERR_NOT_READY;
+	}
+
+	/* Stepping again after SQLITE_DONE would restart the query */
+	if (cursor->done) {
+		return ERR_OK;
+	}
+
+	if (collecting_stats(cursor->query, cursor->entry)) {
+		start_ns = monotonic_ns();
+		rc = sqlite3_step(cursor->stmt);
+		cursor->step_ns += monotonic_ns() - start_ns;
+	}
+	else {
+		rc = sqlite3_step(cursor->stmt);
+	}
+
+	switch (rc) {
+		case SQLITE_ROW:
+			*has_row = true;
+			++cursor->num_rows;
+			return ERR_OK;
+		case SQLITE_DONE:
+			cursor->done = true;
+			return ERR_OK;
+		default:
+			ERR_LOG("Failed to step query [%s]: [%d:%s]",
+				cursor->query->query, rc,
+				sqlite3_errmsg(get_query_handle(cursor->query)));
+			cursor->done = true;
+			cursor->failed = true;
+			return sqlite_error_to_error(rc);
+	}
+}
+
+db_type cursor_column_type(const db_cursor* cursor, size_t col)
+{
+	int64_t value;
+
+	switch (sqlite3_column_type(cursor->stmt, col)) {
+		case SQLITE_FLOAT:
+			return DOUBLE;
+		case SQLITE_TEXT:
+		case SQLITE_BLOB:
+			return TEXT;
+		case SQLITE_INTEGER:
+			value = sqlite3_column_int64(cursor->stmt, col);
+			return INT32_MIN <= value && value <= INT32_MAX ? INT : INT64;
+		default:
+			return INT;
+	}
+}
+
+int32_t cursor_column_int(const db_cursor* cursor, size_t col)
+{
+	return sqlite3_column_int(cursor->stmt, col);
+}
+
+int64_t cursor_column_int64(const db_cursor* cursor, size_t col)
+{
+	return sqlite3_column_int64(cursor->stmt, col);
+}
+
+double cursor_column_double(const db_cursor* cursor, size_t col)
+{
+	return sqlite3_column_double(cursor->stmt, col);
+}
+
+const char* cursor_column_text(const db_cursor* cursor, size_t col, size_t* len)
+{
+	const char* text = (const char*)sqlite3_column_text(cursor->stmt, col);
+
+	if (len) {
+		*len = sqlite3_column_bytes(cursor->stmt, col);
+	}
+
+	return text ? text : "";
+}
+
+/* Records the execution since the cursor was opened or last reset */
+static void record_cursor_execution(db_cursor* cursor)
+{
+	exec_stats exec = {0};
+
+	if (!collecting_stats(cursor->query, cursor->entry) ||
+		!(cursor->done || cursor->num_rows)) {
+		return;
+	}
+
+	exec.latency_ns = cursor->step_ns;
+	exec.step_ns = cursor->step_ns;
+	exec.rows = cursor->num_rows;
+	exec.failed = cursor->failed;
+	record_execution(cursor->query, cursor->entry, &exec);
+
+	cursor->step_ns = 0;
+	cursor->num_rows = 0;
+	cursor->failed = false;
+}
+
+int32_t reset_cursor(db_cursor* cursor)
+{
+	int32_t rc;
+
+	if (!cursor) {
+		ERR_LOG("Cursor is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!cursor->stmt) {
+		ERR_LOG("Cursor is not open");
+		return ERR_NOT_READY;
+	}
+
+	record_cursor_execution(cursor);
+
+	sqlite3_reset(cursor->stmt);
+	cursor->done = false;
+
+	if (0 < cursor->query->num_params) {
+		rc = bind_params(cursor->stmt, cursor->entry, cursor->query);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to bind params to query [%s]",
+				cursor->query->query);
 			return rc;
 		}
+	}
 
-		DEBUG_LOG("Allocating [%u] result rows", result->num_rows)
+	return ERR_OK;
+}
 
-		result->values = (db_value**)malloc(sizeof(db_value*) * result->num_rows);
-		if (!result->values) {
-			ERR_LOG("Failed to allocate result rows");
-			return ERR_NOMEM;
-		}
+int32_t close_cursor(db_cursor* cursor)
+{
+	if (!cursor) {
+		ERR_LOG("Cursor is NULL");
+		return ERR_INVALID;
 	}
 
-	DEBUG_LOG("Preparing query [%s]", query->query);
+	if (!cursor->stmt) {
+		return ERR_OK;
+	}
 
-	sqlite3_stmt *stmt;
-	rc = generate_sql_statment(query, &stmt);
-	if (ERR_OK != rc)
-	{
-		ERR_LOG("Failed to generate sql statement");
-		return rc;
+	record_cursor_execution(cursor);
+
+	release_statement(cursor->query, cursor->stmt, cursor->entry);
+
+	cursor->stmt = NULL;
+	cursor->entry = NULL;
+
+	return ERR_OK;
+}
+
+int32_t execute_query_with_callback(
+	db_query* query,
+	db_row_callback callback,
+	void* ctx)
+{
+	db_cursor cursor;
+	bool has_row;
+	int32_t rc;
+
+	if (!callback) {
+		ERR_LOG("Row callback is NULL");
+		return ERR_INVALID;
 	}
 
-	rc = handle_result(stmt, result);
-	if (ERR_OK != rc)
-	{
-		ERR_LOG("Failed to execute query [%s]: [%d:%s]",
-			query->query, rc, sqlite3_errstr(rc));
-		sqlite3_finalize(stmt);
+	rc = open_cursor(query, &cursor);
+	if (ERR_OK != rc) {
 		return rc;
 	}
-	DEBUG_LOG("Successfully executed query");
 
-	sqlite3_finalize(stmt);
+	while (ERR_OK == (rc = cursor_next(&cursor, &has_row)) && has_row) {
+		rc = callback(&cursor, ctx);
+		if (ERR_OK != rc) {
+			WARN_LOG("Row callback stopped query [%s]: [%d:%s]",
+				query->query, rc, error_to_string(rc));
+			break;
+		}
+	}
+
+	close_cursor(&cursor);
+
+	return rc;
+}
+
+void clear_stmt_cache(db_connection* connection)
+{
+	db_stmt_cache* cache;
+	size_t i;
+	size_t j;
+
+	if (!connection) {
+		return;
+	}
+
+	cache = &connection->stmt_cache;
+
+	DEBUG_LOG("Clearing statement cache [%u entries, %lu hits, %lu misses]",
+		cache->num_entries, cache->hits, cache->misses);
+
+	for (i = 0; i < cache->capacity; ++i) {
+		if (cache->entries[i]) {
+			sqlite3_finalize(cache->entries[i]->stmt);
+			free(cache->entries[i]->query);
+			for (j = 0; j < cache->entries[i]->num_param_indexes; ++j) {
+				free(cache->entries[i]->param_names[j]);
+			}
+			free(cache->entries[i]->param_names);
+			free(cache->entries[i]->param_indexes);
+			free(cache->entries[i]);
+		}
+	}
+
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->capacity = 0;
+	cache->num_entries = 0;
+}
+
+int32_t get_busy_stats(db_connection* connection, db_busy_stats* stats)
+{
+	if (!connection || !stats) {
+		ERR_LOG("Connection or stats is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!connection->handle) {
+		ERR_LOG("Connection is not open");
+		return ERR_NOT_READY;
+	}
+
+	/* The busy handler updates the counters holding this mutex */
+	sqlite3_mutex_enter(sqlite3_db_mutex(connection->handle));
+	*stats = connection->busy_stats;
+	sqlite3_mutex_leave(sqlite3_db_mutex(connection->handle));
+
+	return ERR_OK;
+}
+
+int32_t check_db_changed(db_connection* connection, bool* changed)
+{
+	int64_t data_version;
+	int64_t total_changes;
+	bool first_check;
+	sqlite3_mutex* mutex;
+	int32_t rc = ERR_OK;
+
+	if (!connection || !changed) {
+		ERR_LOG("Connection or changed flag is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!connection->handle) {
+		ERR_LOG("Connection is not open");
+		return ERR_NOT_READY;
+	}
+
+	/* The statement and the counters are shared by the threads using a
+	 * writer. NULL, and a no-op, for connections opened without a
+	 * mutex. */
+	mutex = sqlite3_db_mutex(connection->handle);
+	sqlite3_mutex_enter(mutex);
+
+	/* Kept out of the statement cache so checks do not skew its stats */
+	first_check = !connection->data_version_stmt;
+	if (first_check) {
+		rc = sqlite3_prepare_v2(connection->handle, DATA_VERSION_PRAGMA, -1,
+			&connection->data_version_stmt, NULL);
+		if (SQLITE_OK != rc) {
+			ERR_LOG("Failed to prepare [%s]: [%d:%s]", DATA_VERSION_PRAGMA,
+				rc, sqlite3_errmsg(connection->handle));
+			rc = sqlite_error_to_error(rc);
+			goto CLEAN_UP;
+		}
+	}
+
+	rc = sqlite3_step(connection->data_version_stmt);
+	data_version = sqlite3_column_int64(connection->data_version_stmt, 0);
+	sqlite3_reset(connection->data_version_stmt);
+	if (SQLITE_ROW != rc) {
+		ERR_LOG("Failed to step [%s]: [%d:%s]", DATA_VERSION_PRAGMA,
+			rc, sqlite3_errmsg(connection->handle));
+		rc = sqlite_error_to_error(rc);
+		goto CLEAN_UP;
+	}
+	rc = ERR_OK;
+
+	/* data_version only moves for commits by other connections */
+	total_changes = sqlite3_total_changes64(connection->handle);
+
+	*changed = first_check ||
+		data_version != connection->data_version ||
+		total_changes != connection->total_changes;
+
+	connection->data_version = data_version;
+	connection->total_changes = total_changes;
+
+CLEAN_UP:
+
+	sqlite3_mutex_leave(mutex);
+
+	return rc;
+}
+
+static db_stmt_cache_entry* find_cached_query(
+	db_connection* connection,
+	const char* query)
+{
+	db_stmt_cache* cache = &connection->stmt_cache;
+
+	if (!cache->capacity) {
+		return NULL;
+	}
+
+	return *find_cache_slot(cache, query, hash_query(query));
+}
+
+int32_t get_query_stats(
+	db_connection* connection,
+	const char* query,
+	db_query_stats* stats)
+{
+	db_stmt_cache_entry* entry;
+	int32_t rc = ERR_OK;
+
+	if (!connection || !query || !stats) {
+		ERR_LOG("Connection, query or stats is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!connection->handle) {
+		ERR_LOG("Connection is not open");
+		return ERR_NOT_READY;
+	}
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(connection->handle));
+
+	entry = find_cached_query(connection, query);
+	if (entry) {
+		*stats = entry->stats;
+	}
+	else {
+		rc = ERR_NOT_FOUND;
+	}
+
+	sqlite3_mutex_leave(sqlite3_db_mutex(connection->handle));
+
+	return rc;
+}
+
+static void write_json_string(FILE* file, const char* text)
+{
+	fputc('"', file);
+
+	for (; *text; ++text) {
+		switch (*text) {
+			case '"':
+				fputs("\\\"", file);
+				break;
+			case '\\':
+				fputs("\\\\", file);
+				break;
+			case '\n':
+				fputs("\\n", file);
+				break;
+			case '\t':
+				fputs("\\t", file);
+				break;
+			default:
+				if ((unsigned char)*text < 0x20) {
+					fprintf(file, "\\u%04x", *text);
+				}
+				else {
+					fputc(*text, file);
+				}
+				break;
+		}
+	}
+
+	fputc('"', file);
+}
+
+static void write_query_stats_json(
+	FILE* file,
+	const db_stmt_cache_entry* entry,
+	bool first)
+{
+	const db_query_stats* stats = &entry->stats;
+	size_t last_bucket = DB_LATENCY_BUCKETS;
+	size_t i;
+
+	/* Trailing empty buckets are left out */
+	while (last_bucket && !stats->latency_histogram[last_bucket - 1]) {
+		--last_bucket;
+	}
+
+	fprintf(file, "%s\n  {\"query\": ", first ? "" : ",");
+	write_json_string(file, entry->query);
+	fprintf(file, ", \"calls\": %lu, \"errors\": %lu, \"prepare_ns\": %lu, "
+		"\"step_ns\": %lu, \"rows\": %lu, \"text_bytes\": %lu, "
+		"\"latency_us_log2\": [",
+		stats->calls,
+		stats->errors,
+		stats->prepare_ns,
+		stats->step_ns,
+		stats->rows,
+		stats->text_bytes);
+
+	for (i = 0; i < last_bucket; ++i) {
+		fprintf(file, "%s%lu", i ? ", " : "", stats->latency_histogram[i]);
+	}
+
+	fputs("]}", file);
+}
+
+static void log_query_stats(const db_stmt_cache_entry* entry)
+{
+	const db_query_stats* stats = &entry->stats;
+	uint64_t median = (stats->calls + 1) / 2;
+	uint64_t seen = 0;
+	size_t bucket = 0;
+
+	/* Upper bound of the bucket holding the median call */
+	while (bucket < DB_LATENCY_BUCKETS - 1 &&
+		(seen += stats->latency_histogram[bucket]) < median) {
+		++bucket;
+	}
+
+	INFO_LOG("Query [%s]: [%lu] calls, [%lu] errors, [%lu] rows, "
+		"[%lu] text bytes, prepare [%lu]ns, step [%lu]ns, median < [%lu]us",
+		entry->query,
+		stats->calls,
+		stats->errors,
+		stats->rows,
+		stats->text_bytes,
+		stats->prepare_ns,
+		stats->step_ns,
+		1UL << bucket);
+}
+
+int32_t dump_query_stats(db_connection* connection, FILE* file)
+{
+	db_stmt_cache* cache;
+	bool first = true;
+	size_t i;
+
+	if (!connection) {
+		ERR_LOG("Connection is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!connection->handle) {
+		ERR_LOG("Connection is not open");
+		return ERR_NOT_READY;
+	}
+
+	cache = &connection->stmt_cache;
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(connection->handle));
+
+	if (file) {
+		fputc('[', file);
+	}
+
+	for (i = 0; i < cache->capacity; ++i) {
+		if (!cache->entries[i] || !cache->entries[i]->stats.calls) {
+			continue;
+		}
+
+		if (file) {
+			write_query_stats_json(file, cache->entries[i], first);
+		}
+		else {
+			log_query_stats(cache->entries[i]);
+		}
+		first = false;
+	}
+
+	if (file) {
+		fputs(first ? "]\n" : "\n]\n", file);
+	}
+
+	sqlite3_mutex_leave(sqlite3_db_mutex(connection->handle));
 
 	return ERR_OK;
 }
 
+void reset_query_stats(db_connection* connection)
+{
+	db_stmt_cache* cache;
+	uint64_t prepare_ns;
+	size_t i;
+
+	if (!connection || !connection->handle) {
+		return;
+	}
+
+	cache = &connection->stmt_cache;
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(connection->handle));
+
+	/* Statements stay prepared so keep what preparing them cost */
+	for (i = 0; i < cache->capacity; ++i) {
+		if (cache->entries[i]) {
+			prepare_ns = cache->entries[i]->stats.prepare_ns;
+			memset(&cache->entries[i]->stats, 0, sizeof(db_query_stats));
+			cache->entries[i]->stats.prepare_ns = prepare_ns;
+		}
+	}
+
+	sqlite3_mutex_leave(sqlite3_db_mutex(connection->handle));
+}
+
 void free_results(db_query_result* restrict results) {
 	if (!results ||
 		!results->values) {
@@ -489,6 +1987,26 @@ void free_results(db_query_result* restrict results) {
 	free(results->values);
 }
 
+void free_column_result(db_column_result* restrict result) {
+	size_t col;
+
+	if (!result) {
+		return;
+	}
+
+	for (col = 0; col < result->num_cols; ++col) {
+		free(result->columns[col].values.ptr);
+	}
+
+	free(result->columns);
+	free_arena(&result->text);
+
+	result->columns = NULL;
+	result->num_cols = 0;
+	result->num_rows = 0;
+	result->capacity = 0;
+}
+
 void free_params(query_param* restrict params, uint32_t num_params) {
 	for (uint32_t i = 0; i < num_params; ++i) {
 		if (TEXT == params[i].param.type &&
@@ -0,0 +1,247 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sql/sql_pool.h>
+#include <sql/sql_db.h>
+#include <error.h>
+#include <log.h>
+
+static size_t default_num_readers()
+{
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return num_cpus > 0 ? (size_t)num_cpus : 1;
+}
+
+int32_t open_pool(
+	db_pool* pool,
+	const char* db_path,
+	size_t num_readers,
+	const db_options* options)
+{
+	size_t i;
+	int32_t rc;
+
+	if (!pool || !db_path) {
+		ERR_LOG("Pool or DB path is NULL");
+		return ERR_INVALID;
+	}
+
+	memset(pool, 0, sizeof(db_pool));
+
+	if (!num_readers) {
+		num_readers = default_num_readers();
+	}
+
+	pool->db_path = strdup(db_path);
+	pool->readers = (db_connection*)calloc(num_readers, sizeof(db_connection));
+	pool->free_readers = (size_t*)calloc(num_readers, sizeof(size_t));
+	if (!pool->db_path || !pool->readers || !pool->free_readers) {
+		ERR_LOG("Unable to allocate pool of [%zu] readers", num_readers);
+		free(pool->db_path);
+		free(pool->readers);
+		free(pool->free_readers);
+		return ERR_NOMEM;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->available, NULL);
+
+	/* Readers only run alongside the writer in WAL mode and without an
+	 * exclusive lock */
+	pool->options = options ? *options : DB_OPTIONS_DEFAULT;
+	pool->options.journal_mode = JOURNAL_MODE_WAL;
+	if (LOCKING_MODE_EXCLUSIVE == pool->options.locking_mode) {
+		WARN_LOG("Exclusive locking is not supported by a pool");
+		pool->options.locking_mode = LOCKING_MODE_NORMAL;
+	}
+
+	/* The writer creates the database so it must be opened first */
+	pool->writer.db_path = pool->db_path;
+	pool->writer.options = &pool->options;
+	rc = open_db(&pool->writer);
+	if (ERR_OK != rc) {
+		ERR_LOG("Failed to open pool writer: [%d:%s]", rc, error_to_string(rc));
+		goto CLEAN_UP;
+	}
+
+	for (i = 0; i < num_readers; ++i) {
+		pool->readers[i].db_path = pool->db_path;
+		pool->readers[i].read_only = true;
+		pool->readers[i].options = &pool->options;
+
+		rc = open_db(&pool->readers[i]);
+		if (ERR_OK != rc) {
+			ERR_LOG("Failed to open pool reader [%zu]: [%d:%s]",
+				i, rc, error_to_string(rc));
+			goto CLEAN_UP;
+		}
+
+		pool->free_readers[i] = i;
+		++pool->num_readers;
+		++pool->num_free_readers;
+	}
+
+	NOTICE_LOG("Opened pool with [%zu] readers", pool->num_readers);
+
+	return ERR_OK;
+
+CLEAN_UP:
+
+	close_pool(pool);
+
+	return rc;
+}
+
+int32_t close_pool(db_pool* pool)
+{
+	int32_t rc = ERR_OK;
+	int32_t close_rc;
+	size_t i;
+
+	if (!pool) {
+		ERR_LOG("Pool is NULL");
+		return ERR_INVALID;
+	}
+
+	if (pool->writer_in_use || pool->num_free_readers != pool->num_readers) {
+		ERR_LOG("Closing pool with connections checked out");
+		return ERR_IN_USE;
+	}
+
+	/* Every connection is closed, reporting the first failure */
+	for (i = 0; i < pool->num_readers; ++i) {
+		close_rc = close_db(&pool->readers[i]);
+		if (ERR_OK == rc) {
+			rc = close_rc;
+		}
+	}
+
+	if (pool->writer.handle) {
+		close_rc = close_db(&pool->writer);
+		if (ERR_OK == rc) {
+			rc = close_rc;
+		}
+	}
+
+	pthread_cond_destroy(&pool->available);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->free_readers);
+	free(pool->readers);
+	free(pool->db_path);
+	memset(pool, 0, sizeof(db_pool));
+
+	return rc;
+}
+
+static int32_t take_reader(db_pool* pool, bool wait, db_connection** connection)
+{
+	int32_t rc = ERR_OK;
+
+	if (!pool || !connection) {
+		ERR_LOG("Pool or connection is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!pool->num_readers) {
+		ERR_LOG("Pool is not open");
+		return ERR_NOT_READY;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (!pool->num_free_readers && wait) {
+		pthread_cond_wait(&pool->available, &pool->lock);
+	}
+
+	if (pool->num_free_readers) {
+		--pool->num_free_readers;
+		*connection = &pool->readers[pool->free_readers[pool->num_free_readers]];
+	}
+	else {
+		rc = ERR_IN_USE;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return rc;
+}
+
+int32_t checkout_reader(db_pool* pool, db_connection** connection)
+{
+	return take_reader(pool, true, connection);
+}
+
+int32_t try_checkout_reader(db_pool* pool, db_connection** connection)
+{
+	return take_reader(pool, false, connection);
+}
+
+int32_t checkout_writer(db_pool* pool, db_connection** connection)
+{
+	if (!pool || !connection) {
+		ERR_LOG("Pool or connection is NULL");
+		return ERR_INVALID;
+	}
+
+	if (!pool->writer.handle) {
+		ERR_LOG("Pool is not open");
+		return ERR_NOT_READY;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->writer_in_use) {
+		pthread_cond_wait(&pool->available, &pool->lock);
+	}
+
+	pool->writer_in_use = true;
+	*connection = &pool->writer;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return ERR_OK;
+}
+
+int32_t checkin(db_pool* pool, db_connection* connection)
+{
+	size_t index;
+
+	if (!pool || !connection) {
+		ERR_LOG("Pool or connection is NULL");
+		return ERR_INVALID;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (connection == &pool->writer) {
+		pool->writer_in_use = false;
+	}
+	else if (connection >= pool->readers &&
+		connection < pool->readers + pool->num_readers &&
+		pool->num_free_readers < pool->num_readers) {
+
+		index = connection - pool->readers;
+		pool->free_readers[pool->num_free_readers] = index;
+		++pool->num_free_readers;
+	}
+	else {
+		pthread_mutex_unlock(&pool->lock);
+		ERR_LOG("Connection is not checked out from the pool");
+		return ERR_INVALID;
+	}
+
+	/* Readers and the writer share the condition */
+	pthread_cond_broadcast(&pool->available);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return ERR_OK;
+}
@@ -0,0 +1,348 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <unity.h>
+
+#include <app/import.h>
+#include <app/export.h>
+#include <budget_db/budget_db.h>
+#include <error.h>
+#include <log.h>
+
+#define TEST_NAME "budget_app_import_test"
+#define DB_FILE "budget.db"
+#define CSV_FILE "import.csv"
+#define EXPORT_FILE "export.csv"
+#define HOME_ENV "HOME"
+#define SECONDS_IN_A_DAY 86400
+
+/* Chunks are at least 1 MiB, so this splits into several */
+#define NUM_LARGE_ROWS 32
+#define LARGE_ROW_LINES 5000
+#define LARGE_ROW_LINE "2024-01-01,1.00,Fake row\n"
+
+/* The header is expected and not counted as skipped */
+static const char* FIXTURE =
+	"date,amount,description,payment_type,expense_type\n"
+	"2024-01-15,12.50,Groceries,1,2\n"
+	"2024-02-29,-3,\"Refund, partial\",0,1\r\n"
+	"2024-02-30,1.00,No such day\n"
+	"2023-02-29,1.00,Not a leap year\n"
+	"2024-+1-01,1.00,Signed month\n"
+	"2024- 1-01,1.00,Spaced month\n"
+	"  2024-3-5 , 7 ,Short digits\n"
+	"\n"
+	"86400,0.5,\"Line one\n"
+	"line two\",3,4\n"
+	"2024-03-01,1.005,Fraction of a cent\n"
+	"2024-03-01,abc,Bad amount\n"
+	"2024-03-01,2.00,\"Said \"\"hi\"\"\",5\n"
+	"2024-03-01,2.00\n"
+	"-86400,1,Before the epoch\n"
+	"253402300800,1,After 9999\n"
+	"1960-06-01,4.20,Sixties";
+
+#define FIXTURE_ROWS_IMPORTED 7
+#define FIXTURE_ROWS_SKIPPED 8
+
+db_connection db;
+char* csv_path;
+char* export_path;
+
+static char* home_file(const char* home_dir, const char* name) {
+	size_t length = strlen(home_dir) + strlen(name) + 2;
+	char* path = (char*)malloc(length);
+
+	TEST_ASSERT_NOT_NULL(path);
+	snprintf(path, length, "%s/%s", home_dir, name);
+
+	return path;
+}
+
+static void remove_file(const char* path) {
+	struct stat st;
+
+	if (0 == stat(path, &st)) {
+		DEBUG_LOG("Removing file [%s]", path);
+		remove(path);
+	}
+}
+
+static void remove_db_file() {
+	char* db_file_path = home_file(db.db_path, DB_FILE);
+
+	remove_file(db_file_path);
+	free(db_file_path);
+}
+
+static void write_file(const char* path, const char* text) {
+	FILE* file = fopen(path, "w");
+
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_EQUAL_UINT(strlen(text), fwrite(text, 1, strlen(text), file));
+	TEST_ASSERT_EQUAL_INT(0, fclose(file));
+}
+
+static const expense* find_expense(const expense_list* expenses, const char* description) {
+	size_t i;
+
+	for (i = 0; i < expenses->num_expenses; ++i) {
+		if (!strcmp(expenses->expenses[i].description, description)) {
+			return &expenses->expenses[i];
+		}
+	}
+
+	TEST_FAIL_MESSAGE(description);
+
+	return NULL;
+}
+
+static void get_all_expenses(expense_list* expenses) {
+	date_range range = { INT64_MIN, INT64_MAX };
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, expenses));
+}
+
+void suiteSetUp() {
+	const char* home_dir = getenv(HOME_ENV);
+
+	open_log(TEST_NAME);
+	TEST_ASSERT_NOT_NULL(home_dir);
+
+	db.db_path = strdup(home_dir);
+	TEST_ASSERT_NOT_NULL(db.db_path);
+
+	csv_path = home_file(home_dir, CSV_FILE);
+	export_path = home_file(home_dir, EXPORT_FILE);
+
+	NOTICE_LOG("Using directory [%s] for testing", db.db_path);
+
+	remove_db_file();
+}
+
+int32_t suiteTearDown(int32_t num_failures) {
+
+	NOTICE_LOG("Test [%s] completed with [%d] failures",
+		TEST_NAME, num_failures);
+
+	close_log();
+
+	remove_db_file();
+	remove_file(csv_path);
+	remove_file(export_path);
+
+	free(db.db_path);
+	free(csv_path);
+	free(export_path);
+
+	return num_failures != 0 ? ERR_KO : ERR_OK;
+}
+
+void setUp() {
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_db(&db));
+}
+
+void tearDown() {
+	if (db.handle) {
+		close_budget_db(&db);
+		db.handle = NULL;
+	}
+	remove_db_file();
+}
+
+void test_parse_calendar_date() {
+	time_t date;
+
+	TEST_ASSERT_TRUE(parse_calendar_date("2024-02-29", &date));
+	TEST_ASSERT_EQUAL_INT64(1709164800, date);
+	TEST_ASSERT_TRUE(parse_calendar_date("1969-12-31", &date));
+	TEST_ASSERT_EQUAL_INT64(-SECONDS_IN_A_DAY, date);
+	TEST_ASSERT_TRUE(parse_calendar_date("2024-3-5", &date));
+
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-02-30", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2023-02-29", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-13-01", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-00-10", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-+1-01", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date(" 2024-01-01", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-01-01 ", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("24-01-01", &date));
+	TEST_ASSERT_FALSE(parse_calendar_date("2024-001-01", &date));
+}
+
+void test_import_fixture() {
+	import_options options = {0};
+	import_stats stats = {0};
+	expense_list expenses = {0};
+	const expense* expense;
+	time_t date;
+
+	write_file(csv_path, FIXTURE);
+
+	options.path = csv_path;
+	options.num_threads = 1;
+	options.payment_type = 7;
+	options.expense_type = 8;
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, import_csv(&db, &options, &stats));
+	TEST_ASSERT_EQUAL_UINT(FIXTURE_ROWS_IMPORTED, stats.rows_imported);
+	TEST_ASSERT_EQUAL_UINT(FIXTURE_ROWS_SKIPPED, stats.rows_skipped);
+
+	get_all_expenses(&expenses);
+	TEST_ASSERT_EQUAL_UINT(FIXTURE_ROWS_IMPORTED, expenses.num_expenses);
+
+	expense = find_expense(&expenses, "Groceries");
+	TEST_ASSERT_TRUE(parse_calendar_date("2024-01-15", &date));
+	TEST_ASSERT_EQUAL_INT64(date, expense->date);
+	TEST_ASSERT_EQUAL_INT64(1250, expense->amount);
+	TEST_ASSERT_EQUAL_UINT(1, expense->payment_type);
+	TEST_ASSERT_EQUAL_UINT(2, expense->expense_type);
+
+	expense = find_expense(&expenses, "Refund, partial");
+	TEST_ASSERT_EQUAL_INT64(-300, expense->amount);
+
+	expense = find_expense(&expenses, "Short digits");
+	TEST_ASSERT_TRUE(parse_calendar_date("2024-03-05", &date));
+	TEST_ASSERT_EQUAL_INT64(date, expense->date);
+	TEST_ASSERT_EQUAL_INT64(700, expense->amount);
+	TEST_ASSERT_EQUAL_UINT(7, expense->payment_type);
+	TEST_ASSERT_EQUAL_UINT(8, expense->expense_type);
+
+	expense = find_expense(&expenses, "Line one\nline two");
+	TEST_ASSERT_EQUAL_INT64(SECONDS_IN_A_DAY, expense->date);
+	TEST_ASSERT_EQUAL_INT64(50, expense->amount);
+	TEST_ASSERT_EQUAL_UINT(3, expense->payment_type);
+	TEST_ASSERT_EQUAL_UINT(4, expense->expense_type);
+
+	expense = find_expense(&expenses, "Said \"hi\"");
+	TEST_ASSERT_EQUAL_UINT(5, expense->payment_type);
+	TEST_ASSERT_EQUAL_UINT(8, expense->expense_type);
+
+	expense = find_expense(&expenses, "Before the epoch");
+	TEST_ASSERT_EQUAL_INT64(-SECONDS_IN_A_DAY, expense->date);
+
+	expense = find_expense(&expenses, "Sixties");
+	TEST_ASSERT_TRUE(parse_calendar_date("1960-06-01", &date));
+	TEST_ASSERT_EQUAL_INT64(date, expense->date);
+	TEST_ASSERT_EQUAL_INT64(420, expense->amount);
+
+	free_expenses(&expenses);
+}
+
+void test_import_chunk_boundaries() {
+	import_options options = {0};
+	import_stats stats = {0};
+	expense_list expenses = {0};
+	size_t line_length = strlen(LARGE_ROW_LINE);
+	size_t row_length = line_length * LARGE_ROW_LINES + 64;
+	char* text = (char*)malloc(row_length * NUM_LARGE_ROWS + 1);
+	char* pos = text;
+	size_t i;
+	size_t j;
+
+	TEST_ASSERT_NOT_NULL(text);
+
+	/* Every split point lands inside a quoted description whose lines
+	 * look like rows of their own */
+	for (i = 0; i < NUM_LARGE_ROWS; ++i) {
+		pos += sprintf(pos, "%zu,%zu.25,\"", i * SECONDS_IN_A_DAY, i);
+		for (j = 0; j < LARGE_ROW_LINES; ++j) {
+			memcpy(pos, LARGE_ROW_LINE, line_length);
+			pos += line_length;
+		}
+		pos += sprintf(pos, "\",1,2\n");
+	}
+	*pos = '\0';
+
+	write_file(csv_path, text);
+	free(text);
+
+	options.path = csv_path;
+	options.num_threads = 4;
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, import_csv(&db, &options, &stats));
+	TEST_ASSERT_EQUAL_UINT(NUM_LARGE_ROWS, stats.rows_imported);
+	TEST_ASSERT_EQUAL_UINT(0, stats.rows_skipped);
+
+	get_all_expenses(&expenses);
+	TEST_ASSERT_EQUAL_UINT(NUM_LARGE_ROWS, expenses.num_expenses);
+	for (i = 0; i < NUM_LARGE_ROWS; ++i) {
+		TEST_ASSERT_EQUAL_UINT(line_length * LARGE_ROW_LINES,
+			strlen(expenses.expenses[i].description));
+		TEST_ASSERT_EQUAL_INT64(
+			expenses.expenses[i].date / SECONDS_IN_A_DAY * 100 + 25,
+			expenses.expenses[i].amount);
+	}
+	free_expenses(&expenses);
+}
+
+void test_export_round_trip() {
+	import_options import = {0};
+	import_stats stats = {0};
+	export_options export = {0};
+	expense_list expenses = {0};
+	expense_list reimported = {0};
+	size_t i;
+
+	write_file(csv_path, FIXTURE);
+
+	import.path = csv_path;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, import_csv(&db, &import, &stats));
+	get_all_expenses(&expenses);
+
+	export.fd = open(export_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT_TRUE(export.fd >= 0);
+	export.format = EXPORT_FORMAT_CSV;
+	export.range.start = INT64_MIN;
+	export.range.end = INT64_MAX;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, export_expenses(&db, &export, NULL));
+	TEST_ASSERT_EQUAL_INT(0, close(export.fd));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_budget_db(&db));
+	db.handle = NULL;
+	remove_db_file();
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_db(&db));
+
+	import.path = export_path;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, import_csv(&db, &import, &stats));
+	TEST_ASSERT_EQUAL_UINT(expenses.num_expenses, stats.rows_imported);
+	TEST_ASSERT_EQUAL_UINT(0, stats.rows_skipped);
+
+	get_all_expenses(&reimported);
+	TEST_ASSERT_EQUAL_UINT(expenses.num_expenses, reimported.num_expenses);
+	for (i = 0; i < expenses.num_expenses; ++i) {
+		TEST_ASSERT_EQUAL_INT64(expenses.expenses[i].date, reimported.expenses[i].date);
+		TEST_ASSERT_EQUAL_INT64(expenses.expenses[i].amount, reimported.expenses[i].amount);
+		TEST_ASSERT_EQUAL_UINT(expenses.expenses[i].payment_type,
+			reimported.expenses[i].payment_type);
+		TEST_ASSERT_EQUAL_UINT(expenses.expenses[i].expense_type,
+			reimported.expenses[i].expense_type);
+		TEST_ASSERT_EQUAL_STRING(expenses.expenses[i].description,
+			reimported.expenses[i].description);
+	}
+
+	free_expenses(&expenses);
+	free_expenses(&reimported);
+}
+
+int main() {
+	UNITY_BEGIN();
+
+	suiteSetUp();
+
+	RUN_TEST(test_parse_calendar_date);
+	RUN_TEST(test_import_fixture);
+	RUN_TEST(test_import_chunk_boundaries);
+	RUN_TEST(test_export_round_trip);
+
+	return suiteTearDown(UNITY_END());
+}
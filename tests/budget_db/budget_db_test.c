@@ -24,8 +24,8 @@ static void print_expenses(expense_list* restrict expenses) {
 	size_t i;
 	for (i = 0; i < expenses->num_expenses; ++i) {
 
-		DEBUG_LOG("Got expense [%f, %ld, %u, %u, %s]",
-			expenses->expenses[i].amount,
+		DEBUG_LOG("Got expense [%ld, %ld, %u, %u, %s]",
+			(long)expenses->expenses[i].amount,
 			expenses->expenses[i].date,
 			expenses->expenses[i].payment_type,
 			expenses->expenses[i].expense_type,
@@ -99,6 +99,7 @@ void setUp() {
 }
 
 void tearDown() {
+	db.result_cache = NULL;
 	if (db.handle) {
 		close_budget_db(&db);
 		db.handle = NULL;
@@ -119,6 +120,126 @@ void test_open_close_budget_db_with_invalid_arguments() {
 	TEST_ASSERT_EQUAL_INT(ERR_INVALID, close_budget_db(NULL));
 }
 
+static int32_t count_expense_indexes() {
+	db_query query = {0};
+	db_query_result result = {0};
+	int32_t count;
+
+	query.handle = db.handle;
+	query.query = "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND "
+		"tbl_name='expenses' AND name LIKE 'expenses_%_idx';";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+	count = result.values[0][0].value.int_val;
+	free_results(&result);
+
+	return count;
+}
+
+static int32_t get_schema_version() {
+	db_query query = {0};
+	db_query_result result = {0};
+	int32_t version;
+
+	query.handle = db.handle;
+	query.query = "PRAGMA user_version;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+	version = result.values[0][0].value.int_val;
+	free_results(&result);
+
+	return version;
+}
+
+/* Compares the columns of table, as "name type notnull pk", to expected */
+static void assert_table_columns(const char* table, const char* expected) {
+	db_query query = {0};
+	db_query_result result = {0};
+	char sql[256];
+
+	snprintf(sql, sizeof(sql),
+		"SELECT group_concat(name || ' ' || type || ' ' || \"notnull\" || ' ' || pk, ',') "
+		"FROM pragma_table_info('%s');", table);
+
+	query.handle = db.handle;
+	query.query = sql;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+	TEST_ASSERT_EQUAL_STRING(expected, result.values[0][0].value.string_val);
+	free_results(&result);
+}
+
+static void assert_current_schema() {
+	TEST_ASSERT_EQUAL_INT(5, get_schema_version());
+	TEST_ASSERT_EQUAL_INT(3, count_expense_indexes());
+	assert_table_columns("expenses",
+		"id INTEGER 0 1,amount INT 1 0,date INT 1 0,payment_type INT 1 0,"
+		"expense_type INT 1 0,description TEXT 1 0");
+	assert_table_columns("monthly_totals",
+		"year_month INT 1 1,expense_type INT 1 2,payment_type INT 1 3,"
+		"count INT 1 0,total INT 1 0");
+}
+
+void test_schema_migration() {
+	db_query query = {0};
+	expense_list expenses = {0};
+	monthly_total_list totals = {0};
+	date_range range = {0};
+
+	/* A new database is created at the current version directly */
+	assert_current_schema();
+
+	/* One from before versioning has expenses at version 0 and goes
+	 * through every migration, ending at the same schema */
+	query.handle = db.handle;
+	query.query = "DROP TABLE monthly_totals;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	query.query = "PRAGMA user_version = 0;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_budget_db(&db));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_db(&db));
+	assert_current_schema();
+
+	/* Roll the database back to a schema without indexes */
+	query.handle = db.handle;
+	query.query = "DROP INDEX expenses_date_idx;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	query.query = "PRAGMA user_version = 1;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_budget_db(&db));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_db(&db));
+	TEST_ASSERT_EQUAL_INT(3, count_expense_indexes());
+
+	/* Amounts stored in dollars before version 5 become cents. The
+	 * date, 2100-01-01, does not fit in 32 bits. */
+	query.handle = db.handle;
+	query.query = "INSERT INTO expenses (amount, date, payment_type, expense_type, description) "
+		"VALUES (12.34, 4102444800, 0, 0, 'Legacy expense');";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	query.query = "PRAGMA user_version = 4;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_budget_db(&db));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_db(&db));
+	assert_current_schema();
+
+	range.start = 4102444800;
+	range.end = 4102444800;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &expenses));
+	TEST_ASSERT_EQUAL_UINT(1, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(1234, expenses.expenses[0].amount);
+	TEST_ASSERT_EQUAL_INT64(4102444800, expenses.expenses[0].date);
+	free_expenses(&expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_monthly_totals(&db, 210001, 210001, &totals));
+	TEST_ASSERT_EQUAL_UINT(1, totals.num_totals);
+	TEST_ASSERT_EQUAL_INT64(1234, totals.totals[0].total);
+	free_monthly_totals(&totals);
+}
+
 void test_insert_expenses() {
 
 	uint32_t i;
@@ -144,7 +265,56 @@ void test_insert_expenses() {
 
 	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
 
+	/* IDs must stay unique once rows have been removed */
+	db_query query = {0};
+	query.handle = db.handle;
+	query.query = "DELETE FROM expenses WHERE id=1;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+}
+
+void test_insert_expenses_bulk() {
+	uint32_t i;
+	expense_list expenses = {0};
+	bulk_insert_options options = {0};
+	bulk_insert_stats stats = {0};
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 1000;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 50;
+		expenses.expenses[i].date = expense_date - i;
+		expenses.expenses[i].description = "Bulk expense";
+		expenses.expenses[i].expense_type = i % 5;
+		expenses.expenses[i].payment_type = i % 2;
+	}
+
+	options.batch_size = 300;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		insert_expenses_bulk(&db, &expenses, &options, &stats));
+	TEST_ASSERT_EQUAL_UINT(num_expenses, stats.rows_inserted);
+	TEST_ASSERT_EQUAL_UINT(4, stats.batches_committed);
+
 	free(expenses.expenses);
+	expenses.expenses = NULL;
+	expenses.num_expenses = 0;
+
+	range.start = 0;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &expenses));
+	TEST_ASSERT_EQUAL_UINT(num_expenses, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_STRING("Bulk expense", expenses.expenses[num_expenses - 1].description);
+
+	free_expenses(&expenses);
 }
 
 void test_get_expenses() {
@@ -160,7 +330,7 @@ void test_get_expenses() {
 	TEST_ASSERT_NOT_NULL(expenses.expenses);
 
 	for (i = 0; i < num_expenses; ++i) {
-		expenses.expenses[i].amount = i * 1.00;
+		expenses.expenses[i].amount = i * 100;
 		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
 		expenses.expenses[i].description = "Test expense";
 		expenses.expenses[i].expense_type = i % 3;
@@ -182,16 +352,14 @@ void test_get_expenses() {
 	print_expenses(&expenses);
 
 	for (i = 0; i < expenses.num_expenses; ++i) {
-		TEST_ASSERT_EQUAL_DOUBLE(i * 1.00, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_INT64(i * 100, expenses.expenses[i].amount);
 		TEST_ASSERT_EQUAL_INT(expense_date - i * SECONDS_IN_A_DAY, expenses.expenses[i].date);
 		TEST_ASSERT_EQUAL_UINT(i % 3, expenses.expenses[i].expense_type);
 		TEST_ASSERT_EQUAL_UINT(i % 4, expenses.expenses[i].payment_type);
 		TEST_ASSERT_EQUAL_STRING("Test expense", expenses.expenses[i].description);
 	}
 
-	free(expenses.expenses);
-	expenses.expenses = NULL;
-	expenses.num_expenses = 0;
+	free_expenses(&expenses);
 
 	range.start = expense_date - (5 * SECONDS_IN_A_DAY) + 1;
 	range.end = time(NULL);
@@ -202,16 +370,14 @@ void test_get_expenses() {
 	print_expenses(&expenses);
 
 	for (i = 0; i < expenses.num_expenses; ++i) {
-		TEST_ASSERT_EQUAL_DOUBLE(i * 1.00, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_INT64(i * 100, expenses.expenses[i].amount);
 		TEST_ASSERT_EQUAL_INT(expense_date - (i * SECONDS_IN_A_DAY), expenses.expenses[i].date);
 		TEST_ASSERT_EQUAL_UINT(i % 3, expenses.expenses[i].expense_type);
 		TEST_ASSERT_EQUAL_UINT(i % 4, expenses.expenses[i].payment_type);
 		TEST_ASSERT_EQUAL_STRING("Test expense", expenses.expenses[i].description);
 	}
 
-	free(expenses.expenses);
-	expenses.expenses = NULL;
-	expenses.num_expenses = 0;
+	free_expenses(&expenses);
 
 	range.end = expense_date - (5 * SECONDS_IN_A_DAY);
 	range.start = 0;
@@ -223,16 +389,14 @@ void test_get_expenses() {
 	print_expenses(&expenses);
 
 	for (i = 0; i < expenses.num_expenses; ++i) {
-		TEST_ASSERT_EQUAL_DOUBLE((i + 5) * 1.00, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_INT64((i + 5) * 100, expenses.expenses[i].amount);
 		TEST_ASSERT_EQUAL_INT(expense_date - ((i + 5) * SECONDS_IN_A_DAY), expenses.expenses[i].date);
 		TEST_ASSERT_EQUAL_UINT((i + 5) % 3, expenses.expenses[i].expense_type);
 		TEST_ASSERT_EQUAL_UINT((i + 5) % 4, expenses.expenses[i].payment_type);
 		TEST_ASSERT_EQUAL_STRING("Test expense", expenses.expenses[i].description);
 	}
 
-	free(expenses.expenses);
-	expenses.expenses = NULL;
-	expenses.num_expenses = 0;
+	free_expenses(&expenses);
 
 	range.start = 0;
 	range.end = time(NULL);
@@ -244,14 +408,12 @@ void test_get_expenses() {
 	print_expenses(&expenses);
 
 	for (i = 0; i < expenses.num_expenses; ++i) {
-		TEST_ASSERT_EQUAL_DOUBLE(i * 4.00, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_INT64(i * 400, expenses.expenses[i].amount);
 		TEST_ASSERT_EQUAL_INT(expense_date - ((i * 4) * SECONDS_IN_A_DAY), expenses.expenses[i].date);
 		TEST_ASSERT_EQUAL_UINT(0, expenses.expenses[i].payment_type);
 	}
 
-	free(expenses.expenses);
-	expenses.expenses = NULL;
-	expenses.num_expenses = 0;
+	free_expenses(&expenses);
 
 	TEST_ASSERT_EQUAL_UINT(ERR_OK, get_expenses_in_range_with_expense_type(&db, &range, 0, &expenses));
 
@@ -261,14 +423,751 @@ void test_get_expenses() {
 	print_expenses(&expenses);
 
 	for (i = 0; i < expenses.num_expenses; ++i) {
-		TEST_ASSERT_EQUAL_DOUBLE(i * 3.00, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_INT64(i * 300, expenses.expenses[i].amount);
 		TEST_ASSERT_EQUAL_INT(expense_date - ((i * 3) * SECONDS_IN_A_DAY), expenses.expenses[i].date);
 		TEST_ASSERT_EQUAL_UINT(0, expenses.expenses[i].expense_type);
 	}
 
+	free_expenses(&expenses);
+}
+
+/* Newest first, with expenses on the same date in reverse insert order */
+static void assert_newest_first(const expense_list* expenses) {
+	size_t i;
+
+	for (i = 1; i < expenses->num_expenses; ++i) {
+		TEST_ASSERT_TRUE(expenses->expenses[i - 1].date >= expenses->expenses[i].date);
+		if (expenses->expenses[i - 1].date == expenses->expenses[i].date) {
+			TEST_ASSERT_TRUE(expenses->expenses[i - 1].amount > expenses->expenses[i].amount);
+		}
+	}
+}
+
+void test_get_expenses_order() {
+	uint32_t i;
+	expense_list expenses = {0};
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 12;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	/* Dates are out of order and each is used twice. Amounts follow the
+	 * insert order. */
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - (i * 5 % 6) * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Ordered expense";
+		expenses.expenses[i].expense_type = i % 2;
+		expenses.expenses[i].payment_type = i % 3;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
 	free(expenses.expenses);
 	expenses.expenses = NULL;
-	expenses.num_expenses = 0;
+
+	range.start = 0;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &expenses));
+	TEST_ASSERT_EQUAL_UINT(num_expenses, expenses.num_expenses);
+	assert_newest_first(&expenses);
+	free_expenses(&expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_in_range_with_payment_type(&db, &range, 1, &expenses));
+	TEST_ASSERT_EQUAL_UINT(4, expenses.num_expenses);
+	assert_newest_first(&expenses);
+	free_expenses(&expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_in_range_with_expense_type(&db, &range, 0, &expenses));
+	TEST_ASSERT_EQUAL_UINT(6, expenses.num_expenses);
+	assert_newest_first(&expenses);
+	free_expenses(&expenses);
+}
+
+void test_get_expense_summaries() {
+	uint32_t i;
+	expense_list expenses = {0};
+	expense_summary_list summaries = {0};
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 12;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Summary expense";
+		expenses.expenses[i].expense_type = i % 3;
+		expenses.expenses[i].payment_type = i % 2;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		get_expense_summary_by_expense_type(&db, NULL, &summaries));
+
+	range.start = 0;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_expense_type(&db, &range, &summaries));
+	TEST_ASSERT_EQUAL_UINT(3, summaries.num_summaries);
+
+	/* Type 1 holds amounts 1, 4, 7 and 10 */
+	TEST_ASSERT_EQUAL_UINT(1, summaries.summaries[1].type);
+	TEST_ASSERT_EQUAL_UINT(4, summaries.summaries[1].count);
+	TEST_ASSERT_EQUAL_INT64(2200, summaries.summaries[1].total);
+	TEST_ASSERT_EQUAL_INT64(100, summaries.summaries[1].min);
+	TEST_ASSERT_EQUAL_INT64(1000, summaries.summaries[1].max);
+
+	free_expense_summaries(&summaries);
+
+	/* Only the six most recent days */
+	range.start = expense_date - 5 * SECONDS_IN_A_DAY;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_payment_type(&db, &range, &summaries));
+	TEST_ASSERT_EQUAL_UINT(2, summaries.num_summaries);
+
+	TEST_ASSERT_EQUAL_UINT(0, summaries.summaries[0].type);
+	TEST_ASSERT_EQUAL_UINT(3, summaries.summaries[0].count);
+	TEST_ASSERT_EQUAL_INT64(600, summaries.summaries[0].total);
+	TEST_ASSERT_EQUAL_UINT(1, summaries.summaries[1].type);
+	TEST_ASSERT_EQUAL_INT64(900, summaries.summaries[1].total);
+	TEST_ASSERT_EQUAL_INT64(500, summaries.summaries[1].max);
+
+	free_expense_summaries(&summaries);
+}
+
+void test_monthly_totals() {
+	uint32_t i;
+	db_query query = {0};
+	expense_list expenses = {0};
+	monthly_total_list totals = {0};
+	bulk_insert_options options = { .batch_size = 4 };
+	/* 2020-01-30T12:00:00Z, so rows fall in January and February */
+	time_t expense_date = 1580385600;
+	size_t num_expenses = 10;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = 250;
+		expenses.expenses[i].date = expense_date + i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Monthly expense";
+		expenses.expenses[i].expense_type = i % 2;
+		expenses.expenses[i].payment_type = 0;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		insert_expenses_bulk(&db, &expenses, &options, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		get_monthly_totals(&db, 202001, 202002, NULL));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_monthly_totals(&db, 202001, 202002, &totals));
+	TEST_ASSERT_EQUAL_UINT(4, totals.num_totals);
+
+	/* Jan 30 and 31, inserted twice */
+	TEST_ASSERT_EQUAL_INT(202001, totals.totals[0].year_month);
+	TEST_ASSERT_EQUAL_UINT(0, totals.totals[0].expense_type);
+	TEST_ASSERT_EQUAL_UINT(2, totals.totals[0].count);
+	TEST_ASSERT_EQUAL_INT64(500, totals.totals[0].total);
+	TEST_ASSERT_EQUAL_INT(202001, totals.totals[1].year_month);
+	TEST_ASSERT_EQUAL_UINT(1, totals.totals[1].expense_type);
+	TEST_ASSERT_EQUAL_UINT(2, totals.totals[1].count);
+
+	/* Feb 1 to 8 */
+	TEST_ASSERT_EQUAL_INT(202002, totals.totals[2].year_month);
+	TEST_ASSERT_EQUAL_UINT(8, totals.totals[2].count);
+	TEST_ASSERT_EQUAL_INT64(2000, totals.totals[2].total);
+	TEST_ASSERT_EQUAL_INT(202002, totals.totals[3].year_month);
+	TEST_ASSERT_EQUAL_UINT(8, totals.totals[3].count);
+
+	free_monthly_totals(&totals);
+
+	/* Changes made outside insert_expenses need a rebuild */
+	query.handle = db.handle;
+	query.query = "DELETE FROM expenses WHERE date>=1580515200;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, rebuild_monthly_totals(&db));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_monthly_totals(&db, 0, 999912, &totals));
+	TEST_ASSERT_EQUAL_UINT(2, totals.num_totals);
+	TEST_ASSERT_EQUAL_INT(202001, totals.totals[1].year_month);
+	TEST_ASSERT_EQUAL_UINT(2, totals.totals[1].count);
+	TEST_ASSERT_EQUAL_INT64(500, totals.totals[1].total);
+
+	free_monthly_totals(&totals);
+
+	/* The first and last months SQLite's date functions handle */
+	expenses.num_expenses = 2;
+	expenses.expenses = (expense*)calloc(2, sizeof(expense));
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+	expenses.expenses[0].date = MIN_EXPENSE_DATE;
+	expenses.expenses[0].amount = 100;
+	expenses.expenses[0].description = "First month";
+	expenses.expenses[1].date = MAX_EXPENSE_DATE;
+	expenses.expenses[1].amount = 200;
+	expenses.expenses[1].description = "Last month";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	expenses.expenses[0].date = MIN_EXPENSE_DATE - 1;
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, insert_expenses(&db, &expenses));
+	expenses.expenses[0].date = MAX_EXPENSE_DATE + 1;
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, insert_expenses(&db, &expenses));
+	free(expenses.expenses);
+
+	/* Same keys from the rollup and from a rebuild */
+	for (i = 0; i < 2; ++i) {
+		TEST_ASSERT_EQUAL_INT(ERR_OK,
+			get_monthly_totals(&db, 0, 999912, &totals));
+		TEST_ASSERT_EQUAL_UINT(4, totals.num_totals);
+		TEST_ASSERT_EQUAL_INT(1, totals.totals[0].year_month);
+		TEST_ASSERT_EQUAL_INT64(100, totals.totals[0].total);
+		TEST_ASSERT_EQUAL_INT(999912, totals.totals[3].year_month);
+		TEST_ASSERT_EQUAL_INT64(200, totals.totals[3].total);
+		free_monthly_totals(&totals);
+
+		TEST_ASSERT_EQUAL_INT(ERR_OK, rebuild_monthly_totals(&db));
+	}
+}
+
+void test_get_expenses_matching() {
+	uint32_t i;
+	expense_list expenses = {0};
+	expense_filter filter = {0};
+	uint32_t payment_types[] = { 0, 2, 3 };
+	uint32_t expense_type = 1;
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 12;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Filtered expense";
+		expenses.expenses[i].expense_type = i % 2;
+		expenses.expenses[i].payment_type = i % 4;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+	expenses.expenses = NULL;
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, get_expenses_matching(&db, NULL, &expenses));
+
+	filter.date_flags = 0x80;
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, get_expenses_matching(&db, &filter, &expenses));
+
+	/* An empty filter matches everything */
+	filter.date_flags = 0;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_matching(&db, &filter, &expenses));
+	TEST_ASSERT_EQUAL_UINT(num_expenses, expenses.num_expenses);
+	free_expenses(&expenses);
+
+	/* Amounts in (2, 9] with payment types 0, 2 or 3 */
+	filter.amount_flags = GREATER_THAN_AMOUNT | LESS_THAN_AMOUNT;
+	filter.min_amount = 200;
+	filter.max_amount = 950;
+	filter.payment_types = payment_types;
+	filter.num_payment_types = 3;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_matching(&db, &filter, &expenses));
+	print_expenses(&expenses);
+	TEST_ASSERT_EQUAL_UINT(5, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(300, expenses.expenses[0].amount);
+	TEST_ASSERT_EQUAL_INT64(800, expenses.expenses[4].amount);
+	free_expenses(&expenses);
+
+	/* Before a date, inclusive, with an expense type */
+	memset(&filter, 0, sizeof(filter));
+	filter.date_flags = BEFORE_DATE | ON_DATE;
+	filter.range.end = expense_date - 8 * SECONDS_IN_A_DAY;
+	filter.expense_types = &expense_type;
+	filter.num_expense_types = 1;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_matching(&db, &filter, &expenses));
+	TEST_ASSERT_EQUAL_UINT(2, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(900, expenses.expenses[0].amount);
+	free_expenses(&expenses);
+
+	/* Exact date and amount */
+	memset(&filter, 0, sizeof(filter));
+	filter.date_flags = ON_DATE;
+	filter.range.start = expense_date - 4 * SECONDS_IN_A_DAY;
+	filter.amount_flags = EQUALS_AMOUNT;
+	filter.min_amount = 400;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_matching(&db, &filter, &expenses));
+	TEST_ASSERT_EQUAL_UINT(1, expenses.num_expenses);
+	free_expenses(&expenses);
+}
+
+void test_get_expenses_page() {
+	uint32_t i;
+	expense_list expenses = {0};
+	expense_filter filter = {0};
+	expense_page_key key = {0};
+	uint32_t payment_type = 1;
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 25;
+	size_t num_seen = 0;
+	size_t num_pages = 0;
+	int64_t last_amount = -1;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	/* Three expenses a day, inserted oldest first so ids follow dates */
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - (num_expenses - i) / 3 * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Paged expense";
+		expenses.expenses[i].expense_type = 0;
+		expenses.expenses[i].payment_type = i % 2;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+	expenses.expenses = NULL;
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		get_expenses_page(&db, &filter, 0, &key, &expenses));
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		get_expenses_page(&db, &filter, 10, NULL, &expenses));
+
+	filter.date_flags = ON_DATE | BEFORE_DATE;
+	filter.range.end = expense_date;
+
+	do {
+		TEST_ASSERT_EQUAL_INT(ERR_OK,
+			get_expenses_page(&db, &filter, 10, &key, &expenses));
+
+		/* Pages continue where the last one ended, oldest first */
+		for (i = 0; i < expenses.num_expenses; ++i) {
+			TEST_ASSERT_TRUE(expenses.expenses[i].amount > last_amount);
+			last_amount = expenses.expenses[i].amount;
+		}
+
+		num_seen += expenses.num_expenses;
+		++num_pages;
+		free_expenses(&expenses);
+	} while (num_seen % 10 == 0 && num_pages < 5);
+
+	TEST_ASSERT_EQUAL_UINT(num_expenses, num_seen);
+	TEST_ASSERT_EQUAL_UINT(3, num_pages);
+
+	/* Continuing from a key in the middle of a day with a type set */
+	key.date = expense_date - 4 * SECONDS_IN_A_DAY;
+	key.id = 0;
+	filter.payment_types = &payment_type;
+	filter.num_payment_types = 1;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_page(&db, &filter, 4, &key, &expenses));
+	TEST_ASSERT_EQUAL_UINT(4, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(1100, expenses.expenses[0].amount);
+	TEST_ASSERT_EQUAL_INT64(1700, expenses.expenses[3].amount);
+	TEST_ASSERT_EQUAL_INT(expenses.expenses[3].date, key.date);
+	free_expenses(&expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_page(&db, &filter, 4, &key, &expenses));
+	TEST_ASSERT_EQUAL_UINT(3, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(1900, expenses.expenses[0].amount);
+	free_expenses(&expenses);
+}
+
+void test_result_cache() {
+	uint32_t i;
+	result_cache cache;
+	db_connection writer = {0};
+	db_query query = {0};
+	expense_list expenses = {0};
+	expense_list cached = {0};
+	expense_summary_list summaries = {0};
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 6;
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_result_cache(&cache, 2, 0));
+	db.result_cache = &cache;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Cached expense";
+		expenses.expenses[i].expense_type = i % 2;
+		expenses.expenses[i].payment_type = 0;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	range.start = expense_date - 3 * SECONDS_IN_A_DAY;
+	range.end = expense_date;
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(0, cache.hits);
+	free_expenses(&cached);
+
+	/* The copy served from the cache is owned by the caller */
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(1, cache.hits);
+	TEST_ASSERT_EQUAL_UINT(4, cached.num_expenses);
+	TEST_ASSERT_EQUAL_INT64(300, cached.expenses[3].amount);
+	TEST_ASSERT_EQUAL_STRING("Cached expense", cached.expenses[3].description);
+	free_expenses(&cached);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_expense_type(&db, &range, &summaries));
+	free_expense_summaries(&summaries);
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_expense_type(&db, &range, &summaries));
+	TEST_ASSERT_EQUAL_UINT(2, cache.hits);
+	TEST_ASSERT_EQUAL_UINT(2, summaries.num_summaries);
+	TEST_ASSERT_EQUAL_INT64(400, summaries.summaries[1].total);
+	free_expense_summaries(&summaries);
+
+	/* Changes made outside budget_db are seen, through this connection */
+	query.handle = db.handle;
+	query.query = "DELETE FROM expenses WHERE amount=0;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(2, cache.hits);
+	TEST_ASSERT_EQUAL_UINT(3, cached.num_expenses);
+	free_expenses(&cached);
+
+	/* or through a connection without the cache */
+	writer.db_path = db.db_path;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_db(&writer));
+	query.handle = writer.handle;
+	query.query = "DELETE FROM expenses WHERE amount=100;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_db(&writer));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(2, cache.hits);
+	TEST_ASSERT_EQUAL_UINT(2, cached.num_expenses);
+	free_expenses(&cached);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(3, cache.hits);
+	free_expenses(&cached);
+
+	/* Inserting invalidates the results read before */
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+	TEST_ASSERT_EQUAL_UINT(6, cached.num_expenses);
+	free_expenses(&cached);
+
+	free(expenses.expenses);
+
+	/* Only the two most recently used results are kept */
+	for (i = 0; i < 3; ++i) {
+		range.start = expense_date - i * SECONDS_IN_A_DAY;
+		TEST_ASSERT_EQUAL_INT(ERR_OK, get_expenses_in_range(&db, &range, &cached));
+		free_expenses(&cached);
+	}
+	TEST_ASSERT_EQUAL_UINT(2, cache.num_entries);
+	TEST_ASSERT_TRUE(cache.evictions > 0);
+
+	db.result_cache = NULL;
+	close_result_cache(&cache);
+}
+
+/** @struct streamed_expenses
+  *
+  * @details
+  *		What count_streamed_expense has seen
+  */
+struct streamed_expenses {
+	size_t count;
+	size_t limit;
+	int64_t total;
+	time_t last_date;
+	bool ordered;
+} typedef streamed_expenses;
+
+static int32_t count_streamed_expense(const expense* expense, void* ctx) {
+	streamed_expenses* streamed = (streamed_expenses*)ctx;
+
+	TEST_ASSERT_EQUAL_STRING("Streamed expense", expense->description);
+
+	if (streamed->count && expense->date > streamed->last_date) {
+		streamed->ordered = false;
+	}
+
+	++streamed->count;
+	streamed->total += expense->amount;
+	streamed->last_date = expense->date;
+
+	return streamed->count == streamed->limit ? ERR_BUSY : ERR_OK;
+}
+
+void test_for_each_expense_in_range() {
+	uint32_t i;
+	expense_list expenses = {0};
+	streamed_expenses streamed = { .ordered = true };
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 8;
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Streamed expense";
+		expenses.expenses[i].expense_type = 0;
+		expenses.expenses[i].payment_type = 0;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	free(expenses.expenses);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		for_each_expense_in_range(&db, &range, NULL, &streamed));
+
+	/* Only the four most recent days */
+	range.start = expense_date - 3 * SECONDS_IN_A_DAY;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, for_each_expense_in_range(
+		&db, &range, count_streamed_expense, &streamed));
+	TEST_ASSERT_EQUAL_UINT(4, streamed.count);
+	TEST_ASSERT_EQUAL_INT64(600, streamed.total);
+	TEST_ASSERT_TRUE(streamed.ordered);
+
+	/* The callback's error stops the query */
+	memset(&streamed, 0, sizeof(streamed));
+	streamed.limit = 2;
+	range.start = 0;
+	TEST_ASSERT_EQUAL_INT(ERR_BUSY, for_each_expense_in_range(
+		&db, &range, count_streamed_expense, &streamed));
+	TEST_ASSERT_EQUAL_UINT(2, streamed.count);
+}
+
+static void assert_partitions(
+	const date_range* range,
+	const date_range* partitions,
+	size_t num_partitions,
+	const size_t* expected_rows) {
+
+	expense_list expenses = {0};
+	size_t i;
+
+	TEST_ASSERT_EQUAL_INT64(range->start, partitions[0].start);
+	TEST_ASSERT_EQUAL_INT64(range->end, partitions[num_partitions - 1].end);
+
+	for (i = 0; i < num_partitions; ++i) {
+		if (i) {
+			TEST_ASSERT_EQUAL_INT64(partitions[i - 1].end + 1, partitions[i].start);
+		}
+
+		TEST_ASSERT_EQUAL_INT(ERR_OK,
+			get_expenses_in_range(&db, (date_range*)&partitions[i], &expenses));
+		TEST_ASSERT_EQUAL_UINT(expected_rows[i], expenses.num_expenses);
+		free_expenses(&expenses);
+	}
+}
+
+void test_split_date_range() {
+	uint32_t i;
+	db_query query = {0};
+	expense_list expenses = {0};
+	date_range range = { INT64_MIN, INT64_MAX };
+	date_range partitions[8];
+	size_t num_partitions;
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 40;
+	size_t quarters[] = { 10, 10, 10, 10 };
+	size_t singles[] = { 1, 1, 1 };
+	size_t shared[] = { 10, 30 };
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		split_date_range(&db, &range, 0, partitions, &num_partitions));
+
+	/* Without expenses there is nothing to split */
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		split_date_range(&db, &range, 4, partitions, &num_partitions));
+	TEST_ASSERT_EQUAL_UINT(1, num_partitions);
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)calloc(num_expenses, sizeof(expense));
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	/* A minute apart, a sliver of the full range */
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i;
+		expenses.expenses[i].date = expense_date - i * 60;
+		expenses.expenses[i].description = "Split expense";
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		split_date_range(&db, &range, 4, partitions, &num_partitions));
+	TEST_ASSERT_EQUAL_UINT(4, num_partitions);
+	assert_partitions(&range, partitions, num_partitions, quarters);
+
+	/* Never more partitions than expenses */
+	range.start = expense_date - 2 * 60;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		split_date_range(&db, &range, 8, partitions, &num_partitions));
+	TEST_ASSERT_EQUAL_UINT(3, num_partitions);
+	assert_partitions(&range, partitions, num_partitions, singles);
+
+	/* Expenses sharing a date are not split */
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].date = expense_date - (i < 10 ? 60 : 0);
+	}
+
+	query.handle = db.handle;
+	query.query = "DELETE FROM expenses;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(&db, &expenses));
+	free(expenses.expenses);
+
+	range.start = INT64_MIN;
+	range.end = INT64_MAX;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		split_date_range(&db, &range, 4, partitions, &num_partitions));
+	TEST_ASSERT_EQUAL_UINT(2, num_partitions);
+	assert_partitions(&range, partitions, num_partitions, shared);
+}
+
+void test_parallel_reports() {
+	uint32_t i;
+	db_pool pool;
+	db_connection* writer;
+	expense_list expenses = {0};
+	expense_list serial = {0};
+	expense_summary_list summaries = {0};
+	expense_summary_list serial_summaries = {0};
+	date_range range = {0};
+	time_t expense_date = time(NULL);
+	size_t num_expenses = 30;
+
+	/* The pool needs WAL mode so the suite's connection is not used */
+	close_budget_db(&db);
+	db.handle = NULL;
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_budget_pool(&pool, db.db_path, 3, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkout_writer(&pool, &writer));
+
+	expenses.num_expenses = num_expenses;
+	expenses.expenses = (expense*)malloc(
+		sizeof(expense) * num_expenses);
+	TEST_ASSERT_NOT_NULL(expenses.expenses);
+
+	for (i = 0; i < num_expenses; ++i) {
+		expenses.expenses[i].amount = i * 100;
+		expenses.expenses[i].date = expense_date - i * SECONDS_IN_A_DAY;
+		expenses.expenses[i].description = "Parallel expense";
+		expenses.expenses[i].expense_type = i % 3;
+		expenses.expenses[i].payment_type = i % 2;
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, insert_expenses(writer, &expenses));
+
+	free(expenses.expenses);
+	expenses.expenses = NULL;
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID,
+		get_expenses_in_range_parallel(&pool, NULL, 0, &expenses));
+
+	/* More partitions than readers wait for a reader to be checked in */
+	range.start = expense_date - 20 * SECONDS_IN_A_DAY;
+	range.end = expense_date;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_in_range_parallel(&pool, &range, 7, &expenses));
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expenses_in_range(writer, &range, &serial));
+
+	TEST_ASSERT_EQUAL_UINT(21, expenses.num_expenses);
+	TEST_ASSERT_EQUAL_UINT(serial.num_expenses, expenses.num_expenses);
+	for (i = 0; i < serial.num_expenses; ++i) {
+		TEST_ASSERT_EQUAL_INT(serial.expenses[i].date, expenses.expenses[i].date);
+		TEST_ASSERT_EQUAL_INT64(serial.expenses[i].amount, expenses.expenses[i].amount);
+		TEST_ASSERT_EQUAL_STRING(serial.expenses[i].description,
+			expenses.expenses[i].description);
+	}
+
+	free_expenses(&expenses);
+	free_expenses(&serial);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_expense_type_parallel(&pool, &range, 0, &summaries));
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_expense_type(writer, &range, &serial_summaries));
+
+	TEST_ASSERT_EQUAL_UINT(3, summaries.num_summaries);
+	TEST_ASSERT_EQUAL_UINT(serial_summaries.num_summaries, summaries.num_summaries);
+	for (i = 0; i < serial_summaries.num_summaries; ++i) {
+		TEST_ASSERT_EQUAL_UINT(serial_summaries.summaries[i].type, summaries.summaries[i].type);
+		TEST_ASSERT_EQUAL_UINT(serial_summaries.summaries[i].count, summaries.summaries[i].count);
+		TEST_ASSERT_EQUAL_INT64(serial_summaries.summaries[i].total, summaries.summaries[i].total);
+		TEST_ASSERT_EQUAL_INT64(serial_summaries.summaries[i].min, summaries.summaries[i].min);
+		TEST_ASSERT_EQUAL_INT64(serial_summaries.summaries[i].max, summaries.summaries[i].max);
+	}
+
+	free_expense_summaries(&summaries);
+	free_expense_summaries(&serial_summaries);
+
+	/* Open-ended ranges span more seconds than fit in a time_t */
+	range.start = INT64_MIN;
+	range.end = INT64_MAX;
+	for (i = 1; i <= 7; i += 3) {
+		TEST_ASSERT_EQUAL_INT(ERR_OK,
+			get_expenses_in_range_parallel(&pool, &range, i, &expenses));
+		TEST_ASSERT_EQUAL_UINT(num_expenses, expenses.num_expenses);
+		free_expenses(&expenses);
+	}
+
+	/* Fits in a time_t, but the partition offsets would not */
+	range.start = 0;
+	range.end = INT64_MAX - 1;
+	TEST_ASSERT_EQUAL_INT(ERR_OK,
+		get_expense_summary_by_payment_type_parallel(&pool, &range, 5, &summaries));
+	TEST_ASSERT_EQUAL_UINT(2, summaries.num_summaries);
+	TEST_ASSERT_EQUAL_UINT(num_expenses, summaries.summaries[0].count + summaries.summaries[1].count);
+	free_expense_summaries(&summaries);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkin(&pool, writer));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_budget_pool(&pool));
 }
 
 int main() {
@@ -277,8 +1176,19 @@ int main() {
 	suiteSetUp();
 
 	RUN_TEST(test_open_close_budget_db_with_invalid_arguments);
+	RUN_TEST(test_schema_migration);
 	RUN_TEST(test_insert_expenses);
+	RUN_TEST(test_insert_expenses_bulk);
 	RUN_TEST(test_get_expenses);
+	RUN_TEST(test_get_expenses_order);
+	RUN_TEST(test_get_expenses_matching);
+	RUN_TEST(test_get_expenses_page);
+	RUN_TEST(test_result_cache);
+	RUN_TEST(test_get_expense_summaries);
+	RUN_TEST(test_monthly_totals);
+	RUN_TEST(test_for_each_expense_in_range);
+	RUN_TEST(test_split_date_range);
+	RUN_TEST(test_parallel_reports);
 
 	return suiteTearDown(UNITY_END());
 }
@@ -0,0 +1,274 @@
+/**
+ * Copyright (C) 2020 Dallas Leclerc
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <unity.h>
+
+#include <error.h>
+#include <log.h>
+
+#define TEST_NAME "budget_app_log_test"
+#define LOG_FILE "log_test.log"
+#define HOME_ENV "HOME"
+#define LINE_SIZE 512
+
+/* Far more than the ring holds so producers overrun the consumer */
+#define NUM_PRODUCERS 4
+#define MESSAGES_PER_PRODUCER 20000
+
+#define PRODUCER_FORMAT "producer [%d] message [%d]"
+#define DROPPED_FORMAT "Dropped [%" SCNu64 "] log messages"
+#define LEVEL_FORMAT "level [%s] argument [%d]"
+
+char* log_path;
+int32_t evaluations;
+
+/** @struct log_contents
+  *
+  * @details
+  *		What a test found in the log file
+  */
+struct log_contents {
+	uint64_t delivered[NUM_PRODUCERS];
+	uint64_t reported_dropped;
+	uint64_t other_lines;
+	bool in_order;
+} typedef log_contents;
+
+static void remove_log_file() {
+	struct stat st;
+
+	if (0 == stat(log_path, &st)) {
+		remove(log_path);
+	}
+}
+
+static void* produce_messages(void* arg) {
+	int32_t producer = (int32_t)(intptr_t)arg;
+	int32_t i;
+
+	/* Bypass the level macros so --with-log-level cannot compile
+	 * these out */
+	for (i = 0; i < MESSAGES_PER_PRODUCER; ++i) {
+		write_log(LOG_INFO, PRODUCER_FORMAT, __FILE__, __LINE__, producer, i);
+	}
+
+	return NULL;
+}
+
+/* Counts how often a log call evaluated its arguments */
+static int32_t evaluate_argument() {
+	return ++evaluations;
+}
+
+/* Built as if configured with --with-log-level=notice */
+#pragma push_macro("LOG_COMPILE_LEVEL")
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_NOTICE
+
+static void log_compiled_at_notice() {
+	WARN_LOG(LEVEL_FORMAT, "warning", evaluate_argument());
+	NOTICE_LOG(LEVEL_FORMAT, "notice", evaluate_argument());
+	INFO_LOG(LEVEL_FORMAT, "info", evaluate_argument());
+	DEBUG_LOG(LEVEL_FORMAT, "debug", evaluate_argument());
+}
+
+#pragma pop_macro("LOG_COMPILE_LEVEL")
+
+/* Built with the default level so only the runtime level filters */
+#pragma push_macro("LOG_COMPILE_LEVEL")
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+
+static void log_every_level() {
+	ERR_LOG(LEVEL_FORMAT, "err", evaluate_argument());
+	WARN_LOG(LEVEL_FORMAT, "warning", evaluate_argument());
+	NOTICE_LOG(LEVEL_FORMAT, "notice", evaluate_argument());
+	INFO_LOG(LEVEL_FORMAT, "info", evaluate_argument());
+	DEBUG_LOG(LEVEL_FORMAT, "debug", evaluate_argument());
+}
+
+#pragma pop_macro("LOG_COMPILE_LEVEL")
+
+static uint64_t count_log_lines(const char* text) {
+	char line[LINE_SIZE];
+	uint64_t count = 0;
+	FILE* file = fopen(log_path, "r");
+
+	TEST_ASSERT_NOT_NULL(file);
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strstr(line, text)) {
+			++count;
+		}
+	}
+
+	TEST_ASSERT_EQUAL_INT(0, fclose(file));
+
+	return count;
+}
+
+static void read_log_file(log_contents* contents) {
+	char line[LINE_SIZE];
+	int32_t last[NUM_PRODUCERS];
+	int32_t producer;
+	int32_t message;
+	uint64_t dropped;
+	const char* text;
+	FILE* file = fopen(log_path, "r");
+
+	TEST_ASSERT_NOT_NULL(file);
+
+	memset(contents, 0, sizeof(log_contents));
+	contents->in_order = true;
+	for (producer = 0; producer < NUM_PRODUCERS; ++producer) {
+		last[producer] = -1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if ((text = strstr(line, "producer [")) &&
+			2 == sscanf(text, PRODUCER_FORMAT, &producer, &message) &&
+			0 <= producer && NUM_PRODUCERS > producer) {
+			if (message <= last[producer]) {
+				contents->in_order = false;
+			}
+			last[producer] = message;
+			++contents->delivered[producer];
+		}
+		else if ((text = strstr(line, "Dropped [")) &&
+			1 == sscanf(text, DROPPED_FORMAT, &dropped)) {
+			contents->reported_dropped += dropped;
+		}
+		else {
+			++contents->other_lines;
+		}
+	}
+
+	TEST_ASSERT_EQUAL_INT(0, fclose(file));
+}
+
+void suiteSetUp() {
+	const char* home_dir = getenv(HOME_ENV);
+	size_t length;
+
+	TEST_ASSERT_NOT_NULL(home_dir);
+
+	length = strlen(home_dir) + strlen(LOG_FILE) + 2;
+	log_path = (char*)malloc(length);
+	TEST_ASSERT_NOT_NULL(log_path);
+	snprintf(log_path, length, "%s/%s", home_dir, LOG_FILE);
+}
+
+int32_t suiteTearDown(int32_t num_failures) {
+	remove_log_file();
+	free(log_path);
+
+	return num_failures;
+}
+
+void setUp() {
+	evaluations = 0;
+	remove_log_file();
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_log_async(TEST_NAME, log_path));
+}
+
+void tearDown() {
+	close_log();
+	set_log_level(LOG_DEBUG);
+}
+
+void test_async_ring_overflow() {
+	pthread_t producers[NUM_PRODUCERS];
+	log_contents contents;
+	uint64_t delivered = 0;
+	uint64_t dropped;
+	int32_t i;
+
+	TEST_ASSERT_EQUAL_INT(ERR_IN_USE, open_log_async(TEST_NAME, log_path));
+
+	for (i = 0; i < NUM_PRODUCERS; ++i) {
+		TEST_ASSERT_EQUAL_INT(0, pthread_create(
+			&producers[i], NULL, produce_messages, (void*)(intptr_t)i));
+	}
+	for (i = 0; i < NUM_PRODUCERS; ++i) {
+		TEST_ASSERT_EQUAL_INT(0, pthread_join(producers[i], NULL));
+	}
+
+	/* Producers are done so the count is final, and close_log must
+	 * deliver whatever is still in the ring */
+	dropped = get_log_dropped();
+	close_log();
+	TEST_ASSERT_EQUAL_UINT64(0, get_log_dropped());
+
+	read_log_file(&contents);
+	for (i = 0; i < NUM_PRODUCERS; ++i) {
+		delivered += contents.delivered[i];
+	}
+
+	TEST_ASSERT_EQUAL_UINT64(
+		(uint64_t)NUM_PRODUCERS * MESSAGES_PER_PRODUCER, delivered + dropped);
+	TEST_ASSERT_EQUAL_UINT64(dropped, contents.reported_dropped);
+	TEST_ASSERT_EQUAL_UINT64(0, contents.other_lines);
+	TEST_ASSERT_TRUE(contents.in_order);
+}
+
+void test_async_single_message() {
+	log_contents contents;
+
+	write_log(LOG_INFO, PRODUCER_FORMAT, __FILE__, __LINE__, 0, 0);
+	close_log();
+
+	read_log_file(&contents);
+	TEST_ASSERT_EQUAL_UINT64(1, contents.delivered[0]);
+	TEST_ASSERT_EQUAL_UINT64(0, contents.reported_dropped);
+	TEST_ASSERT_EQUAL_UINT64(0, contents.other_lines);
+}
+
+void test_runtime_log_level() {
+	set_log_level(LOG_WARNING);
+	log_every_level();
+
+	/* Skipped messages do not evaluate their arguments */
+	TEST_ASSERT_EQUAL_INT(2, evaluations);
+
+	close_log();
+
+	TEST_ASSERT_EQUAL_UINT64(1, count_log_lines("level [err]"));
+	TEST_ASSERT_EQUAL_UINT64(1, count_log_lines("level [warning]"));
+	TEST_ASSERT_EQUAL_UINT64(2, count_log_lines("level ["));
+}
+
+void test_compile_log_level() {
+	log_compiled_at_notice();
+
+	/* The runtime level lets everything through, so only the compile
+	 * time level stops info and debug */
+	TEST_ASSERT_EQUAL_INT(2, evaluations);
+
+	close_log();
+
+	TEST_ASSERT_EQUAL_UINT64(1, count_log_lines("level [warning]"));
+	TEST_ASSERT_EQUAL_UINT64(1, count_log_lines("level [notice]"));
+	TEST_ASSERT_EQUAL_UINT64(2, count_log_lines("level ["));
+}
+
+int main() {
+	UNITY_BEGIN();
+
+	suiteSetUp();
+
+	RUN_TEST(test_async_ring_overflow);
+	RUN_TEST(test_async_single_message);
+	RUN_TEST(test_runtime_log_level);
+	RUN_TEST(test_compile_log_level);
+
+	return suiteTearDown(UNITY_END());
+}
@@ -6,11 +6,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <unity.h>
 
 #include "sql_test_queries.h"
 #include <sql/sql_db.h>
+#include <sql/sql_pool.h>
 #include <error.h>
 #include <log.h>
 
@@ -223,6 +225,312 @@ void test_execute_with_results() {
 	free(query.params);
 }
 
+void test_statement_cache() {
+	db_query query = {0};
+	db_query_result result = {0};
+	query_param param = {0};
+
+	create_test_table();
+
+	int32_t int_vals[3] = { 1, 2, 3 };
+	double double_vals[3] = { 1.5, 2.5, 3.5 };
+	const char* text_vals[3] = { "Row 1", "Row 2", "Row 3" };
+
+	insert_rows(int_vals, double_vals, text_vals, 3);
+
+	query.connection = &db;
+	query.query = SELECT_INT_FROM_ROW_WITH_ID;
+	query.num_params = 1;
+	query.params = &param;
+	param.name = ID_PARAM;
+	param.param.type = INT;
+
+	for (int32_t i = 0; i < 3; ++i) {
+		param.param.value.int_val = i + 1;
+
+		TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+		TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+		TEST_ASSERT_EQUAL_INT(int_vals[i], result.values[0][0].value.int_val);
+
+		free_results(&result);
+		memset(&result, 0, sizeof(result));
+	}
+
+	TEST_ASSERT_EQUAL_UINT(1, db.stmt_cache.num_entries);
+	TEST_ASSERT_EQUAL_UINT(2, db.stmt_cache.hits);
+	TEST_ASSERT_EQUAL_UINT(1, db.stmt_cache.misses);
+
+	clear_stmt_cache(&db);
+	TEST_ASSERT_EQUAL_UINT(0, db.stmt_cache.num_entries);
+}
+
+void test_execute_with_many_results() {
+	db_query query = {db.handle, SELECT_ALL_TEXT, 0, NULL};
+	db_query_result result = {0};
+	int32_t int_vals[40];
+	double double_vals[40];
+	const char* text_vals[40];
+
+	create_test_table();
+
+	for (uint32_t i = 0; i < 40; ++i) {
+		int_vals[i] = i;
+		double_vals[i] = i * 0.5;
+		text_vals[i] = (i % 2) ? "odd;row" : "even;row";
+	}
+
+	insert_rows(int_vals, double_vals, text_vals, 40);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(40, result.num_rows);
+	TEST_ASSERT_EQUAL_UINT(1, result.num_cols);
+	for (uint32_t i = 0; i < result.num_rows; ++i) {
+		TEST_ASSERT_EQUAL_STRING(text_vals[i], result.values[i][0].value.string_val);
+	}
+	free_results(&result);
+
+	query.query = SELECT_ROW_WITH_SEMICOLON_TEXT;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(20, result.num_rows);
+	TEST_ASSERT_EQUAL_UINT(4, result.num_cols);
+	free_results(&result);
+}
+
+void test_execute_columnar_query() {
+	db_query query = {db.handle, SELECT_ALL_ROWS, 0, NULL};
+	db_column_result result = {0};
+	int32_t int_vals[100];
+	double double_vals[100];
+	const char* text_vals[100];
+
+	create_test_table();
+
+	for (uint32_t i = 0; i < 100; ++i) {
+		int_vals[i] = i * 2;
+		double_vals[i] = i * 0.25;
+		text_vals[i] = (i % 3) ? "Not a multiple of three" : "Multiple of three";
+	}
+
+	insert_rows(int_vals, double_vals, text_vals, 100);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, execute_columnar_query(&query, NULL));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_columnar_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(100, result.num_rows);
+	TEST_ASSERT_EQUAL_UINT(4, result.num_cols);
+	TEST_ASSERT_TRUE(result.columns[0].type == INT);
+	TEST_ASSERT_TRUE(result.columns[1].type == INT);
+	TEST_ASSERT_TRUE(result.columns[2].type == DOUBLE);
+	TEST_ASSERT_TRUE(result.columns[3].type == TEXT);
+
+	for (uint32_t i = 0; i < result.num_rows; ++i) {
+		TEST_ASSERT_EQUAL_INT(i + 1, result.columns[0].values.int_vals[i]);
+		TEST_ASSERT_EQUAL_INT(int_vals[i], result.columns[1].values.int_vals[i]);
+		TEST_ASSERT_EQUAL_DOUBLE(double_vals[i], result.columns[2].values.double_vals[i]);
+		TEST_ASSERT_EQUAL_STRING(text_vals[i], result.columns[3].values.string_vals[i]);
+	}
+
+	free_column_result(&result);
+	TEST_ASSERT_NULL(result.columns);
+	TEST_ASSERT_NULL(result.text.head);
+}
+
+static int32_t sum_int_vals(db_cursor* row, void* ctx) {
+	int32_t* sum = (int32_t*)ctx;
+
+	TEST_ASSERT_EQUAL_UINT(4, row->num_cols);
+	*sum += cursor_column_int(row, 1);
+
+	return *sum >= 6 ? ERR_NOT_PERMITTED : ERR_OK;
+}
+
+void test_cursor() {
+	db_query query = {db.handle, SELECT_ALL_ROWS, 0, NULL};
+	db_cursor cursor;
+	bool has_row;
+	uint32_t row = 0;
+	size_t len;
+	int32_t sum = 0;
+
+	create_test_table();
+
+	int32_t int_vals[4] = { 1, 2, 3, 4 };
+	double double_vals[4] = { 0.5, 1.5, 2.5, 3.5 };
+	const char* text_vals[4] = { "Row 1", "Row 2", "Row 3", "Row 4" };
+
+	insert_rows(int_vals, double_vals, text_vals, 4);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, open_cursor(NULL, &cursor));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_cursor(&query, &cursor));
+
+	while (ERR_OK == cursor_next(&cursor, &has_row) && has_row) {
+		TEST_ASSERT_TRUE(cursor_column_type(&cursor, 2) == DOUBLE);
+		TEST_ASSERT_EQUAL_INT(int_vals[row], cursor_column_int(&cursor, 1));
+		TEST_ASSERT_EQUAL_DOUBLE(double_vals[row], cursor_column_double(&cursor, 2));
+		TEST_ASSERT_EQUAL_STRING(text_vals[row], cursor_column_text(&cursor, 3, &len));
+		TEST_ASSERT_EQUAL_UINT(strlen(text_vals[row]), len);
+		++row;
+	}
+	TEST_ASSERT_EQUAL_UINT(4, row);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, cursor_next(&cursor, &has_row));
+	TEST_ASSERT_FALSE(has_row);
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_cursor(&cursor));
+
+	TEST_ASSERT_EQUAL_INT(ERR_NOT_PERMITTED,
+		execute_query_with_callback(&query, sum_int_vals, &sum));
+	TEST_ASSERT_EQUAL_INT(6, sum);
+}
+
+void test_positional_params() {
+	db_query query = {0};
+	db_query_result result = {0};
+	query_param params[4] = {0};
+	db_stmt_cache_entry* entry = NULL;
+	char name[16];
+
+	create_test_table();
+
+	/* Positions are used directly, so no names are needed */
+	params[0].index = 1;
+	params[0].param.type = INT;
+	params[0].param.value.int_val = 7;
+	params[1].index = 2;
+	params[1].param.type = INT;
+	params[1].param.value.int_val = 42;
+	params[2].index = 3;
+	params[2].param.type = DOUBLE;
+	params[2].param.value.double_val = 4.5;
+	params[3].index = 4;
+	params[3].param.type = STATIC_TEXT;
+	params[3].param.value.string_val = "Positional";
+
+	query.connection = &db;
+	query.query = INSERT_ROW;
+	query.num_params = 4;
+	query.params = params;
+	query.positional_params = true;
+
+	/* Positions past the query's parameters are rejected */
+	params[3].index = 5;
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, execute_query(&query, NULL));
+	params[3].index = 4;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	/* An index of 0 resolves by name, which may change in place */
+	strcpy(name, ID_PARAM);
+	params[0].name = name;
+	params[0].index = 0;
+	query.query = SELECT_INT_FROM_ROW_WITH_ID;
+	query.num_params = 1;
+	for (uint32_t i = 0; i < 2; ++i) {
+		TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+		TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+		TEST_ASSERT_EQUAL_INT(42, result.values[0][0].value.int_val);
+		free_results(&result);
+	}
+
+	strcpy(name, INT_VAL_PARAM);
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(0, result.num_rows);
+	free_results(&result);
+
+	for (uint32_t i = 0; i < db.stmt_cache.capacity; ++i) {
+		if (db.stmt_cache.entries[i] &&
+			0 == strcmp(SELECT_INT_FROM_ROW_WITH_ID, db.stmt_cache.entries[i]->query)) {
+			entry = db.stmt_cache.entries[i];
+		}
+	}
+
+	TEST_ASSERT_NOT_NULL(entry);
+	TEST_ASSERT_EQUAL_UINT(1, entry->num_param_indexes);
+	TEST_ASSERT_EQUAL_STRING(INT_VAL_PARAM, entry->param_names[0]);
+	TEST_ASSERT_EQUAL_INT(0, entry->param_indexes[0]);
+}
+
+void test_int64_values() {
+	db_query query = {0};
+	db_query_result result = {0};
+	db_column_result columns = {0};
+	db_cursor cursor;
+	query_param params[4] = {0};
+	bool has_row;
+	uint32_t row = 0;
+	const int64_t big_val = 5000000000LL;
+
+	create_test_table();
+
+	int32_t int_vals[3] = { -1, 0, INT32_MAX };
+	double double_vals[3] = { 0.5, 1.5, 2.5 };
+	const char* text_vals[3] = { "Row 1", "Row 2", "Row 3" };
+
+	insert_rows(int_vals, double_vals, text_vals, 3);
+
+	params[0].index = 1;
+	params[0].param.type = INT64;
+	params[0].param.value.int64_val = 4;
+	params[1].index = 2;
+	params[1].param.type = INT64;
+	params[1].param.value.int64_val = big_val;
+	params[2].index = 3;
+	params[2].param.type = DOUBLE;
+	params[2].param.value.double_val = 3.5;
+	params[3].index = 4;
+	params[3].param.type = STATIC_TEXT;
+	params[3].param.value.string_val = "Row 4";
+
+	query.connection = &db;
+	query.query = INSERT_ROW;
+	query.num_params = 4;
+	query.params = params;
+	query.positional_params = true;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	/* Only values that do not fit in an INT are reported as INT64 */
+	params[0].name = ID_PARAM;
+	params[0].index = 0;
+	query.query = SELECT_INT_FROM_ROW_WITH_ID;
+	query.num_params = 1;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+	TEST_ASSERT_TRUE(result.values[0][0].type == INT64);
+	TEST_ASSERT_EQUAL_INT64(big_val, result.values[0][0].value.int64_val);
+	free_results(&result);
+
+	params[0].param.value.int64_val = 3;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_TRUE(result.values[0][0].type == INT);
+	TEST_ASSERT_EQUAL_INT(INT32_MAX, result.values[0][0].value.int_val);
+	free_results(&result);
+
+	/* The column starts as INT and is widened by the last row */
+	query.query = SELECT_ALL_ROWS;
+	query.num_params = 0;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_columnar_query(&query, &columns));
+	TEST_ASSERT_EQUAL_UINT(4, columns.num_rows);
+	TEST_ASSERT_TRUE(columns.columns[0].type == INT);
+	TEST_ASSERT_TRUE(columns.columns[1].type == INT64);
+	for (row = 0; row < 3; ++row) {
+		TEST_ASSERT_EQUAL_INT64(int_vals[row], columns.columns[1].values.int64_vals[row]);
+	}
+	TEST_ASSERT_EQUAL_INT64(big_val, columns.columns[1].values.int64_vals[3]);
+	free_column_result(&columns);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_cursor(&query, &cursor));
+	for (row = 0; ERR_OK == cursor_next(&cursor, &has_row) && has_row; ++row) {
+		if (row < 3) {
+			TEST_ASSERT_TRUE(cursor_column_type(&cursor, 1) == INT);
+			TEST_ASSERT_EQUAL_INT64(int_vals[row], cursor_column_int64(&cursor, 1));
+		}
+		else {
+			TEST_ASSERT_TRUE(cursor_column_type(&cursor, 1) == INT64);
+			TEST_ASSERT_EQUAL_INT64(big_val, cursor_column_int64(&cursor, 1));
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT(4, row);
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_cursor(&cursor));
+}
+
 void test_table_queries() {
 	db_query query = {db.handle, CREATE_TEST_TABLE, 0, NULL};
 
@@ -252,6 +560,264 @@ void test_queries_with_invalid_params() {
 	free(query.params);
 }
 
+void test_query_stats() {
+	db_query query = {0};
+	db_query_result result = {0};
+	db_query_stats stats = {0};
+	db_cursor cursor;
+	query_param param = {0};
+	int32_t int_vals[3] = {1, 2, 3};
+	double double_vals[3] = {1.0, 2.0, 3.0};
+	const char* text_vals[3] = {"one", "two", "three"};
+	char* json = NULL;
+	size_t json_len = 0;
+	FILE* json_file;
+	bool has_row;
+	size_t i;
+	uint64_t histogram_calls = 0;
+
+	create_test_table();
+	insert_rows(int_vals, double_vals, text_vals, 3);
+
+	db.collect_stats = true;
+
+	query.connection = &db;
+	query.query = SELECT_ALL_ROWS;
+	TEST_ASSERT_EQUAL_INT(ERR_NOT_FOUND, get_query_stats(&db, SELECT_ALL_ROWS, &stats));
+
+	for (i = 0; i < 2; ++i) {
+		TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+		free_results(&result);
+	}
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_query_stats(&db, SELECT_ALL_ROWS, &stats));
+	TEST_ASSERT_EQUAL_UINT(2, stats.calls);
+	TEST_ASSERT_EQUAL_UINT(0, stats.errors);
+	TEST_ASSERT_EQUAL_UINT(6, stats.rows);
+	/* "one", "two" and "three" with terminators, twice */
+	TEST_ASSERT_EQUAL_UINT(28, stats.text_bytes);
+	TEST_ASSERT_TRUE(stats.prepare_ns > 0);
+	TEST_ASSERT_TRUE(stats.step_ns > 0);
+
+	for (i = 0; i < DB_LATENCY_BUCKETS; ++i) {
+		histogram_calls += stats.latency_histogram[i];
+	}
+	TEST_ASSERT_EQUAL_UINT(2, histogram_calls);
+
+	/* Every reset of a cursor is an execution */
+	param.name = ID_PARAM;
+	param.param.type = INT;
+	query.query = SELECT_ROW_WITH_ID;
+	query.num_params = 1;
+	query.params = &param;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_cursor(&query, &cursor));
+	for (i = 1; i <= 3; ++i) {
+		param.param.value.int_val = i;
+		TEST_ASSERT_EQUAL_INT(ERR_OK, reset_cursor(&cursor));
+		TEST_ASSERT_EQUAL_INT(ERR_OK, cursor_next(&cursor, &has_row));
+		TEST_ASSERT_TRUE(has_row);
+	}
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_cursor(&cursor));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_query_stats(&db, SELECT_ROW_WITH_ID, &stats));
+	TEST_ASSERT_EQUAL_UINT(3, stats.calls);
+	TEST_ASSERT_EQUAL_UINT(3, stats.rows);
+
+	json_file = open_memstream(&json, &json_len);
+	TEST_ASSERT_NOT_NULL(json_file);
+	TEST_ASSERT_EQUAL_INT(ERR_OK, dump_query_stats(&db, json_file));
+	fclose(json_file);
+	TEST_ASSERT_EQUAL_INT('[', json[0]);
+	TEST_ASSERT_NOT_NULL(strstr(json, "\"query\": \"SELECT * FROM test ORDER BY id;\""));
+	TEST_ASSERT_NOT_NULL(strstr(json, "\"calls\": 3"));
+	free(json);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, dump_query_stats(&db, NULL));
+
+	reset_query_stats(&db);
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_query_stats(&db, SELECT_ALL_ROWS, &stats));
+	TEST_ASSERT_EQUAL_UINT(0, stats.calls);
+	TEST_ASSERT_TRUE(stats.prepare_ns > 0);
+
+	db.collect_stats = false;
+}
+
+static int32_t query_pragma_int(db_connection* connection, const char* pragma) {
+	db_query query = {0};
+	db_query_result result = {0};
+	int32_t value;
+
+	query.handle = connection->handle;
+	query.query = pragma;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_UINT(1, result.num_rows);
+	TEST_ASSERT_EQUAL_INT(INT, result.values[0][0].type);
+
+	value = result.values[0][0].value.int_val;
+	free_results(&result);
+
+	return value;
+}
+
+void test_db_options() {
+	db_connection tuned = {0};
+	db_options invalid = {0};
+	db_query query = {0};
+	db_query_result result = {0};
+
+	tuned.db_path = db.db_path;
+	tuned.options = &DB_OPTIONS_HIGH_THROUGHPUT;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_db(&tuned));
+
+	query.handle = tuned.handle;
+	query.query = "PRAGMA journal_mode;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	TEST_ASSERT_EQUAL_STRING("wal", result.values[0][0].value.string_val);
+	free_results(&result);
+
+	/* NORMAL is 1 and MEMORY is 2 */
+	TEST_ASSERT_EQUAL_INT(1, query_pragma_int(&tuned, "PRAGMA synchronous;"));
+	TEST_ASSERT_EQUAL_INT(-65536, query_pragma_int(&tuned, "PRAGMA cache_size;"));
+	TEST_ASSERT_EQUAL_INT(2, query_pragma_int(&tuned, "PRAGMA temp_store;"));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_db(&tuned));
+
+	invalid.synchronous = SYNCHRONOUS_EXTRA + 1;
+	tuned.options = &invalid;
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, open_db(&tuned));
+	TEST_ASSERT_NULL(tuned.handle);
+}
+
+void test_busy_handler() {
+	db_connection blocked = {0};
+	db_options options = { .busy_timeout_ms = 20 };
+	db_busy_stats stats = {0};
+	db_query query = {0};
+	db_query_result result = {0};
+
+	create_test_table();
+
+	blocked.db_path = db.db_path;
+	blocked.options = &options;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_db(&blocked));
+
+	query.handle = db.handle;
+	query.query = "BEGIN EXCLUSIVE TRANSACTION;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	/* Backs off until the deadline instead of failing straight away */
+	query.handle = blocked.handle;
+	query.query = SELECT_ALL_ROWS;
+	TEST_ASSERT_EQUAL_INT(ERR_BUSY, execute_query(&query, &result));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, get_busy_stats(&blocked, &stats));
+	TEST_ASSERT_EQUAL_UINT(1, stats.busy_events);
+	TEST_ASSERT_EQUAL_UINT(1, stats.timeouts);
+	TEST_ASSERT_TRUE(stats.retries > 1);
+	TEST_ASSERT_TRUE(stats.wait_ns >= 15000000);
+	TEST_ASSERT_TRUE(stats.wait_ns < 1000000000);
+
+	query.handle = db.handle;
+	query.query = "END TRANSACTION;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	query.handle = blocked.handle;
+	query.query = SELECT_ALL_ROWS;
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, &result));
+	free_results(&result);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_db(&blocked));
+}
+
+static void* count_rows_on_reader(void* arg) {
+	db_pool* pool = (db_pool*)arg;
+	db_connection* reader = NULL;
+	db_query query = {0};
+	db_query_result result = {0};
+	intptr_t num_rows;
+
+	if (ERR_OK != checkout_reader(pool, &reader)) {
+		return (void*)-1;
+	}
+
+	query.connection = reader;
+	query.query = SELECT_ALL_ROWS;
+	if (ERR_OK != execute_query(&query, &result)) {
+		checkin(pool, reader);
+		return (void*)-1;
+	}
+
+	num_rows = result.num_rows;
+	free_results(&result);
+	checkin(pool, reader);
+
+	return (void*)num_rows;
+}
+
+void test_pool() {
+	db_pool pool;
+	db_connection* writer = NULL;
+	db_connection* readers[2] = {NULL};
+	db_connection* reader = NULL;
+	db_query query = {0};
+	pthread_t threads[4];
+	void* num_rows;
+	int32_t int_vals[3] = {1, 2, 3};
+	double double_vals[3] = {1.0, 2.0, 3.0};
+	const char* text_vals[3] = {"one", "two", "three"};
+	size_t i;
+
+	create_test_table();
+	insert_rows(int_vals, double_vals, text_vals, 3);
+
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, open_pool(&pool, NULL, 2, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, open_pool(&pool, db.db_path, 2, NULL));
+	TEST_ASSERT_EQUAL_UINT(2, pool.num_readers);
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkout_reader(&pool, &readers[0]));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, try_checkout_reader(&pool, &readers[1]));
+	TEST_ASSERT_TRUE(readers[0] != readers[1]);
+	TEST_ASSERT_TRUE(readers[0]->read_only);
+	TEST_ASSERT_EQUAL_INT(ERR_IN_USE, try_checkout_reader(&pool, &reader));
+	TEST_ASSERT_EQUAL_INT(ERR_IN_USE, close_pool(&pool));
+
+	/* Readers cannot write */
+	query.connection = readers[0];
+	query.query = "DELETE FROM test;";
+	TEST_ASSERT_NOT_EQUAL(ERR_OK, execute_query(&query, NULL));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkin(&pool, readers[0]));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkin(&pool, readers[1]));
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, checkin(&pool, readers[1]));
+	TEST_ASSERT_EQUAL_INT(ERR_INVALID, checkin(&pool, &db));
+
+	/* Readers see committed rows while the writer holds an open transaction */
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkout_writer(&pool, &writer));
+	query.connection = writer;
+	query.query = "BEGIN TRANSACTION;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	query.query = "DELETE FROM test;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+
+	for (i = 0; i < 4; ++i) {
+		TEST_ASSERT_EQUAL_INT(0,
+			pthread_create(&threads[i], NULL, count_rows_on_reader, &pool));
+	}
+
+	for (i = 0; i < 4; ++i) {
+		TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], &num_rows));
+		TEST_ASSERT_EQUAL_INT(3, (intptr_t)num_rows);
+	}
+
+	query.query = "END TRANSACTION;";
+	TEST_ASSERT_EQUAL_INT(ERR_OK, execute_query(&query, NULL));
+	TEST_ASSERT_EQUAL_INT(ERR_OK, checkin(&pool, writer));
+
+	TEST_ASSERT_EQUAL_INT(0, (intptr_t)count_rows_on_reader(&pool));
+
+	TEST_ASSERT_EQUAL_INT(ERR_OK, close_pool(&pool));
+}
+
 int main() {
 	UNITY_BEGIN();
 
@@ -259,8 +825,18 @@ int main() {
 	RUN_TEST(test_open_db_with_invalid_arguments);
 	RUN_TEST(test_execute_with_invalid_query);
 	RUN_TEST(test_execute_with_results);
+	RUN_TEST(test_statement_cache);
+	RUN_TEST(test_execute_with_many_results);
+	RUN_TEST(test_execute_columnar_query);
+	RUN_TEST(test_cursor);
+	RUN_TEST(test_positional_params);
+	RUN_TEST(test_int64_values);
 	RUN_TEST(test_queries_with_invalid_params);
 	RUN_TEST(test_table_queries);
+	RUN_TEST(test_query_stats);
+	RUN_TEST(test_db_options);
+	RUN_TEST(test_busy_handler);
+	RUN_TEST(test_pool);
 
 	return suiteTearDown(UNITY_END());
 }
@@ -24,12 +24,18 @@
 #define SELECT_ROW_WITH_ID \
 	"SELECT * FROM test WHERE id=$id_param;"
 
+#define SELECT_ALL_ROWS \
+	"SELECT * FROM test ORDER BY id;"
+
 #define SELECT_ALL_TEXT \
 	"SELECT text_val FROM test;"
 
 #define SELECT_ROW_WITH_TEXT \
 	"SELECT * FROM test WHERE text_val='$text_param';"
 
+#define SELECT_ROW_WITH_SEMICOLON_TEXT \
+	"SELECT * FROM test WHERE text_val='odd;row';"
+
 #define SELECT_INT_FROM_ROW_WITH_ID \
 	"SELECT int_val FROM test WHERE id=$id_param;"
 